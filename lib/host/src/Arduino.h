@@ -0,0 +1,134 @@
+/***********************************************************************
+ * Filename: Arduino.h
+ * Author: Pavel Kejik
+ * Date: 2024-04-12
+ * Description:
+ *     Host stand-in of the Arduino-ESP32 core for the native test
+ *     build. Provides only what the radio, FEC, motion and parameter
+ *     code uses: timing, String, Serial, IPAddress and the
+ *     attributes placing data in RTC memory.
+ *
+ ***********************************************************************/
+
+#pragma once
+#include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/time.h>
+#include <algorithm>
+#include <string>
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include "freertos/queue.h"
+#include "freertos/task.h"
+
+using std::max;
+using std::min;
+
+#define HIGH 0x1
+#define LOW 0x0
+#define INPUT 0x01
+#define OUTPUT 0x03
+
+#define RTC_DATA_ATTR
+#define RTC_NOINIT_ATTR
+#define IRAM_ATTR
+#define ARDUINO_RUNNING_CORE 1
+
+#define constrain(amt, low, high) ((amt) < (low) ? (low) : ((amt) > (high) ? (high) : (amt)))
+
+typedef int esp_err_t;
+#define ESP_OK 0
+#define ESP_FAIL -1
+
+class String
+{
+private:
+    std::string str;
+
+public:
+    String(void) {}
+    String(const char *cstr) : str(cstr != NULL ? cstr : "") {}
+    String(const std::string &s) : str(s) {}
+    explicit String(char c) : str(1, c) {}
+    String(int value) : str(std::to_string(value)) {}
+    String(unsigned int value) : str(std::to_string(value)) {}
+    String(long value) : str(std::to_string(value)) {}
+    String(unsigned long value) : str(std::to_string(value)) {}
+
+    const char *c_str(void) const { return str.c_str(); }
+    unsigned int length(void) const { return str.length(); }
+    char charAt(unsigned int idx) const { return idx < str.length() ? str[idx] : 0; }
+    void clear(void) { str.clear(); }
+    void reserve(unsigned int size) { str.reserve(size); }
+    long toInt(void) const { return strtol(str.c_str(), NULL, 10); }
+    int compareTo(const String &other) const { return str.compare(other.str); }
+    bool equals(const String &other) const { return str == other.str; }
+    String substring(unsigned int from) const { return from < str.length() ? String(str.substr(from)) : String(); }
+    String substring(unsigned int from, unsigned int to) const { return from < str.length() ? String(str.substr(from, to - from)) : String(); }
+    int indexOf(char c) const { size_t pos = str.find(c); return pos == std::string::npos ? -1 : (int)pos; }
+
+    bool concat(const char *cstr) { str += cstr; return true; }
+    bool concat(char c) { str += c; return true; }
+    String &operator+=(const String &other) { str += other.str; return *this; }
+    String &operator+=(const char *cstr) { str += cstr; return *this; }
+    String &operator+=(char c) { str += c; return *this; }
+    bool operator==(const String &other) const { return str == other.str; }
+    bool operator==(const char *cstr) const { return str == cstr; }
+    bool operator!=(const String &other) const { return str != other.str; }
+    bool operator<(const String &other) const { return str < other.str; }
+    friend String operator+(const String &a, const String &b) { return String(a.str + b.str); }
+};
+
+class HardwareSerial
+{
+public:
+    void begin(unsigned long baud) {}
+    size_t print(const char *str) { return fputs(str, stdout) >= 0 ? strlen(str) : 0; }
+    size_t print(const String &str) { return print(str.c_str()); }
+    size_t println(void) { return print("\n"); }
+    size_t println(const char *str) { return print(str) + println(); }
+    size_t println(const String &str) { return println(str.c_str()); }
+    int printf(const char *format, ...) __attribute__((format(printf, 2, 3)));
+};
+
+extern HardwareSerial Serial;
+
+class IPAddress
+{
+private:
+    uint8_t bytes[4];
+
+public:
+    IPAddress(void) { memset(bytes, 0, sizeof(bytes)); }
+    IPAddress(uint32_t address) { memcpy(bytes, &address, sizeof(bytes)); }
+    operator uint32_t(void) const { uint32_t address; memcpy(&address, bytes, sizeof(address)); return address; }
+    bool fromString(const String &address);
+    String toString(void) const;
+};
+
+class EspClass
+{
+public:
+    void restart(void);
+};
+
+extern EspClass ESP;
+
+unsigned long millis(void);
+unsigned long micros(void);
+void delay(uint32_t ms);
+void delayMicroseconds(uint32_t us);
+uint32_t esp_random(void);
+void randomSeed(unsigned long seed);
+long random(long howbig);
+long random(long howsmall, long howbig);
+void pinMode(uint8_t pin, uint8_t mode);
+void digitalWrite(uint8_t pin, uint8_t val);
+int digitalRead(uint8_t pin);
+int getArduinoLoopTaskStackSize(void);
+bool psramFound(void);
+void *ps_malloc(size_t size);
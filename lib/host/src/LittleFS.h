@@ -0,0 +1,39 @@
+/***********************************************************************
+ * Filename: LittleFS.h
+ * Author: Pavel Kejik
+ * Date: 2024-04-12
+ * Description:
+ *     Host stand-in of the LittleFS file system, it holds no files.
+ *
+ ***********************************************************************/
+
+#pragma once
+#include "Arduino.h"
+
+namespace fs
+{
+    class File
+    {
+    public:
+        operator bool(void) const { return false; }
+        size_t size(void) { return 0; }
+        int available(void) { return 0; }
+        size_t readBytes(char *buffer, size_t length) { return 0; }
+        size_t write(const uint8_t *buf, size_t size) { return 0; }
+        bool seek(uint32_t pos) { return false; }
+        size_t position(void) { return 0; }
+        void close(void) {}
+    };
+
+    class LittleFSFS
+    {
+    public:
+        bool begin(bool formatOnFail = false, const char *basePath = "/littlefs", uint8_t maxOpenFiles = 10) { return true; }
+        void end(void) {}
+        File open(const char *path, const char *mode = "r", bool create = false) { return File(); }
+        bool exists(const char *path) { return false; }
+        bool remove(const char *path) { return false; }
+    };
+}
+
+using fs::File;
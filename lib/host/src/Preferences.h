@@ -0,0 +1,30 @@
+/***********************************************************************
+ * Filename: Preferences.h
+ * Author: Pavel Kejik
+ * Date: 2024-04-12
+ * Description:
+ *     Host stand-in of the NVS backed Preferences, values are kept in
+ *     memory for the life of the process.
+ *
+ ***********************************************************************/
+
+#pragma once
+#include "Arduino.h"
+
+class Preferences
+{
+public:
+    bool begin(const char *name, bool readOnly = false);
+    void end(void);
+    bool isKey(const char *key);
+    size_t putShort(const char *key, int16_t value);
+    int16_t getShort(const char *key, int16_t defaultValue = 0);
+    size_t putUShort(const char *key, uint16_t value);
+    uint16_t getUShort(const char *key, uint16_t defaultValue = 0);
+    size_t putLong(const char *key, int32_t value);
+    int32_t getLong(const char *key, int32_t defaultValue = 0);
+    size_t putString(const char *key, const String &value);
+    String getString(const char *key, const String defaultValue = String());
+    size_t putBytes(const char *key, const void *value, size_t len);
+    size_t getBytes(const char *key, void *buf, size_t maxLen);
+};
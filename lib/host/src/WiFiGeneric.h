@@ -0,0 +1,27 @@
+/***********************************************************************
+ * Filename: WiFiGeneric.h
+ * Author: Pavel Kejik
+ * Date: 2024-04-12
+ * Description:
+ *     Host stand-in of the TX power levels of the Arduino Wi-Fi core.
+ *
+ ***********************************************************************/
+
+#pragma once
+#include "esp_wifi.h"
+
+typedef enum
+{
+    WIFI_POWER_19_5dBm = 78,
+    WIFI_POWER_19dBm = 76,
+    WIFI_POWER_18_5dBm = 74,
+    WIFI_POWER_17dBm = 68,
+    WIFI_POWER_15dBm = 60,
+    WIFI_POWER_13dBm = 52,
+    WIFI_POWER_11dBm = 44,
+    WIFI_POWER_8_5dBm = 34,
+    WIFI_POWER_7dBm = 28,
+    WIFI_POWER_5dBm = 20,
+    WIFI_POWER_2dBm = 8,
+    WIFI_POWER_MINUS_1dBm = -4,
+} wifi_power_t;
@@ -0,0 +1,31 @@
+/***********************************************************************
+ * Filename: esp_camera.h
+ * Author: Pavel Kejik
+ * Date: 2024-04-12
+ * Description:
+ *     Host stand-in of the camera driver types, there is no sensor
+ *     on the host.
+ *
+ ***********************************************************************/
+
+#pragma once
+#include "Arduino.h"
+
+typedef enum
+{
+    PIXFORMAT_RGB565,
+    PIXFORMAT_YUV422,
+    PIXFORMAT_YUV420,
+    PIXFORMAT_GRAYSCALE,
+    PIXFORMAT_JPEG,
+} pixformat_t;
+
+typedef struct
+{
+    uint8_t *buf;
+    size_t len;
+    size_t width;
+    size_t height;
+    pixformat_t format;
+    struct timeval timestamp;
+} camera_fb_t;
@@ -0,0 +1,19 @@
+/***********************************************************************
+ * Filename: esp_now.h
+ * Author: Pavel Kejik
+ * Date: 2024-04-12
+ * Description:
+ *     Host stand-in of the ESP-NOW types, frames go through SimTransport.
+ *
+ ***********************************************************************/
+
+#pragma once
+#include "esp_wifi.h"
+
+#define ESP_NOW_MAX_DATA_LEN 250
+
+typedef enum
+{
+    ESP_NOW_SEND_SUCCESS = 0,
+    ESP_NOW_SEND_FAIL,
+} esp_now_send_status_t;
@@ -0,0 +1,11 @@
+/***********************************************************************
+ * Filename: semphr.h
+ * Author: Pavel Kejik
+ * Date: 2024-04-12
+ * Description:
+ *     Host stand-in, the whole FreeRTOS API is in FreeRTOS.h.
+ *
+ ***********************************************************************/
+
+#pragma once
+#include "freertos/FreeRTOS.h"
@@ -0,0 +1,534 @@
+/***********************************************************************
+ * Filename: host.cpp
+ * Author: Pavel Kejik
+ * Date: 2024-04-12
+ * Description:
+ *     Implements the host stand-ins of the Arduino core and FreeRTOS.
+ *     Handles are allocated once and never freed, detached task threads
+ *     may still use them while the process exits.
+ *
+ ***********************************************************************/
+
+#include "Arduino.h"
+#include "Preferences.h"
+#include "img_converters.h"
+#include <stdarg.h>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <map>
+#include <mutex>
+#include <random>
+#include <thread>
+#include <vector>
+
+HardwareSerial Serial;
+EspClass ESP;
+
+struct HostQueue
+{
+    std::mutex mutex;
+    std::condition_variable changed;
+    UBaseType_t length;
+    UBaseType_t itemSize;
+    UBaseType_t count;
+    std::deque<std::vector<uint8_t>> items;
+};
+
+struct HostTask
+{
+    std::mutex mutex;
+    std::condition_variable notified;
+    uint32_t notifyValue;
+};
+
+/* Thrown by vTaskDelete(NULL) to leave the task function */
+struct HostTaskExit
+{
+};
+
+static const std::chrono::steady_clock::time_point startTime = std::chrono::steady_clock::now();
+static thread_local HostTask *currentTask = NULL;
+
+static std::recursive_mutex &criticalMutex(void)
+{
+    static std::recursive_mutex *mutex = new std::recursive_mutex();
+    return *mutex;
+}
+
+static std::mt19937 &randomEngine(void)
+{
+    static std::mt19937 *engine = new std::mt19937(1);
+    return *engine;
+}
+
+static std::mutex &randomMutex(void)
+{
+    static std::mutex *mutex = new std::mutex();
+    return *mutex;
+}
+
+/* Waits until ready() holds or the ticks run out, true when it holds */
+template <typename Ready>
+static bool waitFor(std::unique_lock<std::mutex> &lock, std::condition_variable &cv, TickType_t wait, Ready ready)
+{
+    if (wait == portMAX_DELAY)
+    {
+        cv.wait(lock, ready);
+        return true;
+    }
+    return cv.wait_for(lock, std::chrono::milliseconds(wait), ready);
+}
+
+unsigned long millis(void)
+{
+    return std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - startTime).count();
+}
+
+unsigned long micros(void)
+{
+    return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - startTime).count();
+}
+
+void delay(uint32_t ms)
+{
+    std::this_thread::sleep_for(std::chrono::milliseconds(ms));
+}
+
+void delayMicroseconds(uint32_t us)
+{
+    std::this_thread::sleep_for(std::chrono::microseconds(us));
+}
+
+/* Seeded with a constant so a test run can be repeated */
+uint32_t esp_random(void)
+{
+    std::lock_guard<std::mutex> lock(randomMutex());
+    return randomEngine()();
+}
+
+void randomSeed(unsigned long seed)
+{
+    std::lock_guard<std::mutex> lock(randomMutex());
+    randomEngine().seed(seed);
+}
+
+long random(long howbig)
+{
+    return (howbig > 0) ? esp_random() % howbig : 0;
+}
+
+long random(long howsmall, long howbig)
+{
+    return (howbig > howsmall) ? howsmall + random(howbig - howsmall) : howsmall;
+}
+
+void pinMode(uint8_t pin, uint8_t mode)
+{
+}
+
+void digitalWrite(uint8_t pin, uint8_t val)
+{
+}
+
+int digitalRead(uint8_t pin)
+{
+    return LOW;
+}
+
+int getArduinoLoopTaskStackSize(void)
+{
+    return 8192;
+}
+
+bool psramFound(void)
+{
+    return false;
+}
+
+void *ps_malloc(size_t size)
+{
+    return malloc(size);
+}
+
+bool jpg2rgb565(const uint8_t *src, size_t src_len, uint8_t *out, jpg_scale_t scale)
+{
+    return false;
+}
+
+int HardwareSerial::printf(const char *format, ...)
+{
+    va_list args;
+    va_start(args, format);
+    int len = vprintf(format, args);
+    va_end(args);
+    return len;
+}
+
+bool IPAddress::fromString(const String &address)
+{
+    unsigned int b[4];
+    char tail;
+    if (sscanf(address.c_str(), "%u.%u.%u.%u%c", &b[0], &b[1], &b[2], &b[3], &tail) != 4)
+    {
+        return false;
+    }
+    for (int i = 0; i < 4; i++)
+    {
+        if (b[i] > 255)
+        {
+            return false;
+        }
+        bytes[i] = b[i];
+    }
+    return true;
+}
+
+String IPAddress::toString(void) const
+{
+    char str[16];
+    snprintf(str, sizeof(str), "%u.%u.%u.%u", bytes[0], bytes[1], bytes[2], bytes[3]);
+    return String(str);
+}
+
+void EspClass::restart(void)
+{
+    exit(0);
+}
+
+void hostEnterCritical(void)
+{
+    criticalMutex().lock();
+}
+
+void hostExitCritical(void)
+{
+    criticalMutex().unlock();
+}
+
+QueueHandle_t xQueueCreate(UBaseType_t length, UBaseType_t itemSize)
+{
+    HostQueue *queue = new HostQueue();
+    queue->length = length;
+    queue->itemSize = itemSize;
+    queue->count = 0;
+    return queue;
+}
+
+void vQueueDelete(QueueHandle_t queue)
+{
+}
+
+static BaseType_t queueSend(QueueHandle_t queue, const void *item, TickType_t wait, bool front)
+{
+    std::unique_lock<std::mutex> lock(queue->mutex);
+    if (!waitFor(lock, queue->changed, wait, [queue]
+                 { return queue->count < queue->length; }))
+    {
+        return errQUEUE_FULL;
+    }
+    if (queue->itemSize > 0)
+    {
+        std::vector<uint8_t> copy((const uint8_t *)item, (const uint8_t *)item + queue->itemSize);
+        if (front)
+        {
+            queue->items.push_front(copy);
+        }
+        else
+        {
+            queue->items.push_back(copy);
+        }
+    }
+    queue->count++;
+    queue->changed.notify_all();
+    return pdPASS;
+}
+
+static BaseType_t queueReceive(QueueHandle_t queue, void *item, TickType_t wait, bool remove)
+{
+    std::unique_lock<std::mutex> lock(queue->mutex);
+    if (!waitFor(lock, queue->changed, wait, [queue]
+                 { return queue->count > 0; }))
+    {
+        return pdFALSE;
+    }
+    if (queue->itemSize > 0)
+    {
+        memcpy(item, queue->items.front().data(), queue->itemSize);
+        if (remove)
+        {
+            queue->items.pop_front();
+        }
+    }
+    if (remove)
+    {
+        queue->count--;
+        queue->changed.notify_all();
+    }
+    return pdPASS;
+}
+
+BaseType_t xQueueSendToBack(QueueHandle_t queue, const void *item, TickType_t wait)
+{
+    return queueSend(queue, item, wait, false);
+}
+
+BaseType_t xQueueSendToFront(QueueHandle_t queue, const void *item, TickType_t wait)
+{
+    return queueSend(queue, item, wait, true);
+}
+
+BaseType_t xQueueReceive(QueueHandle_t queue, void *item, TickType_t wait)
+{
+    return queueReceive(queue, item, wait, true);
+}
+
+BaseType_t xQueuePeek(QueueHandle_t queue, void *item, TickType_t wait)
+{
+    return queueReceive(queue, item, wait, false);
+}
+
+BaseType_t xQueueOverwrite(QueueHandle_t queue, const void *item)
+{
+    {
+        std::lock_guard<std::mutex> lock(queue->mutex);
+        queue->items.clear();
+        queue->count = 0;
+    }
+    return queueSend(queue, item, 0, false);
+}
+
+BaseType_t xQueueReset(QueueHandle_t queue)
+{
+    std::lock_guard<std::mutex> lock(queue->mutex);
+    queue->items.clear();
+    queue->count = 0;
+    queue->changed.notify_all();
+    return pdPASS;
+}
+
+UBaseType_t uxQueueMessagesWaiting(QueueHandle_t queue)
+{
+    std::lock_guard<std::mutex> lock(queue->mutex);
+    return queue->count;
+}
+
+UBaseType_t uxQueueSpacesAvailable(QueueHandle_t queue)
+{
+    std::lock_guard<std::mutex> lock(queue->mutex);
+    return queue->length - queue->count;
+}
+
+SemaphoreHandle_t xSemaphoreCreateBinary(void)
+{
+    return xQueueCreate(1, 0);
+}
+
+SemaphoreHandle_t xSemaphoreCreateMutex(void)
+{
+    SemaphoreHandle_t semaphore = xQueueCreate(1, 0);
+    semaphore->count = 1;
+    return semaphore;
+}
+
+SemaphoreHandle_t xSemaphoreCreateCounting(UBaseType_t maxCount, UBaseType_t initialCount)
+{
+    SemaphoreHandle_t semaphore = xQueueCreate(maxCount, 0);
+    semaphore->count = initialCount;
+    return semaphore;
+}
+
+BaseType_t xSemaphoreTake(SemaphoreHandle_t semaphore, TickType_t wait)
+{
+    return queueReceive(semaphore, NULL, wait, true);
+}
+
+BaseType_t xSemaphoreGive(SemaphoreHandle_t semaphore)
+{
+    return queueSend(semaphore, NULL, 0, false);
+}
+
+UBaseType_t uxSemaphoreGetCount(SemaphoreHandle_t semaphore)
+{
+    return uxQueueMessagesWaiting(semaphore);
+}
+
+BaseType_t xTaskCreateUniversal(TaskFunction_t task, const char *name, uint32_t stackDepth, void *param, UBaseType_t priority, TaskHandle_t *handle, BaseType_t core)
+{
+    HostTask *created = new HostTask();
+    created->notifyValue = 0;
+    if (handle != NULL)
+    {
+        *handle = created;
+    }
+    std::thread([task, param, created]()
+                {
+                    currentTask = created;
+                    try
+                    {
+                        task(param);
+                    }
+                    catch (const HostTaskExit &)
+                    {
+                    } })
+        .detach();
+    return pdPASS;
+}
+
+BaseType_t xTaskCreatePinnedToCore(TaskFunction_t task, const char *name, uint32_t stackDepth, void *param, UBaseType_t priority, TaskHandle_t *handle, BaseType_t core)
+{
+    return xTaskCreateUniversal(task, name, stackDepth, param, priority, handle, core);
+}
+
+BaseType_t xTaskCreate(TaskFunction_t task, const char *name, uint32_t stackDepth, void *param, UBaseType_t priority, TaskHandle_t *handle)
+{
+    return xTaskCreateUniversal(task, name, stackDepth, param, priority, handle, tskNO_AFFINITY);
+}
+
+/* A thread cannot be stopped from outside, only a task deleting itself ends */
+void vTaskDelete(TaskHandle_t task)
+{
+    if (task == NULL || task == currentTask)
+    {
+        throw HostTaskExit();
+    }
+}
+
+void vTaskDelay(TickType_t ticks)
+{
+    if (ticks == 0)
+    {
+        std::this_thread::yield();
+    }
+    else
+    {
+        delay(ticks);
+    }
+}
+
+TickType_t xTaskGetTickCount(void)
+{
+    return millis();
+}
+
+TaskHandle_t xTaskGetCurrentTaskHandle(void)
+{
+    if (currentTask == NULL)
+    {
+        currentTask = new HostTask();
+        currentTask->notifyValue = 0;
+    }
+    return currentTask;
+}
+
+void vTaskSuspendAll(void)
+{
+}
+
+BaseType_t xTaskResumeAll(void)
+{
+    return pdFALSE;
+}
+
+BaseType_t xTaskNotifyGive(TaskHandle_t task)
+{
+    std::lock_guard<std::mutex> lock(task->mutex);
+    task->notifyValue++;
+    task->notified.notify_all();
+    return pdPASS;
+}
+
+uint32_t ulTaskNotifyTake(BaseType_t clearOnExit, TickType_t wait)
+{
+    HostTask *task = xTaskGetCurrentTaskHandle();
+    std::unique_lock<std::mutex> lock(task->mutex);
+    if (!waitFor(lock, task->notified, wait, [task]
+                 { return task->notifyValue > 0; }))
+    {
+        return 0;
+    }
+    uint32_t value = task->notifyValue;
+    task->notifyValue = clearOnExit ? 0 : value - 1;
+    return value;
+}
+
+static std::map<std::string, std::vector<uint8_t>> &preferences(void)
+{
+    static std::map<std::string, std::vector<uint8_t>> *values = new std::map<std::string, std::vector<uint8_t>>();
+    return *values;
+}
+
+bool Preferences::begin(const char *name, bool readOnly)
+{
+    return true;
+}
+
+void Preferences::end(void)
+{
+}
+
+bool Preferences::isKey(const char *key)
+{
+    return preferences().count(key) > 0;
+}
+
+size_t Preferences::putBytes(const char *key, const void *value, size_t len)
+{
+    preferences()[key] = std::vector<uint8_t>((const uint8_t *)value, (const uint8_t *)value + len);
+    return len;
+}
+
+size_t Preferences::getBytes(const char *key, void *buf, size_t maxLen)
+{
+    auto it = preferences().find(key);
+    if (it == preferences().end() || it->second.size() > maxLen)
+    {
+        return 0;
+    }
+    memcpy(buf, it->second.data(), it->second.size());
+    return it->second.size();
+}
+
+size_t Preferences::putShort(const char *key, int16_t value)
+{
+    return putBytes(key, &value, sizeof(value));
+}
+
+int16_t Preferences::getShort(const char *key, int16_t defaultValue)
+{
+    int16_t value;
+    return (getBytes(key, &value, sizeof(value)) == sizeof(value)) ? value : defaultValue;
+}
+
+size_t Preferences::putUShort(const char *key, uint16_t value)
+{
+    return putBytes(key, &value, sizeof(value));
+}
+
+uint16_t Preferences::getUShort(const char *key, uint16_t defaultValue)
+{
+    uint16_t value;
+    return (getBytes(key, &value, sizeof(value)) == sizeof(value)) ? value : defaultValue;
+}
+
+size_t Preferences::putLong(const char *key, int32_t value)
+{
+    return putBytes(key, &value, sizeof(value));
+}
+
+int32_t Preferences::getLong(const char *key, int32_t defaultValue)
+{
+    int32_t value;
+    return (getBytes(key, &value, sizeof(value)) == sizeof(value)) ? value : defaultValue;
+}
+
+size_t Preferences::putString(const char *key, const String &value)
+{
+    return putBytes(key, value.c_str(), value.length() + 1);
+}
+
+String Preferences::getString(const char *key, const String defaultValue)
+{
+    auto it = preferences().find(key);
+    return (it == preferences().end()) ? defaultValue : String((const char *)it->second.data());
+}
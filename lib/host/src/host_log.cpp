@@ -0,0 +1,21 @@
+/***********************************************************************
+ * Filename: host_log.cpp
+ * Author: Pavel Kejik
+ * Date: 2024-04-12
+ * Description:
+ *     Host stand-in of SystemLog::PutLog. The native build has no file
+ *     system, log entries go to the standard output.
+ *
+ ***********************************************************************/
+
+#include "log.h"
+
+void SystemLog::PutLog(const char *msg, Verbosity_t lvl, time_t t)
+{
+    Serial.printf("log %d: %s\n", (int)lvl, msg);
+}
+
+void SystemLog::PutLog(String msg, Verbosity_t lvl, time_t t)
+{
+    PutLog(msg.c_str(), lvl, t);
+}
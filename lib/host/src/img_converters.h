@@ -0,0 +1,21 @@
+/***********************************************************************
+ * Filename: img_converters.h
+ * Author: Pavel Kejik
+ * Date: 2024-04-12
+ * Description:
+ *     Host stand-in of the JPEG decoder, it decodes nothing.
+ *
+ ***********************************************************************/
+
+#pragma once
+#include "Arduino.h"
+
+typedef enum
+{
+    JPG_SCALE_NONE,
+    JPG_SCALE_2X,
+    JPG_SCALE_4X,
+    JPG_SCALE_8X,
+} jpg_scale_t;
+
+bool jpg2rgb565(const uint8_t *src, size_t src_len, uint8_t *out, jpg_scale_t scale);
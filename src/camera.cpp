@@ -15,9 +15,18 @@
 #include "log.h"
 #include "esp_now_client.h"
 #include "deep_sleep_ctrl.h"
+#include "motion.h"
+#include "jpeg_rate.h"
 
-camera_fb_t *Camera::picture = NULL;
 SemaphoreHandle_t Camera::semaphore = xSemaphoreCreateBinary();
+QueueHandle_t Camera::frameQueue = NULL;
+SemaphoreHandle_t Camera::freeFrames = NULL;
+std::atomic<bool> Camera::capturing(false);
+bool Camera::captured = false;
+uint32_t Camera::burstStart = 0;
+RTC_DATA_ATTR SensorExposure_t Camera::exposure;
+bool Camera::exposureRestored = false;
+uint32_t Camera::initAt = 0;
 
 static camera_config_t camera_config = {
     .pin_pwdn = CAM_PIN_PWDN,
@@ -46,16 +55,32 @@ static camera_config_t camera_config = {
     .pixel_format = PIXFORMAT_JPEG, // YUV422,GRAYSCALE,RGB565,JPEG
     .frame_size = FRAMESIZE_SVGA,   // QQVGA-UXGA, For ESP32, do not use sizes above QVGA when not JPEG. The performance of the ESP32-S series has improved a lot, but JPEG mode always gives better frame rates.
 
-    .jpeg_quality = 10, // 0-63, for OV series camera sensors, lower number means higher quality
-    .fb_count = 1,      // When jpeg mode is used, if fb_count more than one, the driver will work in continuous mode.
-    // .grab_mode = CAMERA_GRAB_WHEN_EMPTY,
+    .jpeg_quality = JPEG_QUALITY_DEFAULT, // 0-63, for OV series camera sensors, lower number means higher quality
+    .fb_count = CAMERA_FB_COUNT, // When jpeg mode is used, if fb_count more than one, the driver will work in continuous mode.
+    .fb_location = CAMERA_FB_IN_PSRAM,
+    .grab_mode = CAMERA_GRAB_LATEST,
 };
 
 void Camera::Init()
 {
-    picture = NULL;
     SetTimezone(PopisCasu.Get().c_str());
+    /* Without PSRAM there is room for one frame only, capture and send take turns */
+    if (!psramFound())
+    {
+        camera_config.fb_count = 1;
+        camera_config.fb_location = CAMERA_FB_IN_DRAM;
+        camera_config.grab_mode = CAMERA_GRAB_WHEN_EMPTY;
+    }
+    /* Set before the driver starts, so no frame is taken at the old quality */
+    camera_config.jpeg_quality = JpegRate::Predict(IsDay() ? 0 : 1);
+    KvalitaJpeg.Set(camera_config.jpeg_quality);
+    if (frameQueue == NULL)
+    {
+        frameQueue = xQueueCreate(CAMERA_FB_COUNT, sizeof(CameraFrame_t));
+        freeFrames = xSemaphoreCreateCounting(camera_config.fb_count, camera_config.fb_count);
+    }
     esp_err_t err = esp_camera_init(&camera_config);
+    initAt = millis();
     if (err != ESP_OK)
     {
         Serial.printf("Camera init failed with error 0x%x", err);
@@ -89,6 +114,55 @@ void Camera::Init()
     //    s->set_vflip(s, 0);          // 0 = disable , 1 = enable
     //    s->set_dcw(s, 1);            // 0 = disable , 1 = enable
     //    s->set_colorbar(s, 0);       // 0 = disable , 1 = enable
+    restoreExposure();
+}
+
+bool Camera::useFlash(void)
+{
+    switch (PouzitBlesk.Get())
+    {
+    case automaticky:
+        return !IsDay();
+    case vzdy:
+        return true;
+    default:
+        return false;
+    }
+}
+
+/* AEC and AGC keep running, they only start from the values of the last
+   picture taken at a similar time with the same flash setting. The AWB gains
+   of the OV2640 are not reachable through the driver, AWB starts from scratch. */
+void Camera::restoreExposure(void)
+{
+    sensor_t *s = esp_camera_sensor_get();
+    time_t age = Now() - exposure.savedAt;
+    exposureRestored = false;
+    if (s == NULL || !exposure.valid || exposure.flash != useFlash() || age < 0 || age > EXPOSURE_MAX_AGE_S)
+    {
+        return;
+    }
+    s->set_reg(s, OV2640_REG_REG45, 0x3F, exposure.aec >> 10);
+    s->set_reg(s, OV2640_REG_AEC, 0xFF, (exposure.aec >> 2) & 0xFF);
+    s->set_reg(s, OV2640_REG_REG04, 0x03, exposure.aec & 0x03);
+    s->set_reg(s, OV2640_REG_GAIN, 0xFF, exposure.gain);
+    exposureRestored = true;
+}
+
+void Camera::saveExposure(bool flash)
+{
+    sensor_t *s = esp_camera_sensor_get();
+    if (s == NULL)
+    {
+        return;
+    }
+    exposure.aec = (s->get_reg(s, OV2640_REG_REG45, 0x3F) << 10) |
+                   (s->get_reg(s, OV2640_REG_AEC, 0xFF) << 2) |
+                   s->get_reg(s, OV2640_REG_REG04, 0x03);
+    exposure.gain = s->get_reg(s, OV2640_REG_GAIN, 0xFF);
+    exposure.flash = flash;
+    exposure.savedAt = Now();
+    exposure.valid = true;
 }
 
 bool Camera::IsDay(void)
@@ -149,19 +223,20 @@ void Camera::Task(void)
     {
         active_tasks[Camera_Task] = true;
 
-        if (picture == NULL)
+        if (!captured)
         {
             switch (KonfiguraceSnimani.Get())
             {
+            /* Only a picture requested by PoriditSnimek skips the motion gate */
             case automaticky:
                 if (PoriditSnimek.Get() || IsDay())
                 {
-                    TakePicture();
+                    TakePicture(!PoriditSnimek.Get());
                 }
                 break;
 
             case vzdy:
-                TakePicture();
+                TakePicture(!PoriditSnimek.Get());
                 break;
 
             case nikdy:
@@ -179,89 +254,200 @@ void Camera::Task(void)
     active_tasks[Camera_Task] = false;
 }
 
+/* Sends the frames of the current burst as they come, each goes back to the
+   driver once the receiver confirmed its last chunk */
 bool Camera::SendPictureViaEspNow(const uint8_t *mac_addr)
 {
-    Serial.println("Sending photo");
-    unsigned int count = picture->len;
-
-    size_t cnv_buf_len = picture->len;
-    uint8_t *cnv_buf = picture->buf;
-    // bool isConverted = frame2jpg(picture, 80, &cnv_buf, &cnv_buf_len);
-    // if (!isConverted)
-    // {
-    //     Serial.println("failed to convert");
-    // }
-
-    if (picture == NULL || cnv_buf_len == 0 || cnv_buf == NULL)
-    {
-        return true;
-    }
-    bool sendMessageSuccess = true;
+    CameraFrame_t frame;
+    uint32_t sent = 0;
 
-    ByteStreamPayload payload;
-    memset(&payload, 0, sizeof(payload));
-    payload.max_mr_bytes = cnv_buf_len;
-
-    size_t currentIndex = 0;
-    size_t payload_cap = sizeof(DataPayload::data);
-    size_t payload_size = sizeof(payload) - payload_cap;
-
-    while (currentIndex < cnv_buf_len)
+    Serial.println("Sending photo");
+    while (xQueueReceive(frameQueue, &frame, pdMS_TO_TICKS(capturing ? CAMERA_FRAME_WAIT_MS : 0)) == pdTRUE)
     {
-        memset(&payload.data, 0, sizeof(payload.data));
-        payload.data.index = currentIndex;
-
-        size_t bytesLeft = cnv_buf_len - currentIndex;
-        size_t bytesToCopy = bytesLeft < payload_cap ? bytesLeft : payload_cap;
-
-        memcpy(payload.data.data, cnv_buf + currentIndex, bytesToCopy);
-        payload.data.nmr = bytesToCopy;
-
-        CHECK_SEND_RETURN_IF_FAIL(ESPNowCtrl::SendMessage(mac_addr, MSG_BYTE_STREAM, payload, payload_size + bytesToCopy, 5));
+        bool res = true;
+        if (frame.fb->len > 0 && frame.fb->buf != NULL)
+        {
+            sendThumbnail(mac_addr, frame.fb);
+            uint32_t start = millis();
+            res = ESPNowClient::SendStream(mac_addr, frame.fb->buf, frame.fb->len);
+            if (res)
+            {
+                /* Base of the byte budget of the next wake */
+                RychlostSnimku_Bps.Set((uint64_t)frame.fb->len * 1000 / max((uint32_t)1, (uint32_t)(millis() - start)));
+            }
+        }
+        returnFrame(frame.fb);
+        if (!res)
+        {
+            /* After a cancelled image the rest of the burst is not wanted either */
+            DeletePicture();
+            return ESPNowCtrl::IsCancelled(STREAM_TYPE_IMAGE);
+        }
 
-        currentIndex += bytesToCopy;
+        /* A single shot gives its end-to-end time, a burst the time per frame */
+        sent++;
+        DobaSnimku_ms.Set(min((uint32_t)(millis() - burstStart) / sent, (uint32_t)UINT16_MAX));
+        Serial.printf("Picture sent, %lu ms after capture\n", millis() - frame.takenAt);
     }
-    Serial.println("Picture sent");
 
-    return sendMessageSuccess;
+    return true;
 }
 
-void Camera::TakePicture()
+/* 1/8 scale preview of the frame, decoded straight to the small size and
+   encoded again, so the gateway shows the picture long before the full frame
+   arrives. It also decides whether it wants the full frame at all. */
+void Camera::sendThumbnail(const uint8_t *mac_addr, camera_fb_t *fb)
 {
-    switch (PouzitBlesk.Get())
+    ESPNowCtrl::CancelStreams(STREAM_TYPE_IMAGE, false);
+    if (!(EspNowSchopnosti.Get() & CAP_THUMBNAIL) || PoslatNahled.Get() != povoleno)
     {
-    case automaticky:
+        return;
+    }
+
+    uint32_t start = millis();
+    uint16_t width = (fb->width + 7) / 8;
+    uint16_t height = (fb->height + 7) / 8;
+    size_t rgbLen = width * height * 2;
+    uint8_t *rgb = (uint8_t *)(psramFound() ? ps_malloc(rgbLen) : malloc(rgbLen));
+    uint8_t *jpg = NULL;
+    size_t jpgLen = 0;
+    if (rgb == NULL)
+    {
+        return;
+    }
+    if (jpg2rgb565(fb->buf, fb->len, rgb, JPG_SCALE_8X) &&
+        fmt2jpg(rgb, rgbLen, width, height, PIXFORMAT_RGB565, CAMERA_THUMB_QUALITY, &jpg, &jpgLen))
     {
-        if (!IsDay())
+        if (ESPNowClient::SendStream(mac_addr, jpg, jpgLen, STREAM_TYPE_THUMBNAIL))
         {
-            digitalWrite(FLASH_PIN, HIGH);
-            delay(500);
+            DobaNahledu_ms.Set(min((uint32_t)(millis() - burstStart), (uint32_t)UINT16_MAX));
+            Serial.printf("Thumbnail %zu bytes sent in %lu ms\n", jpgLen, millis() - start);
         }
-        break;
+        free(jpg);
     }
-    case vzdy:
-        digitalWrite(FLASH_PIN, HIGH);
-        delay(500);
+    free(rgb);
+}
 
-        break;
-    case nikdy:
+/* A burst of SnimkuVDavce frames, the first one goes out while the rest are captured.
+   A gated burst is dropped when its first frame shows no change since the last wake. */
+void Camera::TakePicture(bool gated)
+{
+    uint16_t burst = max((uint16_t)1, (uint16_t)SnimkuVDavce.Get());
+    captured = true;
+    capturing = true;
+    burstStart = millis();
+
+    bool flash = useFlash();
+    if (flash)
+    {
+        digitalWrite(FLASH_PIN, HIGH);
+        delay(CAMERA_FLASH_ON_MS);
+    }
+    else
+    {
         digitalWrite(FLASH_PIN, LOW);
-        break;
-    default:
-        break;
+    }
+    /* The driver captures from its init on, wait until the exposure settled */
+    uint32_t settle = exposureRestored ? CAMERA_SETTLE_MS : CAMERA_WARMUP_MS;
+    if (millis() - initAt < settle)
+    {
+        delay(settle - (millis() - initAt));
     }
 
-    picture = esp_camera_fb_get();
+    for (uint16_t i = 0; i < burst; i++)
+    {
+        bool stale = (i == 0);
+        /* Waits until the sender returned a buffer to the driver, the flash
+           does not stay on for the whole transfer */
+        if (xSemaphoreTake(freeFrames, 0) != pdTRUE)
+        {
+            digitalWrite(FLASH_PIN, LOW);
+            if (xSemaphoreTake(freeFrames, pdMS_TO_TICKS(CAMERA_FRAME_WAIT_MS)) != pdTRUE)
+            {
+                break;
+            }
+            if (flash)
+            {
+                digitalWrite(FLASH_PIN, HIGH);
+                delay(CAMERA_FLASH_ON_MS);
+                stale = true;
+            }
+        }
+        /* The receiver cancelled an image of this burst, it wants none of the rest */
+        if (i > 0 && ESPNowCtrl::IsCancelled(STREAM_TYPE_IMAGE))
+        {
+            xSemaphoreGive(freeFrames);
+            Serial.println("Burst cancelled by receiver");
+            break;
+        }
+        if (stale)
+        {
+            discardStaleFrame();
+        }
+        CameraFrame_t frame;
+        frame.takenAt = millis();
+        frame.fb = esp_camera_fb_get();
+        if (frame.fb == NULL)
+        {
+            xSemaphoreGive(freeFrames);
+            SystemLog::PutLog("Chyba snimani", v_error);
+            break;
+        }
+        if (i == 0)
+        {
+            ProbuzeniKSnimku_ms.Set(min((uint32_t)millis(), (uint32_t)UINT16_MAX));
+            saveExposure(flash);
+            JpegRate::Update(IsDay() ? 0 : 1, camera_config.jpeg_quality, frame.fb->len);
+        }
+        if (i == 0 && gated && !MotionGate::Check(frame.fb))
+        {
+            returnFrame(frame.fb);
+            Serial.println("No motion, picture dropped");
+            break;
+        }
+        /* The sender may return the frame as soon as it is queued */
+        Serial.printf("Picture taken! Its size was: %zu bytes\n", frame.fb->len);
+        xQueueSendToBack(frameQueue, &frame, 0);
+        if (i == 0)
+        {
+            ESPNowClient::SendPhoto();
+        }
+    }
 
     digitalWrite(FLASH_PIN, LOW);
+    capturing = false;
+}
+
+void Camera::returnFrame(camera_fb_t *fb)
+{
+    esp_camera_fb_return(fb);
+    xSemaphoreGive(freeFrames);
+}
 
-    Serial.printf("Picture taken! Its size was: %zu bytes\n", picture->len);
-    ESPNowClient::SendPhoto();
+/* Without PSRAM the single buffer is filled as soon as it is empty, so it holds
+   a frame from before the settle wait or without the flash. The frame is thrown
+   away and the next fb_get captures a fresh one. */
+void Camera::discardStaleFrame(void)
+{
+    if (camera_config.grab_mode != CAMERA_GRAB_WHEN_EMPTY)
+    {
+        return;
+    }
+    camera_fb_t *fb = esp_camera_fb_get();
+    if (fb != NULL)
+    {
+        esp_camera_fb_return(fb);
+    }
 }
 
+/* Returns frames that will not be sent to the driver */
 void Camera::DeletePicture()
 {
-    esp_camera_fb_return(picture);
+    CameraFrame_t frame;
+    while (xQueueReceive(frameQueue, &frame, 0) == pdTRUE)
+    {
+        returnFrame(frame.fb);
+    }
 }
 
 void Camera::Wake(void)
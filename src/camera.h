@@ -13,17 +13,65 @@
 
 #include "Arduino.h"
 #include "esp_camera.h"
+#include "freertos/queue.h"
+#include <atomic>
 
+#define CAMERA_FB_COUNT 2
+#define CAMERA_FRAME_WAIT_MS 3000
+#define CAMERA_THUMB_QUALITY 40 /* fmt2jpg quality, 0-100 */
+#define CAMERA_WARMUP_MS 1500     /* AEC/AGC convergence from the driver defaults */
+#define CAMERA_SETTLE_MS 200      /* Same, starting from the cached exposure */
+#define CAMERA_FLASH_ON_MS 500    /* Flash up to full light before a frame */
+#define EXPOSURE_MAX_AGE_S 3600   /* Older exposure is no good guess of the light */
+
+/* OV2640 sensor bank registers, bit 8 selects the bank in get_reg/set_reg */
+#define OV2640_REG_GAIN 0x100
+#define OV2640_REG_REG04 0x104
+#define OV2640_REG_AEC 0x110
+#define OV2640_REG_REG45 0x145
+
+typedef struct
+{
+    camera_fb_t *fb;
+    uint32_t takenAt;
+} CameraFrame_t;
+
+/* Converged exposure of the last picture, kept over deep sleep */
+typedef struct
+{
+    time_t savedAt;
+    uint16_t aec;
+    uint8_t gain;
+    bool flash;
+    bool valid;
+} SensorExposure_t;
+
+/* With PSRAM the driver captures into the second frame buffer while the first
+   one is being sent, captured frames go to ESPNowClient through frameQueue. */
 class Camera
 {
 private:
     static SemaphoreHandle_t semaphore;
+    static QueueHandle_t frameQueue;
+    static SemaphoreHandle_t freeFrames;
+    static std::atomic<bool> capturing;
+    static bool captured;
+    static uint32_t burstStart;
+    static SensorExposure_t exposure;
+    static bool exposureRestored;
+    static uint32_t initAt;
 
-public:
-    static camera_fb_t *picture;
+    static bool useFlash(void);
+    static void saveExposure(bool flash);
+    static void restoreExposure(void);
 
+    static void returnFrame(camera_fb_t *fb);
+    static void discardStaleFrame(void);
+    static void sendThumbnail(const uint8_t *mac_addr, camera_fb_t *fb);
+
+public:
     static void Init();
-    static void TakePicture();
+    static void TakePicture(bool gated = false);
     static void DeletePicture();
     static bool SendPictureViaEspNow(const uint8_t *mac_addr);
     static void Task(void);
@@ -0,0 +1,58 @@
+/***********************************************************************
+ * Filename: channel_scan.cpp
+ * Author: Pavel Kejik
+ * Date: 2024-04-12
+ * Description:
+ *     Implements ChannelScan.
+ *
+ ***********************************************************************/
+
+#include "channel_scan.h"
+
+RTC_DATA_ATTR uint8_t ChannelScan::channelScore[MAX_CHANNEL + 1];
+RTC_DATA_ATTR int32_t ChannelScan::pairRtt_us = 0;
+
+uint8_t ChannelScan::Order(uint8_t lastChannel, uint8_t *order)
+{
+    uint8_t nmr = 0;
+    if (lastChannel >= 1 && lastChannel <= MAX_CHANNEL)
+    {
+        order[nmr++] = lastChannel;
+    }
+    for (int score = UINT8_MAX; score >= 0; score--)
+    {
+        for (uint8_t channel = 1; channel <= MAX_CHANNEL; channel++)
+        {
+            if (channel != lastChannel && channelScore[channel] == score)
+            {
+                order[nmr++] = channel;
+            }
+        }
+    }
+    return nmr;
+}
+
+uint32_t ChannelScan::ProbeTimeout(void)
+{
+    if (pairRtt_us <= 0)
+    {
+        return PAIR_PROBE_MAX_MS;
+    }
+    return constrain((uint32_t)(4 * pairRtt_us / 1000), PAIR_PROBE_MIN_MS, PAIR_PROBE_MAX_MS);
+}
+
+void ChannelScan::Paired(uint8_t channel, int32_t rtt_us)
+{
+    for (uint8_t i = 1; i <= MAX_CHANNEL; i++)
+    {
+        channelScore[i] -= channelScore[i] / 4;
+    }
+    channelScore[channel] = min(UINT8_MAX, channelScore[channel] + CHANNEL_SCORE_HIT);
+    pairRtt_us = (pairRtt_us <= 0) ? rtt_us : (pairRtt_us * 7 + rtt_us) / 8;
+}
+
+void ChannelScan::Clear(void)
+{
+    memset(channelScore, 0, sizeof(channelScore));
+    pairRtt_us = 0;
+}
@@ -0,0 +1,39 @@
+/***********************************************************************
+ * Filename: channel_scan.h
+ * Author: Pavel Kejik
+ * Date: 2024-04-12
+ * Description:
+ *     Declares ChannelScan, the pairing scan history. Every channel has
+ *     a score raised when the gateway answered on it and decayed with
+ *     every pairing, the scan tries the channels by score. Probes wait
+ *     a few round trips of the recent pairings. The history is kept in
+ *     RTC memory.
+ *
+ ***********************************************************************/
+
+#pragma once
+#include "Arduino.h"
+#include "esp_now_ctrl.h"
+
+#define PAIR_PROBE_MIN_MS 20
+#define PAIR_PROBE_MAX_MS 200
+#define CHANNEL_SCORE_HIT 64
+
+class ChannelScan
+{
+private:
+    static uint8_t channelScore[MAX_CHANNEL + 1];
+    static int32_t pairRtt_us;
+
+public:
+    /* Last good channel first, then channels that worked recently, then the rest */
+    static uint8_t Order(uint8_t lastChannel, uint8_t *order);
+
+    /* A probe waits a few round trips of the last pairing, not a fixed time */
+    static uint32_t ProbeTimeout(void);
+
+    static void Paired(uint8_t channel, int32_t rtt_us);
+
+    /* Forgets the history, the next scan waits the full probe time again */
+    static void Clear(void);
+};
@@ -13,4 +13,11 @@ std::mutex ESPNowClient::mutex;
 bool ESPNowClient::isUpdating = false;
 uint32_t ESPNowClient::startUpdateTime;
 bool ESPNowClient::param_defs_send = false;
-bool ESPNowClient::picture_send = false;
\ No newline at end of file
+bool ESPNowClient::picture_send = false;
+QueueHandle_t ESPNowClient::resumeQueue = NULL;
+SemaphoreHandle_t ESPNowClient::pairSignal = xSemaphoreCreateBinary();
+SemaphoreHandle_t ESPNowClient::wakeReplySignal = xSemaphoreCreateBinary();
+RTC_DATA_ATTR bool ESPNowClient::wakeReportSupported = true;
+RTC_DATA_ATTR uint8_t ESPNowClient::wakeReportMisses = 0;
+bool ESPNowClient::sleepAnnounced = false;
+uint32_t ESPNowClient::sleepTime = 0;
\ No newline at end of file
@@ -19,10 +19,18 @@
 #include <Update.h>
 #include "deep_sleep_ctrl.h"
 #include "camera.h"
+#include "channel_scan.h"
 
 #define COMMUNICATION_ATTEMPTS 2
 #define DEVICE_TYPE DEVICE_TYPE_CAMERA
 #define UPDATE_TIMEOUT_S 100
+#define STREAM_RESUME_ATTEMPTS 3
+#define STREAM_RESUME_TIMEOUT_MS 300
+#define WAKE_REPLY_TIMEOUT_MS 300
+#define WAKE_REPORT_MAX_MISSES 3
+#define SLOT_WAKE_LEAD_MS 300
+#define SLOT_MIN_SLEEP_MS 1000
+#define TIME_VALID_EPOCH 1704067200
 
 #define CHECK_SEND(functionCall, resultVar)          \
     do                                               \
@@ -90,6 +98,13 @@
         }                                 \
     }
 
+typedef struct
+{
+    uint8_t tag;
+    size_t len;
+    size_t offset;
+} StreamTransfer_t;
+
 class ESPNowClient
 {
 private:
@@ -100,9 +115,33 @@ private:
     static uint32_t startUpdateTime;
     static bool param_defs_send;
     static bool picture_send;
+    static QueueHandle_t resumeQueue;
+    static SemaphoreHandle_t pairSignal;
+    static SemaphoreHandle_t wakeReplySignal;
+    static bool wakeReportSupported;
+    static uint8_t wakeReportMisses;
+    static bool sleepAnnounced;
+    static uint32_t sleepTime;
+
+    static void fillParamDef(pardef_t_espnow &def, const Register *reg)
+    {
+        def.adr = reg->def.adr;
+        def.min = reg->def.min;
+        def.max = reg->def.max;
+        def.dsc = reg->def.dsc;
+        def.flags = reg->def.atr;
+        strncpy(def.ptxt, reg->def.ptxt, sizeof(def.ptxt) - 1);
+        def.ptxt[sizeof(def.ptxt) - 1] = '\0';
+    }
 
+    /* With CAP_STREAM_MUX the definitions go as one stream of pardef_t_espnow
+       records next to the other streams, otherwise MAX_PARAM_DEFS per message */
     static bool sendParamDefs(const uint8_t *mac_addr)
     {
+        if (EspNowSchopnosti.Get() & CAP_STREAM_MUX)
+        {
+            return sendParamDefStream(mac_addr);
+        }
         ParamDefsPayload payload;
         uint8_t parIdx = 0;
         bool res = true;
@@ -111,13 +150,7 @@ private:
             Register *reg = Register::GetParByIdx(i);
             if (reg && (reg->def.dsc & Par_ESPNow))
             {
-                payload.params[parIdx].adr = reg->def.adr;
-                payload.params[parIdx].min = reg->def.min;
-                payload.params[parIdx].max = reg->def.max;
-                payload.params[parIdx].dsc = reg->def.dsc;
-                payload.params[parIdx].flags = reg->def.atr;
-                strncpy(payload.params[parIdx].ptxt, reg->def.ptxt, sizeof(payload.params[parIdx].ptxt) - 1);
-                payload.params[parIdx].ptxt[sizeof(payload.params[parIdx].ptxt) - 1] = '\0';
+                fillParamDef(payload.params[parIdx], reg);
                 parIdx++;
                 payload.numParams = parIdx;
                 if (parIdx >= MAX_PARAM_DEFS)
@@ -136,11 +169,32 @@ private:
         return res;
     }
 
-    static bool sendParamValues(const uint8_t *mac_addr)
+    static bool sendParamDefStream(const uint8_t *mac_addr)
     {
-        ReadRequestPayload payload;
-        uint16_t regFirst = UINT16_MAX;
-        uint16_t regLast = 0;
+        pardef_t_espnow *defs = (pardef_t_espnow *)malloc(sizeof(pardef_t_espnow) * Register::NmrParameters);
+        if (defs == NULL)
+        {
+            return false;
+        }
+        size_t nmr = 0;
+        for (int i = 0; i < Register::NmrParameters; i++)
+        {
+            Register *reg = Register::GetParByIdx(i);
+            if (reg && (reg->def.dsc & Par_ESPNow))
+            {
+                fillParamDef(defs[nmr++], reg);
+            }
+        }
+        bool res = (nmr == 0) || SendStream(mac_addr, (const uint8_t *)defs, sizeof(pardef_t_espnow) * nmr, STREAM_TYPE_PARAM_DEFS);
+        free(defs);
+        return res;
+    }
+
+    /* Address range covering all registers shared over ESP-Now */
+    static bool espNowRegRange(uint16_t &regFirst, uint16_t &regLast)
+    {
+        regFirst = UINT16_MAX;
+        regLast = 0;
         for (int i = 0; i < Register::NmrParameters; i++)
         {
             Register *reg = Register::GetParByIdx(i);
@@ -156,7 +210,15 @@ private:
                 }
             }
         }
-        if (regFirst != UINT16_MAX)
+        return regFirst != UINT16_MAX;
+    }
+
+    static bool sendParamValues(const uint8_t *mac_addr)
+    {
+        ReadRequestPayload payload;
+        uint16_t regFirst;
+        uint16_t regLast;
+        if (espNowRegRange(regFirst, regLast))
         {
             payload.regAddr = regFirst;
             payload.nmr = regLast - regFirst;
@@ -208,13 +270,42 @@ private:
         }
     }
 
-    static bool pairResponseHandler(const uint8_t *mac_addr, const PairResponsePayload *payload)
+    /* Frame size and capabilities both sides support, a legacy response has neither */
+    static void storePairCapabilities(const PairResponsePayload *payload, uint16_t payloadSize)
+    {
+        uint16_t maxPayload = MAX_PAYLOAD_SIZE;
+        uint8_t capabilities = 0;
+        if (payloadSize >= sizeof(PairResponsePayload))
+        {
+            maxPayload = constrain(payload->maxPayload, MAX_PAYLOAD_SIZE, MAX_FRAME_PAYLOAD_SIZE);
+            capabilities = payload->capabilities & localCapabilities();
+        }
+        if (!(capabilities & CAP_LARGE_FRAMES))
+        {
+            maxPayload = MAX_PAYLOAD_SIZE;
+        }
+        EspNowMaxDelkaRamce.Set(maxPayload);
+        EspNowSchopnosti.Set(capabilities);
+    }
+
+    static uint8_t localCapabilities(void)
+    {
+        return ((MAX_FRAME_PAYLOAD_SIZE > MAX_PAYLOAD_SIZE) ? CAP_LARGE_FRAMES : 0) | CAP_FEC | CAP_SEQUENCE | CAP_STREAM_MUX | CAP_SLOTS | CAP_THUMBNAIL | CAP_STREAM_ACK;
+    }
+
+    static bool pairResponseHandler(const uint8_t *mac_addr, const Message *msg, int len)
     {
+        const PairResponsePayload *payload = (const PairResponsePayload *)(msg->payload);
+        uint16_t payloadSize = GetPayloadSize(msg);
         bool res = true;
         if (payload->state == PAIR_STATE_PAIRED)
         {
+            storePairCapabilities(payload, payloadSize);
             bool isBroadcast = false;
             gotMasterResponse = true;
+            wakeReportSupported = true;
+            wakeReportMisses = 0;
+            xSemaphoreGive(pairSignal);
             {
                 std::lock_guard<std::mutex> lock(mutex);
                 isBroadcast = memcmp(MasterMacAdresa.Get(), BroadcastAddress, 6) == 0;
@@ -230,10 +321,8 @@ private:
             if (isBroadcast)
             {
                 StavZarizeni.Set(Sparovano);
-                CHECK_RETURN_IF_FAIL(sendParamDefs(mac_addr));
-                CHECK_SEND_RETURN_IF_FAIL(ESPNowCtrl::SendMessage(mac_addr, MSG_TIME_SYNC_REQUEST));
-                CHECK_RETURN_IF_FAIL(sendParamValues(mac_addr));
-                CHECK_SEND_RETURN_IF_FAIL(ESPNowCtrl::SendMessage(mac_addr, MSG_TRANSMIT_DONE));
+                /* The first pairing sends the definitions and values, the worker does it */
+                res = ESPNowCtrl::Defer(mac_addr, msg, len, handleDeferred);
             }
         }
         else if ((payload->state == PAIR_STATE_INITIAL_REQUEST) || (payload->state == PAIR_STATE_EXPIRED))
@@ -255,9 +344,10 @@ private:
         return res;
     }
 
-    static void fwUpdateRequestHandler(const uint8_t *mac_addr, UpdateRequestPayload *payload)
+    static void fwUpdateRequestHandler(const uint8_t *mac_addr, UpdateRequestPayload *payload, uint16_t payloadSize)
     {
         static uint32_t last_index = 0;
+        size_t nmr = (payload->nmr == PAYLOAD_SIZE_EXTENDED) ? payloadSize - offsetof(UpdateRequestPayload, data) : payload->nmr;
         if (!payload->index)
         {
             active_tasks[Communication_Task] = true;
@@ -268,7 +358,7 @@ private:
                 Update.printError(Serial);
         }
         // Serial.printf("Get data, size: %d, index: %d, FW: %d\n", payload->nmr, payload->index, payload->isFW);
-        if (Update.write(payload->data, payload->nmr) != payload->nmr)
+        if (Update.write(payload->data, nmr) != nmr)
             Update.printError(Serial);
         if (payload->isFinal)
         {
@@ -288,6 +378,152 @@ private:
         }
     }
 
+    static void streamResumeHandler(const uint8_t *mac_addr, const StreamResumePayload *payload)
+    {
+        xQueueOverwrite(resumeQueue, payload);
+    }
+
+    /* Asks the receiver where the interrupted stream should continue, receivers
+       without resume support keep the offset confirmed so far. */
+    static void resumeTransfer(const uint8_t *mac_addr, StreamTransfer_t &transfer)
+    {
+        StreamResumePayload request;
+        StreamResumePayload response;
+        request.type = transfer.tag;
+        request.max_mr_bytes = transfer.len;
+        request.index = transfer.offset;
+
+        xQueueReset(resumeQueue);
+        if (!ESPNowCtrl::SendMessage(mac_addr, MSG_STREAM_RESUME, request, sizeof(StreamResumePayload)))
+        {
+            return;
+        }
+        if (xQueueReceive(resumeQueue, &response, pdMS_TO_TICKS(STREAM_RESUME_TIMEOUT_MS)) == pdTRUE)
+        {
+            if (response.type == transfer.tag && response.max_mr_bytes == transfer.len && response.index <= transfer.len)
+            {
+                transfer.offset = response.index;
+            }
+        }
+    }
+
+    static bool sendSeparateReport(const uint8_t *mac_addr)
+    {
+        CHECK_RETURN_IF_FAIL(sendParamValues(mac_addr));
+        CHECK_SEND_RETURN_IF_FAIL(ESPNowCtrl::SendMessage(mac_addr, MSG_TIME_SYNC_REQUEST));
+        CHECK_SEND_RETURN_IF_FAIL(ESPNowCtrl::SendMessage(mac_addr, MSG_TRANSMIT_DONE));
+        return true;
+    }
+
+    /* One frame instead of param values, time sync request and done marker. A
+       missed reply falls back to the separate exchanges for this wake only, a
+       gateway missing WAKE_REPORT_MAX_MISSES replies in a row gets them from
+       then on. */
+    static bool sendWakeReport(const uint8_t *mac_addr)
+    {
+        if (!wakeReportSupported)
+        {
+            return sendSeparateReport(mac_addr);
+        }
+
+        WakeReportPayload report;
+        uint16_t regFirst = 0;
+        uint16_t regLast = 0;
+        espNowRegRange(regFirst, regLast);
+        if ((regLast - regFirst) > WAKE_REPORT_MAX_VALUES)
+        {
+            /* Registers not fitting into the report go ahead as read responses */
+            ReadRequestPayload head;
+            head.regAddr = regFirst;
+            head.nmr = regLast - regFirst - WAKE_REPORT_MAX_VALUES;
+            CHECK_RETURN_IF_FAIL(readParamsRequestHandler(mac_addr, &head));
+            regFirst += head.nmr;
+        }
+        report.flags = WAKE_FLAG_TIME_SYNC | WAKE_FLAG_DONE;
+        report.sleepTime = PeriodaKomunikace_S.Get();
+        report.regAddr = regFirst;
+        report.nmr = regLast - regFirst;
+        for (uint16_t i = 0; i < report.nmr; i++)
+        {
+            int16_t value;
+            Register::ReadReg(&value, regFirst + i);
+            report.values[i] = value;
+        }
+
+        xSemaphoreTake(wakeReplySignal, 0);
+        CHECK_SEND_RETURN_IF_FAIL(ESPNowCtrl::SendMessage(mac_addr, MSG_WAKE_REPORT, report, 9 + report.nmr * 2));
+        if (xSemaphoreTake(wakeReplySignal, pdMS_TO_TICKS(WAKE_REPLY_TIMEOUT_MS)) != pdTRUE)
+        {
+            if (++wakeReportMisses >= WAKE_REPORT_MAX_MISSES)
+            {
+                SystemLog::PutLog("Gateway bez podpory MSG_WAKE_REPORT", v_warning);
+                wakeReportSupported = false;
+            }
+            return sendSeparateReport(mac_addr);
+        }
+        wakeReportMisses = 0;
+        return true;
+    }
+
+    /* The gateway sends only the values it writes, the payload ends after them */
+    static void wakeReplyHandler(const uint8_t *mac_addr, const WakeReplyPayload *payload, uint16_t payloadSize)
+    {
+        if (payloadSize < offsetof(WakeReplyPayload, values) ||
+            payload->nmr > (payloadSize - offsetof(WakeReplyPayload, values)) / sizeof(int16_t))
+        {
+            return;
+        }
+        if (payload->flags & WAKE_REPLY_TIME_SYNC)
+        {
+            timeSyncResponseHandler(mac_addr, &payload->time);
+        }
+        for (uint16_t i = 0; i < payload->nmr && i < WAKE_REPLY_MAX_WRITES; i++)
+        {
+            Register::WriteReg(payload->values[i], i + payload->regAddr);
+        }
+        if (payload->nmr > 0)
+        {
+            Camera::Wake();
+        }
+        sleepTime = payload->sleepTime;
+        sleepAnnounced = true;
+        xSemaphoreGive(wakeReplySignal);
+        if (!(payload->flags & WAKE_REPLY_MORE))
+        {
+            active_tasks[Communication_Task] = false;
+        }
+    }
+
+    static uint64_t nowMs(void)
+    {
+        struct timeval tv;
+        gettimeofday(&tv, NULL);
+        return (tv.tv_sec < TIME_VALID_EPOCH) ? 0 : (uint64_t)tv.tv_sec * 1000 + tv.tv_usec / 1000;
+    }
+
+    /* The slot is kept as its phase in the period of the synced clock, so it
+       survives deep sleep without further messages */
+    static void sleepSlotHandler(const uint8_t *mac_addr, const SleepPayload *payload, uint16_t payloadSize)
+    {
+        if (payloadSize < sizeof(SleepPayload))
+        {
+            return;
+        }
+        uint64_t now = nowMs();
+        if (payload->slotPeriod == 0 || now == 0)
+        {
+            SlotPerioda_s.Set(0);
+            return;
+        }
+        uint64_t period_ms = (uint64_t)payload->slotPeriod * 1000;
+        SlotPerioda_s.Set(payload->slotPeriod);
+        SlotOffset_ms.Set((now + payload->slotStartIn) % period_ms);
+        if (payload->sleepTime > 0)
+        {
+            sleepTime = payload->sleepTime;
+        }
+    }
+
     static void timeSyncResponseHandler(const uint8_t *mac_addr, const TimeSyncPayload *payload)
     {
         PopisCasu.Set(payload->timezone);
@@ -297,19 +533,57 @@ private:
         CasZapadu.Set(payload->sunsetTime);
     }
 
+    static bool sendFirstPairing(const uint8_t *mac_addr)
+    {
+        CHECK_RETURN_IF_FAIL(sendParamDefs(mac_addr));
+        CHECK_SEND_RETURN_IF_FAIL(ESPNowCtrl::SendMessage(mac_addr, MSG_TIME_SYNC_REQUEST));
+        CHECK_RETURN_IF_FAIL(sendParamValues(mac_addr));
+        CHECK_SEND_RETURN_IF_FAIL(ESPNowCtrl::SendMessage(mac_addr, MSG_TRANSMIT_DONE));
+        return true;
+    }
+
+    /* Requests sending many frames run in the ESPNowCtrl worker, the RX task
+       handles only what is done within one frame. A failed send scans for the
+       master, which waits for the pair response the RX task delivers, so
+       nothing sending with CHECK_SEND may run in the RX task. */
+    static void handleDeferred(const uint8_t *mac_addr, const Message *msg, int len)
+    {
+        switch (msg->messageType)
+        {
+        case MSG_PAIR_RESPONSE:
+            sendFirstPairing(mac_addr);
+            break;
+        case MSG_READ_PARAM_REQUEST:
+            readParamsRequestHandler(mac_addr, (const ReadRequestPayload *)(msg->payload));
+            break;
+        case MSG_GET_PARAM_DEFS_REQUEST:
+            sendParamDefs(mac_addr);
+            break;
+        case MSG_GET_LOG_REQUEST:
+            SystemLog::SendLogsViaEspNow(mac_addr);
+            break;
+        case MSG_FW_UPDATE_REQUEST:
+            fwUpdateRequestHandler(mac_addr, (UpdateRequestPayload *)(msg->payload), GetPayloadSize(msg));
+            break;
+        default:
+            break;
+        }
+    }
+
     static void handleDataReceived(const uint8_t *mac_addr, const Message *msg, int len)
     {
         // Serial.printf("Received data type: %d, len: %d\n", msg->messageType, len);
         switch (msg->messageType)
         {
         case MSG_PAIR_RESPONSE:
-            pairResponseHandler(mac_addr, (const PairResponsePayload *)(msg->payload));
+            pairResponseHandler(mac_addr, msg, len);
             break;
         case MSG_GET_PARAM_DEFS_REQUEST:
-            sendParamDefs(mac_addr);
+            ESPNowCtrl::Defer(mac_addr, msg, len, handleDeferred);
             break;
         case MSG_READ_PARAM_REQUEST:
-            readParamsRequestHandler(mac_addr, (const ReadRequestPayload *)(msg->payload));
+            /* Each request asks for its own registers, none is coalesced */
+            ESPNowCtrl::Defer(mac_addr, msg, len, handleDeferred, false);
             break;
         case MSG_WRITE_PARAM_REQUEST:
             writeParamsRequestHandler(mac_addr, (const WriteRequestPayload *)(msg->payload));
@@ -317,7 +591,13 @@ private:
             break;
 
         case MSG_FW_UPDATE_REQUEST:
-            fwUpdateRequestHandler(mac_addr, (UpdateRequestPayload *)(msg->payload));
+            /* Finishing the update takes seconds, the chunks before it are written in order
+               inline. A final chunk the full worker queue refuses is finished here too. */
+            if (!((const UpdateRequestPayload *)(msg->payload))->isFinal ||
+                !ESPNowCtrl::Defer(mac_addr, msg, len, handleDeferred))
+            {
+                fwUpdateRequestHandler(mac_addr, (UpdateRequestPayload *)(msg->payload), GetPayloadSize(msg));
+            }
             break;
 
         case MSG_TIME_SYNC_RESPONSE:
@@ -325,7 +605,28 @@ private:
             break;
 
         case MSG_GET_LOG_REQUEST:
-            SystemLog::SendLogsViaEspNow(mac_addr);
+            ESPNowCtrl::Defer(mac_addr, msg, len, handleDeferred);
+            break;
+
+        case MSG_ACK:
+        case MSG_NACK:
+            ESPNowCtrl::PutStreamFeedback(msg);
+            break;
+
+        case MSG_STREAM_RESUME:
+            streamResumeHandler(mac_addr, (const StreamResumePayload *)(msg->payload));
+            break;
+
+        case MSG_STREAM_CANCEL:
+            ESPNowCtrl::CancelStreams(((const StreamCancelPayload *)(msg->payload))->streamType);
+            break;
+
+        case MSG_WAKE_REPLY:
+            wakeReplyHandler(mac_addr, (const WakeReplyPayload *)(msg->payload), GetPayloadSize(msg));
+            break;
+
+        case MSG_SLEEP:
+            sleepSlotHandler(mac_addr, (const SleepPayload *)(msg->payload), GetPayloadSize(msg));
             break;
 
         case MSG_TRANSMIT_DONE:
@@ -347,6 +648,10 @@ public:
     static void Init(void)
     {
         ESPNowCtrl::Init();
+        if (resumeQueue == NULL)
+        {
+            resumeQueue = xQueueCreate(1, sizeof(StreamResumePayload));
+        }
         ESPNowCtrl::SetDataReceivedCallback(handleDataReceived);
         ESPNowCtrl::SetDataSentCallback(OnDataSent);
         ESPNowCtrl::SetChannel(WiFiKanal.Get());
@@ -397,9 +702,7 @@ public:
                         break;
                     }
 
-                    CHECK_BREAK_IF_FAIL(sendParamValues(mac_addr));
-                    CHECK_SEND_BREAK_IF_FAIL(ESPNowCtrl::SendMessage(mac_addr, MSG_TIME_SYNC_REQUEST));
-                    CHECK_SEND_BREAK_IF_FAIL(ESPNowCtrl::SendMessage(mac_addr, MSG_TRANSMIT_DONE));
+                    CHECK_BREAK_IF_FAIL(sendWakeReport(mac_addr));
                     Camera::Wake();
                     res = true;
                 } while (0);
@@ -452,6 +755,51 @@ public:
         xSemaphoreGive(semaphore);
     }
 
+    /* MSG_SLEEP is not needed when the gateway already answered the wake report,
+       unless it carries the announcement of the next wake for the slots */
+    static bool SleepAnnounced(void)
+    {
+        return sleepAnnounced && !(EspNowSchopnosti.Get() & CAP_SLOTS);
+    }
+
+    static uint32_t GetSleepTime(void)
+    {
+        return (sleepTime > 0) ? sleepTime : PeriodaKomunikace_S.Get();
+    }
+
+    /* With a slot assigned the wake lands SLOT_WAKE_LEAD_MS before the slot opens,
+       so the camera is booted by then. The clock is synced to whole seconds, the
+       gateway has to keep slots wider than that. */
+    static uint64_t GetWakeDelay_us(void)
+    {
+        uint64_t period_ms = (uint64_t)SlotPerioda_s.Get() * 1000;
+        uint64_t now = nowMs();
+        if (period_ms == 0 || now == 0)
+        {
+            return (uint64_t)GetSleepTime() * 1000000ULL;
+        }
+        uint64_t sinceSlot = (now + period_ms - (uint64_t)SlotOffset_ms.Get() % period_ms) % period_ms;
+        uint64_t wakeAt = now - sinceSlot + period_ms - SLOT_WAKE_LEAD_MS;
+        while (wakeAt < now + SLOT_MIN_SLEEP_MS)
+        {
+            wakeAt += period_ms;
+        }
+        return (wakeAt - now) * 1000;
+    }
+
+    /* MSG_SLEEP announcing the next wake, returns the payload size */
+    static uint8_t FillSleepPayload(SleepPayload &payload, uint64_t wakeDelay_us)
+    {
+        payload.sleepTime = PeriodaKomunikace_S.Get();
+        if (!(EspNowSchopnosti.Get() & CAP_SLOTS))
+        {
+            return SLEEP_LEGACY_SIZE;
+        }
+        payload.slotPeriod = SlotPerioda_s.Get();
+        payload.slotStartIn = wakeDelay_us / 1000 + ((payload.slotPeriod > 0) ? SLOT_WAKE_LEAD_MS : 0);
+        return sizeof(SleepPayload);
+    }
+
     static void SendPhoto(void)
     {
         active_tasks[Communication_Task] = true;
@@ -459,6 +807,52 @@ public:
         xSemaphoreGive(semaphore);
     }
 
+    /* Sends a byte stream and keeps its state across a re-pairing, so a channel
+       change continues the stream instead of starting again from index 0.
+       Streams sent from several tasks at once are interleaved. */
+    static bool SendStream(const uint8_t *mac_addr, const uint8_t *data, size_t len, uint8_t type = STREAM_TYPE_IMAGE)
+    {
+        StreamTransfer_t transfer;
+        uint8_t stream = ESPNowCtrl::OpenStream(type);
+        if (stream == STREAM_NONE)
+        {
+            return false;
+        }
+        transfer.tag = ESPNowCtrl::GetStreamTag(stream);
+        transfer.len = len;
+        transfer.offset = 0;
+
+        bool res = true;
+        uint8_t attempts = 0;
+        while (!ESPNowCtrl::SendStreamData(stream, mac_addr, data, len, transfer.offset))
+        {
+            if (ESPNowCtrl::IsCancelled(type))
+            {
+                Serial.println("Stream cancelled by receiver");
+                res = false;
+                break;
+            }
+            Serial.println("Communication error");
+            attempts++;
+            if (attempts >= COMMUNICATION_ATTEMPTS + STREAM_RESUME_ATTEMPTS)
+            {
+                res = false;
+                break;
+            }
+            if (attempts >= COMMUNICATION_ATTEMPTS)
+            {
+                if (!ScanForMaster())
+                {
+                    res = false;
+                    break;
+                }
+                resumeTransfer(mac_addr, transfer);
+            }
+        }
+        ESPNowCtrl::CloseStream(stream);
+        return res;
+    }
+
     static bool ScanForMaster()
     {
         gotMasterResponse = false;
@@ -467,35 +861,38 @@ public:
             std::lock_guard<std::mutex> lock(mutex);
             memcpy(macAddr, MasterMacAdresa.Get(), 6);
         }
-        WiFiKanal.Set(1);
-        uint8_t channel = 1;
-        while (!gotMasterResponse)
+        uint8_t order[MAX_CHANNEL];
+        uint8_t nmr = ChannelScan::Order(WiFiKanal.Get(), order);
+        uint8_t channel = 0;
+        xSemaphoreTake(pairSignal, 0);
+        for (uint8_t i = 0; i < nmr && !gotMasterResponse; i++)
         {
             PairRequestPayload request;
+            channel = order[i];
             request.channel = channel;
             ESPNowCtrl::SetChannel(request.channel);
             delay(5);
             request.deviceType = DEVICE_TYPE;
+            request.maxPayload = MAX_FRAME_PAYLOAD_SIZE;
+            request.capabilities = localCapabilities();
+            uint32_t start = micros();
             if (ESPNowCtrl::SendMessage(macAddr, MSG_PAIR_REQUEST, request, sizeof(PairRequestPayload)))
             {
-                delay(200);
-            }
-            if (gotMasterResponse)
-            {
-                break;
-            }
-            channel++;
-            if (channel > MAX_CHANNEL)
-            {
-                // WiFiKanal.Set(1);
-                Serial.println("Pair scan done.");
-                break;
+                if (xSemaphoreTake(pairSignal, pdMS_TO_TICKS(ChannelScan::ProbeTimeout())) == pdTRUE)
+                {
+                    ChannelScan::Paired(channel, micros() - start);
+                }
             }
-            // memcmp(MasterMacAdresa.Get(), BroadcastAddress, 6) == 0
         }
-        delay(100);
-        ESPNowCtrl::SetChannel(WiFiKanal.Get());
-        delay(10);
+        if (!gotMasterResponse)
+        {
+            Serial.println("Pair scan done.");
+        }
+        if (channel != WiFiKanal.Get())
+        {
+            ESPNowCtrl::SetChannel(WiFiKanal.Get());
+            delay(10);
+        }
         if (!gotMasterResponse)
         {
             Serial.println("Device not paired.");
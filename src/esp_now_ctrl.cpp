@@ -11,20 +11,110 @@
  ***********************************************************************/
 
 #include "esp_now_ctrl.h"
-#include "WiFi.h"
-#include "esp_event.h"
-#include "esp_netif.h"
 #include "esp_wifi.h"
-#include "esp_mac.h"
 #include "log.h"
+#include "parameters.h"
+#include "fec.h"
+#ifdef TRANSPORT_SIM
+#include "transport_sim.h"
+#endif
 
 uint8_t BroadcastAddress[] = {0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF};
 DataReceivedCallback ESPNowCtrl::onDataReceivedCallback;
+QueueHandle_t ESPNowCtrl::deferredQueue = NULL;
+std::atomic<uint8_t> ESPNowCtrl::deferredBusy(0);
+std::atomic<uint32_t> ESPNowCtrl::deferredTypes(0);
 DataSentCallback ESPNowCtrl::onDataSentCallback;
-QueueHandle_t ESPNowCtrl::sendQueue = NULL;
-QueueHandle_t ESPNowCtrl::receiveQueue = NULL;
+TxSlot_t ESPNowCtrl::txSlots[TX_SLOTS];
+uint32_t ESPNowCtrl::txNextSeq = 1;
+uint32_t ESPNowCtrl::txDoneSeq = 1;
+portMUX_TYPE ESPNowCtrl::txLock = portMUX_INITIALIZER_UNLOCKED;
+SemaphoreHandle_t ESPNowCtrl::txMutex = NULL;
+uint32_t ESPNowCtrl::txLastDoneAt = 0;
+RTC_DATA_ATTR PeerLink_t ESPNowCtrl::peerLinks[MAX_PEER_LINKS + 1];
+RTC_DATA_ATTR uint8_t ESPNowCtrl::peerLinkVictim = 0;
+BulkLane_t ESPNowCtrl::bulkLanes[MAX_BULK_LANES];
+SemaphoreHandle_t ESPNowCtrl::laneMutex = NULL;
+SemaphoreHandle_t ESPNowCtrl::laneFree = NULL;
+std::atomic<uint8_t> ESPNowCtrl::controlPending(0);
+SemaphoreHandle_t ESPNowCtrl::rxSignal = NULL;
+RxRing_t<RX_CONTROL_POOL_SIZE, RX_CONTROL_FRAME_SIZE> ESPNowCtrl::rxControl;
+RxRing_t<RX_BULK_POOL_SIZE, RX_BULK_FRAME_SIZE> ESPNowCtrl::rxBulk;
+std::atomic<uint32_t> ESPNowCtrl::rxDropped(0);
+std::atomic<uint32_t> ESPNowCtrl::rxOverflow(0);
+uint32_t ESPNowCtrl::rxReplays = 0;
+std::atomic<uint32_t> ESPNowCtrl::txSends(0);
+std::atomic<uint32_t> ESPNowCtrl::txRetries(0);
+std::atomic<uint32_t> ESPNowCtrl::txTimeouts(0);
+std::atomic<uint32_t> ESPNowCtrl::txDelivered(0);
+uint32_t ESPNowCtrl::goodputStart = 0;
+uint32_t ESPNowCtrl::goodputMark = 0;
+uint32_t ESPNowCtrl::goodputPrev = 0;
+uint32_t ESPNowCtrl::rssiSampleAt = 0;
+bool ESPNowCtrl::rssiSampled = false;
+uint8_t ESPNowCtrl::currentRate = PHY_RATE_NONE;
+uint8_t ESPNowCtrl::currentPower = TX_POWER_NONE;
+uint32_t ESPNowCtrl::txAirtime_us = 0;
+uint32_t ESPNowCtrl::txEnergy_uJ = 0;
 
+typedef struct
+{
+    wifi_phy_rate_t rate;
+    uint16_t kbps;
+    uint16_t airtime_us; /* Preamble and payload of a full frame */
+} PhyRate_t;
+
+/* Rates ordered from the most robust one, OFDM rates below 12 Mbps are
+   slower than 11 Mbps CCK for a full frame and are left out */
+static const PhyRate_t phyRates[PHY_RATE_COUNT] = {
+    {WIFI_PHY_RATE_1M_L, 1000, 192 + 2000},
+    {WIFI_PHY_RATE_2M_L, 2000, 192 + 1000},
+    {WIFI_PHY_RATE_5M_L, 5500, 192 + 364},
+    {WIFI_PHY_RATE_11M_L, 11000, 192 + 182},
+    {WIFI_PHY_RATE_12M, 12000, 20 + 167},
+    {WIFI_PHY_RATE_18M, 18000, 20 + 111},
+    {WIFI_PHY_RATE_24M, 24000, 20 + 84},
+    {WIFI_PHY_RATE_36M, 36000, 20 + 56},
+    {WIFI_PHY_RATE_48M, 48000, 20 + 42},
+    {WIFI_PHY_RATE_54M, 54000, 20 + 37},
+};
+
+typedef struct
+{
+    wifi_power_t power; /* In 0.25 dBm */
+    uint16_t current_mA;
+} TxPower_t;
+
+/* Power levels from the lowest one, TX current of the module at each of them */
+static const TxPower_t txPowers[TX_POWER_COUNT] = {
+    {WIFI_POWER_2dBm, 120},
+    {WIFI_POWER_5dBm, 130},
+    {WIFI_POWER_7dBm, 140},
+    {WIFI_POWER_8_5dBm, 145},
+    {WIFI_POWER_11dBm, 160},
+    {WIFI_POWER_13dBm, 175},
+    {WIFI_POWER_15dBm, 190},
+    {WIFI_POWER_17dBm, 205},
+    {WIFI_POWER_18_5dBm, 220},
+    {WIFI_POWER_19_5dBm, 240},
+};
+StreamFlow_t ESPNowCtrl::streams[MAX_STREAMS];
+SemaphoreHandle_t ESPNowCtrl::streamMutex = NULL;
+SemaphoreHandle_t ESPNowCtrl::streamSerial = NULL;
+std::atomic<uint8_t> ESPNowCtrl::streamsOpen(0);
+uint8_t ESPNowCtrl::streamId = 0;
+std::atomic<uint32_t> ESPNowCtrl::cancelledTypes(0);
+QueueHandle_t ESPNowCtrl::txFreeQueue = NULL;
+Message ESPNowCtrl::txPool[TX_POOL_SIZE];
+
+#ifdef TRANSPORT_SIM
+Transport *ESPNowCtrl::transport = &simTransport;
+#else
+static ESPNowTransport espNowTransport;
+Transport *ESPNowCtrl::transport = &espNowTransport;
+#endif
 bool ESPNowCtrl::initDone = false;
+uint32_t ESPNowCtrl::radioOnAt = 0;
 
 void ESPNowCtrl::Init()
 {
@@ -32,29 +122,79 @@ void ESPNowCtrl::Init()
     {
         return;
     }
-    WiFi.mode(WIFI_STA);
-    esp_wifi_set_ps(WIFI_PS_NONE);
+    radioOnAt = millis();
 
-    // Init ESP-NOW
-    if (esp_now_init() != ESP_OK)
+    if (txMutex == NULL)
     {
-        SystemLog::PutLog("Error initializing ESP-NOW", v_error);
-        return;
+        txMutex = xSemaphoreCreateMutex();
     }
-    esp_now_set_wake_window(UINT16_MAX);
-
-    if (sendQueue == NULL)
+    if (laneMutex == NULL)
+    {
+        laneMutex = xSemaphoreCreateMutex();
+        laneFree = xSemaphoreCreateCounting(MAX_BULK_LANES, MAX_BULK_LANES);
+        for (uint8_t i = 0; i < MAX_BULK_LANES; i++)
+        {
+            bulkLanes[i].wake = xSemaphoreCreateBinary();
+        }
+    }
+    memset(txSlots, 0, sizeof(txSlots));
+    currentRate = PHY_RATE_NONE;
+    currentPower = TX_POWER_NONE;
+    txDoneSeq = txNextSeq;
+    if (rxSignal == NULL)
+    {
+        rxSignal = xSemaphoreCreateBinary();
+    }
+    if (streamMutex == NULL)
+    {
+        streamMutex = xSemaphoreCreateMutex();
+        streamSerial = xSemaphoreCreateBinary();
+        xSemaphoreGive(streamSerial);
+        for (int i = 0; i < MAX_STREAMS; i++)
+        {
+            streams[i].used = false;
+            streams[i].feedback = xQueueCreate(STREAM_FEEDBACK_QUEUE_SIZE, sizeof(StreamFeedback_t));
+        }
+    }
+    if (deferredQueue == NULL)
     {
-        sendQueue = xQueueCreate(10, sizeof(esp_now_send_status_t));
+        deferredQueue = xQueueCreate(DEFERRED_QUEUE_SIZE, sizeof(DeferredJob_t));
+        for (int i = 0; i < DEFERRED_WORKERS; i++)
+        {
+            xTaskCreateUniversal(deferredWorker, "espNowWorker", getArduinoLoopTaskStackSize(), NULL, 2, NULL, ARDUINO_RUNNING_CORE);
+        }
     }
-    if (receiveQueue == NULL)
+    if (txFreeQueue == NULL)
     {
-        receiveQueue = xQueueCreate(100, sizeof(ESPNowItem_t));
+        txFreeQueue = xQueueCreate(TX_POOL_SIZE, sizeof(Message *));
+        for (int i = 0; i < TX_POOL_SIZE; i++)
+        {
+            Message *frame = &txPool[i];
+            xQueueSendToBack(txFreeQueue, &frame, 0);
+        }
     }
 
-    esp_now_register_recv_cb(onDataRecv);
+    EspNowRssi_dBm.SetSize(TELEMETRY_CHART_SAMPLES);
+    EspNowGoodput_kbps.SetSize(TELEMETRY_CHART_SAMPLES);
+    goodputStart = millis();
+    goodputMark = txDelivered;
+    rssiSampled = false;
+    /* The RSSI of the last wake says little about this one, the links measure it again */
+    for (uint8_t i = 0; i <= MAX_PEER_LINKS; i++)
+    {
+        peerLinks[i].rssi = 0;
+    }
 
-    esp_now_register_send_cb(onDataSent);
+    if (!transport->Init(onDataRecv, onDataSent))
+    {
+        SystemLog::PutLog("Error initializing ESP-NOW", v_error);
+        return;
+    }
+    if (!peerLinks[PEER_LINK_OTHER].used)
+    {
+        const uint8_t noAddr[6] = {0};
+        initPeerLink(&peerLinks[PEER_LINK_OTHER], noAddr);
+    }
     AddPeer(BroadcastAddress, 0);
 
     initDone = true;
@@ -66,21 +206,15 @@ void ESPNowCtrl::Deinit()
     {
         return;
     }
-    esp_now_deinit();
-    WiFi.mode(WIFI_OFF);
+    transport->Deinit();
     initDone = false;
 }
 
 void ESPNowCtrl::AddPeer(const uint8_t *mac_addr, uint8_t chan)
 {
+    createPeerLink(mac_addr);
     DeletePeer(mac_addr);
-    esp_now_peer_info_t peer;
-    memset(&peer, 0, sizeof(esp_now_peer_info_t));
-    peer.channel = chan;
-    peer.encrypt = false;
-    // peer.ifidx = WIFI_IF_STA;
-    memcpy(peer.peer_addr, mac_addr, sizeof(uint8_t[6]));
-    if (esp_now_add_peer(&peer) != ESP_OK)
+    if (!transport->AddPeer(mac_addr, chan))
     {
         Serial.println("Failed to add peer");
         return;
@@ -89,116 +223,1554 @@ void ESPNowCtrl::AddPeer(const uint8_t *mac_addr, uint8_t chan)
 
 void ESPNowCtrl::DeletePeer(const uint8_t *mac_addr)
 {
-    esp_now_del_peer(mac_addr);
+    transport->DeletePeer(mac_addr);
 }
 
 void ESPNowCtrl::SetChannel(uint8_t channel)
 {
-    esp_wifi_set_channel(channel, WIFI_SECOND_CHAN_NONE);
+    transport->SetChannel(channel);
 }
 
-bool ESPNowCtrl::SendMessageInternal(const uint8_t *peer_addr, uint8_t messageType, const uint8_t *payload, uint8_t payloadSize, uint8_t retryCount)
+void ESPNowCtrl::SetTransport(Transport *newTransport)
 {
-    for (uint8_t retries = 0; retries < retryCount; retries++)
+    if (!initDone)
+    {
+        transport = newTransport;
+    }
+}
+
+Message *ESPNowCtrl::BorrowFrame(uint8_t messageType, uint32_t timeoutMs)
+{
+    Message *frame;
+    if (xQueueReceive(txFreeQueue, &frame, pdMS_TO_TICKS(timeoutMs)) != pdPASS)
+    {
+        SystemLog::PutLog("ESP-Now no free TX frame", v_warning);
+        return NULL;
+    }
+    frame->messageType = messageType;
+    SetPayloadSize(frame, 0);
+    return frame;
+}
+
+void ESPNowCtrl::ReturnFrame(Message *frame)
+{
+    if (frame != NULL)
+    {
+        xQueueSendToBack(txFreeQueue, &frame, 0);
+    }
+}
+
+/* Returns the sequence number of the submitted frame or 0 if the driver refused it.
+   Control frames and pairing go at the most robust rate, bulk frames at the rate
+   chosen by the link's rate statistics unless robust is set. A resubmitted frame
+   keeps its peer sequence number so the receiver drops the copy. */
+uint32_t ESPNowCtrl::SubmitFrame(const uint8_t *peer_addr, Message *frame, uint8_t lane, bool robust)
+{
+    xSemaphoreTake(txMutex, portMAX_DELAY);
+
+    uint32_t seq = txNextSeq;
+    TxSlot_t *slot = &txSlots[seq % TX_SLOTS];
+    bool broadcast = memcmp(peer_addr, BroadcastAddress, 6) == 0;
+    bool numbered = !broadcast && frame->messageType != MSG_PAIR_REQUEST && (EspNowSchopnosti.Get() & CAP_SEQUENCE);
+    uint16_t payloadSize = GetPayloadSize(frame);
+    uint8_t rate = PHY_RATE_ROBUST;
+    uint8_t power = TX_POWER_MAX;
+    bool busy;
+    TaskHandle_t woken[TX_SLOTS];
+    uint8_t nmrWoken = 0;
+
+    portENTER_CRITICAL(&txLock);
+    /* A whole ring of frames later the status of an abandoned frame is not coming */
+    if (slot->state == TX_SLOT_ABANDONED && statusLost(slot, micros()) && (int32_t)(slot->seq - txDoneSeq) >= 0)
+    {
+        nmrWoken = skipStatuses(slot->seq + 1, woken);
+    }
+    busy = slot->state != TX_SLOT_FREE;
+    if (!busy)
+    {
+        slot->seq = seq;
+        memcpy(slot->mac_addr, peer_addr, 6);
+        slot->task = xTaskGetCurrentTaskHandle();
+        slot->state = TX_SLOT_PENDING;
+        slot->link = findPeerLink(peer_addr);
+        slot->sentAt = micros();
+        slot->len = MESSAGE_HEADER_SIZE + payloadSize;
+        if (lane != LANE_CONTROL && !broadcast && !robust)
+        {
+            rate = selectRate(&peerLinks[slot->link]);
+        }
+        /* Pairing and discovery are heard by unknown gateways, they go at full power */
+        if (!broadcast)
+        {
+            power = selectPower(&peerLinks[slot->link]);
+        }
+        slot->power = power;
+        if (numbered && frame->seq == 0)
+        {
+            /* 0 marks a frame not numbered yet */
+            PeerLink_t *link = &peerLinks[slot->link];
+            if (++link->txSeq == 0)
+            {
+                link->txSeq = 1;
+            }
+            frame->seq = link->txSeq;
+        }
+        /* Broadcast frames are not acknowledged and say nothing about the rate */
+        slot->rate = broadcast ? PHY_RATE_NONE : rate;
+        txNextSeq = seq + 1;
+    }
+    portEXIT_CRITICAL(&txLock);
+    for (uint8_t i = 0; i < nmrWoken; i++)
+    {
+        xTaskNotifyGive(woken[i]);
+    }
+
+    if (!busy && rate != currentRate)
+    {
+        if (transport->SetRate(phyRates[rate].rate))
+        {
+            currentRate = rate;
+        }
+    }
+    if (!busy && power != currentPower)
+    {
+        transport->SetPower(txPowers[power].power);
+        currentPower = power;
+    }
+
+    if (numbered)
+    {
+        frame->messageType |= MSG_SEQ_FLAG;
+        memcpy(frame->payload + payloadSize, &frame->seq, MSG_SEQ_SIZE);
+    }
+    else
+    {
+        frame->messageType &= ~MSG_SEQ_FLAG;
+    }
+
+    if (!busy && !transport->Send(peer_addr, (const uint8_t *)frame, MESSAGE_HEADER_SIZE + payloadSize + (numbered ? MSG_SEQ_SIZE : 0)))
+    {
+        portENTER_CRITICAL(&txLock);
+        slot->state = TX_SLOT_FREE;
+        txNextSeq = seq;
+        portEXIT_CRITICAL(&txLock);
+        busy = true;
+    }
+    if (!busy)
     {
-        SendMessageRaw(peer_addr, messageType, payload, payloadSize);
+        txSends++;
+        uint32_t airtime = (uint32_t)phyRates[rate].airtime_us * (MESSAGE_HEADER_SIZE + payloadSize) / MAX_PACKET_SIZE;
+        txAirtime_us += airtime;
+        txEnergy_uJ += (uint64_t)SUPPLY_VOLTAGE_MV * txPowers[power].current_mA * airtime / 1000000;
+    }
+
+    xSemaphoreGive(txMutex);
+    return busy ? 0 : seq;
+}
+
+bool ESPNowCtrl::WaitFrameDone(uint32_t seq, bool *timedOut)
+{
+    uint32_t timeoutMs = SEND_STATUS_TIMEOUT_MS;
+    TxSlot_t *slot = &txSlots[seq % TX_SLOTS];
+
+    portENTER_CRITICAL(&txLock);
+    if (slot->seq == seq)
+    {
+        timeoutMs = linkTimeout(&peerLinks[slot->link]);
+    }
+    portEXIT_CRITICAL(&txLock);
 
+    return WaitFrameDone(seq, timeoutMs, timedOut);
+}
+
+/* Waits for the send status of one frame, statuses of other frames only wake the task */
+bool ESPNowCtrl::WaitFrameDone(uint32_t seq, uint32_t timeoutMs, bool *timedOut)
+{
+    TxSlot_t *slot = &txSlots[seq % TX_SLOTS];
+    uint32_t start = millis();
+    if (timedOut != NULL)
+    {
+        *timedOut = false;
+    }
+
+    while (true)
+    {
+        bool done = false;
         esp_now_send_status_t status;
-        if (xQueueReceive(sendQueue, &status, (TickType_t)pdMS_TO_TICKS(1000)) == pdPASS)
+        PeerLink_t link;
+
+        portENTER_CRITICAL(&txLock);
+        if (slot->seq == seq && slot->state == TX_SLOT_DONE)
         {
-            if (status == ESP_NOW_SEND_SUCCESS)
+            status = slot->status;
+            slot->state = TX_SLOT_FREE;
+            link = peerLinks[slot->link];
+            done = true;
+        }
+        portEXIT_CRITICAL(&txLock);
+
+        if (done)
+        {
+            if (link.rttValid && memcmp(link.mac_addr, BroadcastAddress, 6) != 0)
             {
-                return true;
+                EspNowSrtt_us.Set(link.srtt_us);
+                EspNowRttVar_us.Set(link.rttvar_us);
+                EspNowTimeout_ms.Set(linkTimeout(&link));
+                EspNowRychlostPhy_kbps.Set(phyRates[link.bulkRate].kbps);
+                EspNowZtrata_promile.Set(link.loss);
+                EspNowVykonTx_dBm.Set(txPowers[link.txPower].power / 4);
             }
-            delay(50);
+            publishTelemetry();
+            return status == ESP_NOW_SEND_SUCCESS;
         }
-        else
+
+        uint32_t elapsed = millis() - start;
+        if (elapsed >= timeoutMs)
         {
-            Serial.println("Timeout waiting for send status.");
+            break;
         }
+        ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(timeoutMs - elapsed));
+    }
+
+    Serial.println("Timeout waiting for send status.");
+    if (timedOut != NULL)
+    {
+        *timedOut = true;
+    }
+    txTimeouts++;
+    publishTelemetry();
+    portENTER_CRITICAL(&txLock);
+    if (slot->seq == seq && peerLinks[slot->link].backoff < BACKOFF_MAX_SHIFT)
+    {
+        peerLinks[slot->link].backoff++;
     }
-    return false; // Failed to send after retrying
+    portEXIT_CRITICAL(&txLock);
+    /* The slot waits for the late status, so it is not credited to the next frame */
+    AbandonFrame(seq);
+    return false;
 }
 
-bool ESPNowCtrl::SendMessage(const uint8_t *peer_addr, uint8_t messageType, uint8_t retryCount)
+/* Minstrel like selection: the rate with the best expected throughput is used,
+   every RATE_SAMPLE_INTERVAL-th frame probes a random faster rate. */
+uint8_t ESPNowCtrl::selectRate(PeerLink_t *link)
 {
-    return SendMessageInternal(peer_addr, messageType, nullptr, 0, retryCount);
+    if (link->bulkRate >= PHY_RATE_COUNT || (uint32_t)(millis() - link->statsAt) >= RATE_STATS_INTERVAL_MS)
+    {
+        updateRateStats(link);
+    }
+
+    uint8_t rate = link->bulkRate;
+    if (++link->sampleCnt >= RATE_SAMPLE_INTERVAL && link->bulkRate < (PHY_RATE_COUNT - 1))
+    {
+        link->sampleCnt = 0;
+        rate = link->bulkRate + 1 + esp_random() % (PHY_RATE_COUNT - 1 - link->bulkRate);
+    }
+    return rate;
 }
 
-void ESPNowCtrl::SendMessageRaw(const uint8_t *peer_addr, uint8_t messageType, const uint8_t *payloadData, uint8_t payloadSize)
+void ESPNowCtrl::updateRateStats(PeerLink_t *link)
 {
-    if (payloadSize > (MAX_PAYLOAD_SIZE))
+    uint32_t bestTput = 0;
+    uint8_t best = PHY_RATE_ROBUST;
+
+    link->statsAt = millis();
+    for (uint8_t i = 0; i < PHY_RATE_COUNT; i++)
     {
-        Serial.printf("Payload size is too large: %d bytes, Max allowed: %d bytes\n", payloadSize, MAX_PAYLOAD_SIZE);
-        return;
+        RateStats_t *st = &link->rates[i];
+        if (st->attempts > 0)
+        {
+            uint32_t prob = (uint32_t)st->success * RATE_PROB_SCALE / st->attempts;
+            st->prob = st->valid ? (st->prob * 3 + prob) / 4 : prob;
+            st->valid = true;
+            st->attempts = 0;
+            st->success = 0;
+        }
+
+        /* Rates delivering less than 10 % of frames are not worth the retries */
+        uint32_t tput = (st->valid && st->prob >= RATE_PROB_SCALE / 10) ? st->prob * 1000 / phyRates[i].airtime_us : 0;
+        if (tput > bestTput)
+        {
+            bestTput = tput;
+            best = i;
+        }
+    }
+    link->bulkRate = best;
+}
+
+/* Failures step the power up two levels at once. A window of frames with losses
+   under the target steps it down one level, but only while the gateway still
+   hears us with margin: the link is taken as symmetric, so our RSSI of its
+   frames less the power reduction estimates its RSSI of ours. A window whose
+   estimate fell under the margin steps the power back up. */
+uint8_t ESPNowCtrl::selectPower(PeerLink_t *link)
+{
+    if (link->txPower > TX_POWER_MAX)
+    {
+        link->txPower = TX_POWER_MAX;
     }
 
-    Message msg;
-    msg.messageType = messageType;
-    msg.payloadSize = payloadSize;
-    memcpy(msg.payload, payloadData, payloadSize);
+    if (link->powerFailed >= POWER_FAIL_STEP_UP)
+    {
+        link->txPower = min(TX_POWER_MAX, link->txPower + 2);
+        link->powerSent = 0;
+        link->powerFailed = 0;
+    }
+    else if (link->powerSent >= POWER_WINDOW_FRAMES)
+    {
+        uint32_t loss = (uint32_t)link->powerFailed * 1000 / link->powerSent;
+        if (loss > POWER_LOSS_TARGET_PERMILLE)
+        {
+            link->txPower = min(TX_POWER_MAX, link->txPower + 1);
+        }
+        else if (link->txPower < TX_POWER_MAX && link->rssi != 0 &&
+                 link->rssi - (txPowers[TX_POWER_MAX].power - txPowers[link->txPower].power) / 4 < POWER_RSSI_MIN_DBM)
+        {
+            link->txPower++;
+        }
+        else if (loss <= POWER_LOSS_TARGET_PERMILLE / 2 && link->txPower > 0 && link->rssi != 0)
+        {
+            int32_t reduction = (txPowers[TX_POWER_MAX].power - txPowers[link->txPower - 1].power) / 4;
+            if (link->rssi - reduction >= POWER_RSSI_MIN_DBM)
+            {
+                link->txPower--;
+            }
+        }
+        link->powerSent = 0;
+        link->powerFailed = 0;
+    }
+    return link->txPower;
+}
 
-    size_t totalMessageSize = sizeof(msg.messageType) + sizeof(msg.payloadSize) + payloadSize;
-    esp_now_send(peer_addr, (uint8_t *)&msg, totalMessageSize);
+/* TX energy is summed per frame from its airtime and power level, the rest of
+   the radio on time is counted at the receive current */
+uint32_t ESPNowCtrl::GetRadioEnergy(void)
+{
+    uint64_t onTime_us = (uint64_t)GetRadioOnTime() * 1000;
+    uint64_t rxTime_us = (onTime_us > txAirtime_us) ? onTime_us - txAirtime_us : 0;
+    uint64_t rxEnergy_uJ = rxTime_us * SUPPLY_VOLTAGE_MV * RADIO_RX_CURRENT_MA / 1000000;
+    return (txEnergy_uJ + rxEnergy_uJ) / 1000;
 }
 
-void ESPNowCtrl::SetDataReceivedCallback(DataReceivedCallback callback)
+/* Sliding window over the last RX_SEQ_WINDOW sequence numbers of the peer,
+   a frame far behind the window means the peer started numbering again */
+bool ESPNowCtrl::isReplay(PeerLink_t *link, uint16_t seq)
 {
-    onDataReceivedCallback = callback;
+    int16_t diff = seq - link->rxSeq;
+
+    if (!link->rxSeqValid || diff <= -RX_SEQ_RESYNC)
+    {
+        link->rxSeq = seq;
+        link->rxWindow = 1;
+        link->rxSeqValid = true;
+        return false;
+    }
+    if (diff > 0)
+    {
+        link->rxWindow = (diff < RX_SEQ_WINDOW) ? (link->rxWindow << diff) | 1 : 1;
+        link->rxSeq = seq;
+        return false;
+    }
+    if (-diff >= RX_SEQ_WINDOW || (link->rxWindow & (1UL << -diff)))
+    {
+        return true;
+    }
+    link->rxWindow |= 1UL << -diff;
+    return false;
 }
 
-void ESPNowCtrl::SetDataSentCallback(DataSentCallback callback)
+/* Rolling goodput interpolates the previous window with the current one so the
+   value moves smoothly, one chart sample is stored per finished window. */
+void ESPNowCtrl::publishTelemetry(void)
 {
-    onDataSentCallback = callback;
+    xSemaphoreTake(txMutex, portMAX_DELAY);
+
+    uint32_t now = millis();
+    uint32_t delivered = txDelivered;
+    uint32_t elapsed = now - goodputStart;
+    if (elapsed >= TELEMETRY_WINDOW_MS)
+    {
+        /* Nothing was delivered for a whole window when it is more than one window old */
+        goodputPrev = (elapsed < 2 * TELEMETRY_WINDOW_MS) ? (uint64_t)(delivered - goodputMark) * TELEMETRY_WINDOW_MS / elapsed : 0;
+        goodputMark = delivered;
+        goodputStart = now;
+        elapsed = 0;
+        EspNowGoodput_kbps.Set(goodputPrev * 8 / TELEMETRY_WINDOW_MS);
+    }
+    uint32_t windowBytes = (uint64_t)goodputPrev * (TELEMETRY_WINDOW_MS - elapsed) / TELEMETRY_WINDOW_MS + (delivered - goodputMark);
+
+    EspNowOdeslano.Set(min(txSends.load(), (uint32_t)UINT16_MAX));
+    EspNowOpakovani.Set(min(txRetries.load(), (uint32_t)UINT16_MAX));
+    EspNowTimeouty.Set(min(txTimeouts.load(), (uint32_t)UINT16_MAX));
+    EspNowDoruceno_B.Set(delivered);
+    EspNowGoodput_Bps.Set(windowBytes * 1000 / TELEMETRY_WINDOW_MS);
+
+    xSemaphoreGive(txMutex);
+}
+
+/* The late status of an abandoned frame is discarded instead of being credited to another frame */
+void ESPNowCtrl::AbandonFrame(uint32_t seq)
+{
+    TxSlot_t *slot = &txSlots[seq % TX_SLOTS];
+
+    portENTER_CRITICAL(&txLock);
+    if (slot->seq == seq)
+    {
+        slot->state = (slot->state == TX_SLOT_PENDING) ? TX_SLOT_ABANDONED : TX_SLOT_FREE;
+    }
+    portEXIT_CRITICAL(&txLock);
+}
+
+/* Lookup only, called with txLock held. Frames of peers never added share
+   PEER_LINK_OTHER so a stranger cannot push out the gateway's link state. */
+uint8_t ESPNowCtrl::findPeerLink(const uint8_t *mac_addr)
+{
+    for (uint8_t i = 0; i < MAX_PEER_LINKS; i++)
+    {
+        if (peerLinks[i].used && memcmp(peerLinks[i].mac_addr, mac_addr, 6) == 0)
+        {
+            return i;
+        }
+    }
+    return PEER_LINK_OTHER;
 }
 
-void ESPNowCtrl::onDataRecv(const uint8_t *mac_addr, const uint8_t *incomingData, int len)
+void ESPNowCtrl::initPeerLink(PeerLink_t *link, const uint8_t *mac_addr)
 {
-    if (len <= sizeof(Message))
+    memset(link, 0, sizeof(PeerLink_t));
+    memcpy(link->mac_addr, mac_addr, 6);
+    link->used = true;
+    /* A random start keeps a restarted camera out of the receiver's window */
+    link->txSeq = esp_random();
+    link->txPower = TX_POWER_MAX;
+}
+
+/* Links live in RTC memory, an added peer keeps its state over deep sleep.
+   When the table is full the links are replaced round robin. */
+void ESPNowCtrl::createPeerLink(const uint8_t *mac_addr)
+{
+    PeerLink_t link;
+    initPeerLink(&link, mac_addr);
+
+    portENTER_CRITICAL(&txLock);
+    if (findPeerLink(mac_addr) == PEER_LINK_OTHER)
     {
-        ESPNowItem_t msg;
-        memcpy(msg.mac_addr, mac_addr, 6);
-        memcpy(msg.data, incomingData, len);
-        msg.len = len;
+        uint8_t idx = peerLinkVictim;
+        for (uint8_t i = 0; i < MAX_PEER_LINKS; i++)
+        {
+            if (!peerLinks[i].used)
+            {
+                idx = i;
+                break;
+            }
+        }
+        if (idx == peerLinkVictim)
+        {
+            peerLinkVictim = (peerLinkVictim + 1) % MAX_PEER_LINKS;
+        }
+        peerLinks[idx] = link;
+    }
+    portEXIT_CRITICAL(&txLock);
+}
 
-        xQueueSendToBack(receiveQueue, &msg, pdMS_TO_TICKS(2000));
+void ESPNowCtrl::updateRtt(PeerLink_t *link, int32_t rtt_us)
+{
+    if (!link->rttValid)
+    {
+        link->srtt_us = rtt_us;
+        link->rttvar_us = rtt_us / 2;
+        link->rttValid = true;
+    }
+    else
+    {
+        link->rttvar_us += (abs(link->srtt_us - rtt_us) - link->rttvar_us) / 4;
+        link->srtt_us += (rtt_us - link->srtt_us) / 8;
     }
+    link->backoff = 0;
 }
 
-void ESPNowCtrl::Task()
+/* Status timeout of the next frame on the link, it doubles with every timeout until a status arrives */
+uint32_t ESPNowCtrl::linkTimeout(const PeerLink_t *link)
+{
+    uint32_t timeoutMs = SEND_STATUS_TIMEOUT_MS;
+    if (link->rttValid)
+    {
+        timeoutMs = ((link->srtt_us + 4 * link->rttvar_us) / 1000) << link->backoff;
+    }
+    return constrain(timeoutMs, RTO_MIN_MS, SEND_STATUS_TIMEOUT_MS);
+}
+
+uint32_t ESPNowCtrl::GetTimeout(const uint8_t *peer_addr)
+{
+    uint32_t timeoutMs;
+
+    portENTER_CRITICAL(&txLock);
+    timeoutMs = linkTimeout(&peerLinks[findPeerLink(peer_addr)]);
+    portEXIT_CRITICAL(&txLock);
+
+    return timeoutMs;
+}
+
+/* Exponential backoff with jitter before retrying a failed frame, derived from the smoothed RTT */
+uint32_t ESPNowCtrl::GetBackoff(const uint8_t *peer_addr, uint8_t retries)
+{
+    uint32_t base_us = SEND_STATUS_TIMEOUT_MS * 1000 / 20;
+
+    portENTER_CRITICAL(&txLock);
+    PeerLink_t *link = &peerLinks[findPeerLink(peer_addr)];
+    if (link->rttValid)
+    {
+        base_us = link->srtt_us + link->rttvar_us;
+    }
+    portEXIT_CRITICAL(&txLock);
+
+    uint32_t backoff_us = min((uint32_t)(BACKOFF_MAX_MS * 1000), base_us << min(retries, (uint8_t)BACKOFF_MAX_SHIFT));
+    backoff_us = backoff_us / 2 + esp_random() % (backoff_us / 2 + 1);
+    return max((uint32_t)1, backoff_us / 1000);
+}
+
+bool ESPNowCtrl::SendFrame(const uint8_t *peer_addr, Message *frame, uint8_t retryCount, uint8_t lane)
+{
+    bool res = false;
+    if (lane == LANE_CONTROL)
+    {
+        controlPending++;
+    }
+    for (uint8_t retries = 0; retries < retryCount; retries++)
+    {
+        if (lane != LANE_CONTROL)
+        {
+            AcquireBulk(lane, MESSAGE_HEADER_SIZE + GetPayloadSize(frame));
+        }
+        if (retries > 0)
+        {
+            txRetries++;
+        }
+        uint32_t seq = SubmitFrame(peer_addr, frame, lane, retries >= RATE_ROBUST_RETRY);
+        if (seq != 0 && WaitFrameDone(seq))
+        {
+            res = true;
+            break;
+        }
+        /* Nothing follows the last attempt, the caller gets its result without waiting */
+        if (retries + 1 < retryCount)
+        {
+            delay(GetBackoff(peer_addr, retries));
+        }
+    }
+    if (lane == LANE_CONTROL && --controlPending == 0)
+    {
+        wakeBulkLanes();
+    }
+    return res;
+}
+
+uint8_t ESPNowCtrl::OpenBulkLane(TickType_t wait)
 {
-    ESPNowItem_t data;
+    if (xSemaphoreTake(laneFree, wait) != pdTRUE)
+    {
+        return LANE_CONTROL;
+    }
+    uint8_t lane = LANE_CONTROL;
+    xSemaphoreTake(laneMutex, portMAX_DELAY);
+    for (uint8_t i = 0; i < MAX_BULK_LANES; i++)
+    {
+        if (!bulkLanes[i].active)
+        {
+            bulkLanes[i].active = true;
+            bulkLanes[i].waiting = false;
+            bulkLanes[i].pending = 0;
+            bulkLanes[i].deficit = 0;
+            lane = i;
+            break;
+        }
+    }
+    xSemaphoreGive(laneMutex);
+    return lane;
+}
+
+void ESPNowCtrl::CloseBulkLane(uint8_t lane)
+{
+    if (lane < MAX_BULK_LANES)
+    {
+        xSemaphoreTake(laneMutex, portMAX_DELAY);
+        bulkLanes[lane].active = false;
+        xSemaphoreGive(laneMutex);
+        xSemaphoreGive(laneFree);
+        wakeBulkLanes();
+    }
+}
+
+/* Wakes the lanes blocked in AcquireBulk to check their turn again */
+void ESPNowCtrl::wakeBulkLanes(void)
+{
+    xSemaphoreTake(laneMutex, portMAX_DELAY);
+    for (uint8_t i = 0; i < MAX_BULK_LANES; i++)
+    {
+        if (bulkLanes[i].active && bulkLanes[i].waiting)
+        {
+            xSemaphoreGive(bulkLanes[i].wake);
+        }
+    }
+    xSemaphoreGive(laneMutex);
+}
+
+/* Blocks the bulk transfer while control frames are pending. Each waiting lane
+   gets BULK_QUANTUM bytes per round, a new round starts once no waiting lane
+   has enough deficit left for its next frame. A blocked lane sleeps until the
+   last control frame is done or another lane took its turn. */
+void ESPNowCtrl::AcquireBulk(uint8_t lane, uint16_t bytes)
+{
+    if (lane >= MAX_BULK_LANES)
+    {
+        return;
+    }
 
-    if (xQueueReceive(receiveQueue, &data, portMAX_DELAY) == pdTRUE)
+    while (true)
     {
-        if (onDataReceivedCallback != NULL)
+        bool granted = false;
+        xSemaphoreTake(laneMutex, portMAX_DELAY);
+        BulkLane_t *own = &bulkLanes[lane];
+        own->waiting = true;
+        own->pending = bytes;
+        if (controlPending == 0)
         {
-            if (data.len < (sizeof(Message) - MAX_PAYLOAD_SIZE))
+            if (own->deficit < bytes)
             {
-                SystemLog::PutLog("ESP-Now data too short", v_warning);
-                return;
+                bool anyCanSend = false;
+                for (uint8_t i = 0; i < MAX_BULK_LANES; i++)
+                {
+                    if (bulkLanes[i].active && bulkLanes[i].waiting && bulkLanes[i].deficit >= bulkLanes[i].pending)
+                    {
+                        anyCanSend = true;
+                    }
+                }
+                if (!anyCanSend)
+                {
+                    for (uint8_t i = 0; i < MAX_BULK_LANES; i++)
+                    {
+                        if (bulkLanes[i].active && bulkLanes[i].waiting)
+                        {
+                            bulkLanes[i].deficit += BULK_QUANTUM;
+                        }
+                    }
+                }
             }
-            Message *msg = (Message *)data.data;
-            if (data.len != (sizeof(Message) - MAX_PAYLOAD_SIZE + msg->payloadSize))
+            if (own->deficit >= bytes)
             {
-                SystemLog::PutLog("ESP-Now data incorrect length", v_error);
-                return;
+                own->deficit -= bytes;
+                own->waiting = false;
+                granted = true;
             }
-            onDataReceivedCallback(data.mac_addr, msg, data.len);
         }
+        xSemaphoreGive(laneMutex);
+        if (granted)
+        {
+            wakeBulkLanes();
+            return;
+        }
+        xSemaphoreTake(own->wake, portMAX_DELAY);
     }
 }
 
-void ESPNowCtrl::onDataSent(const uint8_t *mac_addr, esp_now_send_status_t status)
+bool ESPNowCtrl::SendMessageInternal(const uint8_t *peer_addr, uint8_t messageType, const uint8_t *payload, uint8_t payloadSize, uint8_t retryCount)
 {
+    if (payloadSize > (MAX_PAYLOAD_SIZE))
+    {
+        Serial.printf("Payload size is too large: %d bytes, Max allowed: %d bytes\n", payloadSize, MAX_PAYLOAD_SIZE);
+        return false;
+    }
+
+    Message *frame = BorrowFrame(messageType);
+    if (frame == NULL)
+    {
+        return false;
+    }
+    memcpy(frame->payload, payload, payloadSize);
+    SetPayloadSize(frame, payloadSize);
+
+    bool res = SendFrame(peer_addr, frame, retryCount);
+    ReturnFrame(frame);
+    return res;
+}
+
+bool ESPNowCtrl::SendMessage(const uint8_t *peer_addr, uint8_t messageType, uint8_t retryCount)
+{
+    return SendMessageInternal(peer_addr, messageType, nullptr, 0, retryCount);
+}
+
+bool ESPNowCtrl::SendMessageRaw(const uint8_t *peer_addr, uint8_t messageType, const uint8_t *payloadData, uint8_t payloadSize)
+{
+    /* Fire and forget frames are control traffic, no wait for bulk lanes */
+    if (payloadSize > (MAX_PAYLOAD_SIZE))
+    {
+        Serial.printf("Payload size is too large: %d bytes, Max allowed: %d bytes\n", payloadSize, MAX_PAYLOAD_SIZE);
+        return false;
+    }
+
+    Message *frame = BorrowFrame(messageType);
+    if (frame == NULL)
+    {
+        return false;
+    }
+    memcpy(frame->payload, payloadData, payloadSize);
+    SetPayloadSize(frame, payloadSize);
+
+    uint32_t seq = SubmitFrame(peer_addr, frame);
+    if (seq != 0)
+    {
+        AbandonFrame(seq);
+    }
+    ReturnFrame(frame);
+    return seq != 0;
+}
+
+uint16_t ESPNowCtrl::GetMaxPayload(void)
+{
+    return constrain(EspNowMaxDelkaRamce.Get(), MAX_PAYLOAD_SIZE, MAX_FRAME_PAYLOAD_SIZE);
+}
+
+size_t ESPNowCtrl::GetDataChunkSize(void)
+{
+    return GetMaxPayload() - (MAX_FRAME_PAYLOAD_SIZE - MAX_DATA_SIZE);
+}
+
+/* Half as much parity again as the expected losses of a group covers most of their spread */
+uint8_t ESPNowCtrl::GetFecParity(const uint8_t *peer_addr)
+{
+    uint32_t parity = 0;
+    if (EspNowSchopnosti.Get() & CAP_FEC)
+    {
+        portENTER_CRITICAL(&txLock);
+        uint32_t loss = peerLinks[findPeerLink(peer_addr)].loss;
+        portEXIT_CRITICAL(&txLock);
+        if (loss >= FEC_MIN_LOSS_PERMILLE)
+        {
+            parity = min((uint32_t)FEC_MAX_PARITY, (FEC_GROUP_SIZE * loss * 3 / 2 + 999) / 1000);
+        }
+    }
+    EspNowFecParita.Set(parity);
+    return parity;
+}
+
+void ESPNowCtrl::FillByteStreamFrame(Message *frame, const uint8_t *data, size_t len, size_t index, size_t chunkSize, uint8_t tag)
+{
+    ByteStreamPayload *payload = (ByteStreamPayload *)frame->payload;
+    size_t bytesLeft = len - index;
+    size_t bytesToCopy = bytesLeft < chunkSize ? bytesLeft : chunkSize;
+
+    frame->messageType = MSG_BYTE_STREAM;
+    SetPayloadSize(frame, offsetof(ByteStreamPayload, data.data) + bytesToCopy);
+    payload->max_mr_bytes = len;
+    payload->type = tag;
+    payload->data.index = index;
+    payload->data.nmr = (bytesToCopy < PAYLOAD_SIZE_EXTENDED) ? bytesToCopy : PAYLOAD_SIZE_EXTENDED;
+    memcpy(payload->data.data, data + index, bytesToCopy);
+}
+
+/* Parity chunks have index SIZE_MAX and are never resent, group is the
+   FEC group slot of the chunk or FEC_TRACK_GROUPS when it belongs to none */
+typedef struct
+{
+    size_t index;
+    uint8_t attempts;
+    int8_t parity;
+    uint8_t group;
+    Message *frame;
+    uint32_t seq;
+} StreamChunk_t;
+
+/* Yields the chunks to be sent: first the ones reported missing by the receiver,
+   then the ones that were not sent yet. */
+typedef struct
+{
+    size_t next;
+    size_t len;
+    size_t chunkSize;
+    StreamAckPayload nack;
+    uint16_t nackBits;
+    uint16_t nackPos;
+} StreamCursor_t;
+
+static bool isInFlight(const StreamChunk_t *inFlight, uint8_t head, uint8_t nmrInFlight, size_t index)
+{
+    for (uint8_t i = 0; i < nmrInFlight; i++)
+    {
+        if (inFlight[(head + i) % STREAM_MAX_WINDOW].index == index)
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+static bool nextStreamChunk(StreamCursor_t &cursor, const StreamChunk_t *inFlight, uint8_t head, uint8_t nmrInFlight, size_t &index, bool &fromNack)
+{
+    while (cursor.nackPos < cursor.nackBits)
+    {
+        uint16_t bit = cursor.nackPos++;
+        if (cursor.nack.bitmap[bit / 8] & (1 << (bit % 8)))
+        {
+            index = cursor.nack.index + (size_t)bit * cursor.nack.chunkSize;
+            if (index < cursor.next && !isInFlight(inFlight, head, nmrInFlight, index))
+            {
+                fromNack = true;
+                return true;
+            }
+        }
+    }
+    if (cursor.next < cursor.len)
+    {
+        fromNack = false;
+        index = cursor.next;
+        cursor.next += min(cursor.chunkSize, cursor.len - cursor.next);
+        return true;
+    }
+    return false;
+}
+
+static void loadStreamNack(StreamCursor_t &cursor, const StreamFeedback_t &feedback)
+{
+    size_t payloadSize = feedback.size;
+    cursor.nack = feedback.ack;
+    size_t bitmapBytes = payloadSize > offsetof(StreamAckPayload, bitmap) ? payloadSize - offsetof(StreamAckPayload, bitmap) : 0;
+    cursor.nackBits = (cursor.nack.chunkSize > 0) ? bitmapBytes * 8 : 0;
+    cursor.nackPos = 0;
+}
+
+static bool submitStreamChunk(const uint8_t *peer_addr, StreamChunk_t &chunk, uint8_t lane)
+{
+    ESPNowCtrl::AcquireBulk(lane, MESSAGE_HEADER_SIZE + GetPayloadSize(chunk.frame));
+    chunk.seq = ESPNowCtrl::SubmitFrame(peer_addr, chunk.frame, lane);
+    if (chunk.seq == 0)
+    {
+        ESPNowCtrl::ReturnFrame(chunk.frame);
+        return false;
+    }
+    chunk.attempts = 1;
+    return true;
+}
+
+static bool sendByteStreamChunk(const uint8_t *peer_addr, const uint8_t *data, size_t len, size_t chunkSize, StreamChunk_t &chunk, const StreamFlow_t &flow)
+{
+    chunk.frame = ESPNowCtrl::BorrowFrame(MSG_BYTE_STREAM);
+    if (chunk.frame == NULL)
+    {
+        return false;
+    }
+    ESPNowCtrl::FillByteStreamFrame(chunk.frame, data, len, chunk.index, chunkSize, flow.tag);
+    chunk.parity = -1;
+    chunk.group = FEC_TRACK_GROUPS;
+    return submitStreamChunk(peer_addr, chunk, flow.lane);
+}
+
+static bool sendFecParityChunk(const uint8_t *peer_addr, FecEncoder &fec, size_t len, StreamChunk_t &chunk, const StreamFlow_t &flow)
+{
+    chunk.frame = ESPNowCtrl::BorrowFrame(MSG_FEC_PARITY);
+    if (chunk.frame == NULL)
+    {
+        return false;
+    }
+    fec.FillParity(chunk.frame, chunk.parity, len, (flow.tag != 0) ? (FEC_STREAM_TAG_FLAG | flow.tag) : MSG_BYTE_STREAM);
+    chunk.index = SIZE_MAX;
+    return submitStreamChunk(peer_addr, chunk, flow.lane);
+}
+
+static void releaseInFlight(StreamChunk_t *inFlight, uint8_t head, uint8_t nmrInFlight)
+{
+    for (uint8_t i = 0; i < nmrInFlight; i++)
+    {
+        StreamChunk_t *chunk = &inFlight[(head + i) % STREAM_MAX_WINDOW];
+        ESPNowCtrl::AbandonFrame(chunk->seq);
+        ESPNowCtrl::ReturnFrame(chunk->frame);
+    }
+}
+
+static size_t lowestInFlight(const StreamChunk_t *inFlight, uint8_t head, uint8_t nmrInFlight, size_t nextIndex)
+{
+    size_t lowest = nextIndex;
+    for (uint8_t i = 0; i < nmrInFlight; i++)
+    {
+        lowest = min(lowest, inFlight[(head + i) % STREAM_MAX_WINDOW].index);
+    }
+    return lowest;
+}
+
+uint8_t ESPNowCtrl::OpenStream(uint8_t type, TickType_t wait)
+{
+    bool mux = EspNowSchopnosti.Get() & CAP_STREAM_MUX;
+    uint8_t stream = STREAM_NONE;
+    TickType_t start = xTaskGetTickCount();
+
+    if (!mux && xSemaphoreTake(streamSerial, wait) != pdTRUE)
+    {
+        SystemLog::PutLog("ESP-Now stream wait timeout", v_warning);
+        return STREAM_NONE;
+    }
+    /* Waiting for a lane must not hold streamMutex, CloseStream frees lanes under it */
+    TickType_t waited = xTaskGetTickCount() - start;
+    uint8_t lane = OpenBulkLane((waited < wait) ? wait - waited : 0);
+    if (lane == LANE_CONTROL)
+    {
+        if (!mux)
+        {
+            xSemaphoreGive(streamSerial);
+        }
+        SystemLog::PutLog("ESP-Now stream wait timeout", v_warning);
+        return STREAM_NONE;
+    }
+    xSemaphoreTake(streamMutex, portMAX_DELAY);
+    for (uint8_t i = 0; i < MAX_STREAMS; i++)
+    {
+        if (!streams[i].used)
+        {
+            streams[i].tag = mux ? STREAM_TAG(nextStreamId(), type) : 0;
+            streams[i].used = true;
+            streams[i].serial = !mux;
+            streams[i].type = type;
+            streams[i].lane = lane;
+            xQueueReset(streams[i].feedback);
+            stream = i;
+            streamsOpen++;
+            break;
+        }
+    }
+    xSemaphoreGive(streamMutex);
+
+    if (stream == STREAM_NONE)
+    {
+        CloseBulkLane(lane);
+        if (!mux)
+        {
+            xSemaphoreGive(streamSerial);
+        }
+    }
+    return stream;
+}
+
+void ESPNowCtrl::CloseStream(uint8_t stream)
+{
+    if (stream >= MAX_STREAMS)
+    {
+        return;
+    }
+    xSemaphoreTake(streamMutex, portMAX_DELAY);
+    bool serial = streams[stream].serial;
+    CloseBulkLane(streams[stream].lane);
+    streams[stream].used = false;
+    streamsOpen--;
+    xSemaphoreGive(streamMutex);
+
+    if (serial)
+    {
+        xSemaphoreGive(streamSerial);
+    }
+}
+
+/* Consecutive streams get different ids, so a late ACK of a closed stream
+   never completes the next one of the same type and length. Called under
+   streamMutex, there are more ids than streams. */
+uint8_t ESPNowCtrl::nextStreamId(void)
+{
+    while (true)
+    {
+        streamId = streamId % STREAM_ID_MAX + 1;
+        bool used = false;
+        for (uint8_t i = 0; i < MAX_STREAMS; i++)
+        {
+            used |= streams[i].used && (streams[i].tag >> 4) == streamId;
+        }
+        if (!used)
+        {
+            return streamId;
+        }
+    }
+}
+
+bool ESPNowCtrl::SendStreamData(uint8_t stream, const uint8_t *peer_addr, const uint8_t *data, size_t len, size_t &offset, uint8_t window, uint8_t retryCount)
+{
+    if (stream >= MAX_STREAMS)
+    {
+        return false;
+    }
+    const StreamFlow_t &flow = streams[stream];
+    uint8_t lane = flow.lane;
+
+    /* In-flight chunks are kept as a FIFO in submit order, each tagged with the
+       sequence number of its frame. */
+    StreamChunk_t inFlight[STREAM_MAX_WINDOW];
+    uint8_t head = 0;
+    uint8_t nmrInFlight = 0;
+    uint8_t sendErrors = 0;
+    uint8_t ackTimeouts = 0;
+    bool ackSupported = EspNowSchopnosti.Get() & CAP_STREAM_ACK;
+    StreamCursor_t cursor;
+    StreamFeedback_t feedback;
+    /* Parity of a group is sent right after its last chunk, fecLost counts
+       the frames of each tracked group that did not make it */
+    FecEncoder fec;
+    uint8_t fecPending = 0;
+    uint8_t fecGroup = 0;
+    uint8_t fecLost[FEC_TRACK_GROUPS] = {0};
+
+    cursor.next = offset;
+    cursor.len = len;
+    cursor.chunkSize = GetDataChunkSize();
+    cursor.nackBits = 0;
+    cursor.nackPos = 0;
+
+    if (window == 0 || window > STREAM_MAX_WINDOW)
+    {
+        window = STREAM_MAX_WINDOW;
+    }
+    /* Open streams share the TX frame pool */
+    window = max(1, min((int)window, STREAM_MAX_WINDOW / max(1, (int)streamsOpen)));
+    fec.Begin(GetFecParity(peer_addr), cursor.chunkSize);
+
+    while (true)
+    {
+        StreamChunk_t chunk;
+        bool fromNack;
+        if (IsCancelled(flow.type))
+        {
+            releaseInFlight(inFlight, head, nmrInFlight);
+            return false;
+        }
+        while (nmrInFlight < window)
+        {
+            if (fecPending > 0)
+            {
+                chunk.parity = fec.Parity() - fecPending;
+                chunk.group = fecGroup;
+                if (!sendFecParityChunk(peer_addr, fec, len, chunk, flow))
+                {
+                    break;
+                }
+                if (--fecPending == 0)
+                {
+                    fec.NextGroup();
+                    fecGroup = (fecGroup + 1) % FEC_TRACK_GROUPS;
+                    fecLost[fecGroup] = 0;
+                }
+            }
+            else
+            {
+                if (!nextStreamChunk(cursor, inFlight, head, nmrInFlight, chunk.index, fromNack))
+                {
+                    break;
+                }
+                if (!sendByteStreamChunk(peer_addr, data, len, cursor.chunkSize, chunk, flow))
+                {
+                    /* Driver queue is full, put the chunk back to the cursor */
+                    if (fromNack)
+                    {
+                        cursor.nackPos--;
+                    }
+                    else
+                    {
+                        cursor.next = chunk.index;
+                    }
+                    break;
+                }
+                /* Resent chunks are not part of any group */
+                if (fec.Active() && !fromNack)
+                {
+                    fec.Add(chunk.index, data + chunk.index, min(cursor.chunkSize, len - chunk.index));
+                    chunk.group = fecGroup;
+                    if (fec.GroupFull() || cursor.next >= len)
+                    {
+                        fecPending = fec.Parity();
+                    }
+                }
+            }
+            inFlight[(head + nmrInFlight) % STREAM_MAX_WINDOW] = chunk;
+            nmrInFlight++;
+        }
+
+        if (nmrInFlight == 0)
+        {
+            if (cursor.next < len || cursor.nackPos < cursor.nackBits || fecPending > 0)
+            {
+                /* Nothing queued, the driver refused the frame */
+                if (++sendErrors > retryCount)
+                {
+                    return false;
+                }
+                delay(GetBackoff(peer_addr, sendErrors));
+                continue;
+            }
+
+            /* Everything was delivered on MAC level, ask the receiver what it really stored.
+               A receiver without stream feedback has only the MAC level status. */
+            if (!ackSupported)
+            {
+                offset = len;
+                return true;
+            }
+            if (xQueueReceive(flow.feedback, &feedback, pdMS_TO_TICKS(STREAM_ACK_TIMEOUT_MS)) != pdPASS)
+            {
+                if (++ackTimeouts >= STREAM_ACK_ATTEMPTS)
+                {
+                    return false;
+                }
+                /* Resend the last chunk to prompt the receiver for feedback */
+                chunk.index = len - ((len - 1) % cursor.chunkSize) - 1;
+                if (sendByteStreamChunk(peer_addr, data, len, cursor.chunkSize, chunk, flow))
+                {
+                    inFlight[head] = chunk;
+                    nmrInFlight = 1;
+                }
+                continue;
+            }
+        }
+        else
+        {
+            sendErrors = 0;
+
+            /* Statuses come in submit order, the oldest frame in flight completes first */
+            chunk = inFlight[head];
+            head = (head + 1) % STREAM_MAX_WINDOW;
+            nmrInFlight--;
+
+            bool timedOut;
+            if (WaitFrameDone(chunk.seq, &timedOut))
+            {
+                ReturnFrame(chunk.frame);
+            }
+            else if (chunk.parity >= 0 || (chunk.group < FEC_TRACK_GROUPS && fecLost[chunk.group] < fec.Parity()))
+            {
+                /* The receiver rebuilds the chunk from the parity of its group */
+                fecLost[chunk.group]++;
+                ReturnFrame(chunk.frame);
+            }
+            else if (timedOut && ackSupported)
+            {
+                /* Without a status the chunk may well have arrived, a copy would be
+                   sent blindly. The receiver's NACK asks for it if it did not. */
+                ReturnFrame(chunk.frame);
+            }
+            else
+            {
+                /* Only the failed chunk is retransmitted from its own frame, the rest of the window stays in flight.
+                   Its last retries go at the robust rate, a rate that just died would eat them all
+                   before the fallback reaches a working one. */
+                if (chunk.attempts < retryCount)
+                {
+                    txRetries++;
+                    AcquireBulk(lane, MESSAGE_HEADER_SIZE + GetPayloadSize(chunk.frame));
+                }
+                if (chunk.attempts >= retryCount || (chunk.seq = SubmitFrame(peer_addr, chunk.frame, lane, chunk.attempts >= RATE_ROBUST_RETRY)) == 0)
+                {
+                    ReturnFrame(chunk.frame);
+                    releaseInFlight(inFlight, head, nmrInFlight);
+                    return false;
+                }
+                chunk.attempts++;
+                inFlight[(head + nmrInFlight) % STREAM_MAX_WINDOW] = chunk;
+                nmrInFlight++;
+            }
+            /* Holes below the offset are recovered from receiver feedback */
+            offset = max(offset, lowestInFlight(inFlight, head, nmrInFlight, cursor.next));
+
+            if (xQueueReceive(flow.feedback, &feedback, 0) != pdPASS)
+            {
+                continue;
+            }
+        }
+
+        /* Receiver feedback for another stream is ignored */
+        StreamAckPayload *ack = &feedback.ack;
+        if (ack->max_mr_bytes != len)
+        {
+            continue;
+        }
+        ackTimeouts = 0;
+        offset = max(offset, (size_t)ack->index);
+        if (feedback.messageType == MSG_ACK && ack->index >= len)
+        {
+            releaseInFlight(inFlight, head, nmrInFlight);
+            offset = len;
+            return true;
+        }
+        if (feedback.messageType == MSG_NACK)
+        {
+            loadStreamNack(cursor, feedback);
+        }
+    }
+}
+
+void ESPNowCtrl::CancelStreams(uint8_t type, bool cancel)
+{
+    if (type >= 32)
+    {
+        return;
+    }
+    if (cancel)
+    {
+        cancelledTypes |= (1UL << type);
+    }
+    else
+    {
+        cancelledTypes &= ~(1UL << type);
+    }
+}
+
+bool ESPNowCtrl::IsCancelled(uint8_t type)
+{
+    return type < 32 && (cancelledTypes & (1UL << type));
+}
+
+/* Feedback goes to the stream with the tag it carries, streams to a receiver
+   without CAP_STREAM_MUX have tag 0 and there is only one of them at a time */
+void ESPNowCtrl::PutStreamFeedback(const Message *msg)
+{
+    StreamFeedback_t feedback;
+    const uint8_t *payload = msg->payload;
+    uint16_t payloadSize = GetPayloadSize(msg);
+    uint8_t tag = 0;
+
+    if (EspNowSchopnosti.Get() & CAP_STREAM_MUX)
+    {
+        if (payloadSize == 0)
+        {
+            return;
+        }
+        tag = *payload++;
+        payloadSize--;
+    }
+    feedback.messageType = msg->messageType;
+    feedback.size = min((size_t)payloadSize, sizeof(StreamAckPayload));
+    memset(&feedback.ack, 0, sizeof(feedback.ack));
+    memcpy(&feedback.ack, payload, feedback.size);
+
+    xSemaphoreTake(streamMutex, portMAX_DELAY);
+    for (uint8_t i = 0; i < MAX_STREAMS; i++)
+    {
+        if (streams[i].used && streams[i].tag == tag)
+        {
+            xQueueSendToBack(streams[i].feedback, &feedback, 0);
+            break;
+        }
+    }
+    xSemaphoreGive(streamMutex);
+}
+
+bool ESPNowCtrl::Defer(const uint8_t *mac_addr, const Message *msg, int len, DataReceivedCallback handler, bool coalesce)
+{
+    uint32_t typeBit = coalesce ? 1UL << (msg->messageType % 32) : 0;
+    if (deferredTypes.fetch_or(typeBit) & typeBit)
+    {
+        return true;
+    }
+
+    DeferredJob_t job;
+    job.handler = handler;
+    memcpy(job.mac_addr, mac_addr, 6);
+    job.len = len;
+    /* The RX slot ends with the frame, only an extended payload has its length stored behind it */
+    memcpy(&job.msg, msg, len);
+    if (msg->payloadSize == PAYLOAD_SIZE_EXTENDED)
+    {
+        job.msg.extPayloadSize = msg->extPayloadSize;
+    }
+
+    deferredBusy++;
+    if (xQueueSendToBack(deferredQueue, &job, 0) != pdTRUE)
+    {
+        deferredBusy--;
+        deferredTypes &= ~typeBit;
+        SystemLog::PutLog("ESP-Now handler queue full", v_warning);
+        return false;
+    }
+    return true;
+}
+
+/* A request arriving while its handler runs is queued again, it asks for fresh data */
+void ESPNowCtrl::deferredWorker(void *arg)
+{
+    DeferredJob_t job;
+    while (true)
+    {
+        if (xQueueReceive(deferredQueue, &job, portMAX_DELAY) == pdTRUE)
+        {
+            deferredTypes &= ~(1UL << (job.msg.messageType % 32));
+            job.handler(job.mac_addr, &job.msg, job.len);
+            deferredBusy--;
+        }
+    }
+}
+
+void ESPNowCtrl::SetDataReceivedCallback(DataReceivedCallback callback)
+{
+    onDataReceivedCallback = callback;
+}
+
+void ESPNowCtrl::SetDataSentCallback(DataSentCallback callback)
+{
+    onDataSentCallback = callback;
+}
+
+template <size_t Size, size_t DataSize>
+void ESPNowCtrl::putRxItem(RxRing_t<Size, DataSize> &ring, const uint8_t *mac_addr, const uint8_t *incomingData, int len, int8_t rssi)
+{
+    uint32_t head = ring.head.load(std::memory_order_relaxed);
+    if ((head - ring.tail.load(std::memory_order_acquire)) >= Size)
+    {
+        rxDropped++;
+        return;
+    }
+
+    ESPNowItem_t<DataSize> *item = &ring.slots[head % Size];
+    memcpy(item->mac_addr, mac_addr, 6);
+    item->rssi = rssi;
+    memcpy(item->data, incomingData, len);
+    item->len = len;
+
+    ring.head.store(head + 1, std::memory_order_release);
+    xSemaphoreGive(rxSignal);
+}
+
+/* Runs in the receive context of the transport and must not block. The packet
+   is copied once into a free RX slot, the slot is then handed to ESPNowCtrl::Task
+   through a single producer single consumer index ring. Firmware data goes to
+   the bulk ring so it never delays control messages, so do the few control
+   frames with an extended payload, a control slot has no room for them. */
+void ESPNowCtrl::onDataRecv(const uint8_t *mac_addr, const uint8_t *incomingData, int len, int8_t rssi)
+{
+    if (len > (int)(MESSAGE_HEADER_SIZE + MAX_FRAME_PAYLOAD_SIZE + MSG_SEQ_SIZE))
+    {
+        rxOverflow++;
+        return;
+    }
+
+    /* An extended payload has its length stored behind the frame on dispatch */
+    bool extended = len > (int)RX_CONTROL_FRAME_SIZE || (len > 1 && incomingData[1] == PAYLOAD_SIZE_EXTENDED);
+    if ((len > 0 && incomingData[0] == MSG_FW_UPDATE_REQUEST) || extended)
+    {
+        putRxItem(rxBulk, mac_addr, incomingData, len, rssi);
+    }
+    else
+    {
+        putRxItem(rxControl, mac_addr, incomingData, len, rssi);
+    }
+}
+
+template <size_t Size, size_t DataSize>
+void ESPNowCtrl::dispatchRxItem(RxRing_t<Size, DataSize> &ring)
+{
+    uint32_t tail = ring.tail.load(std::memory_order_relaxed);
+    ESPNowItem_t<DataSize> *data = &ring.slots[tail % Size];
+
+    if (data->rssi != 0)
+    {
+        portENTER_CRITICAL(&txLock);
+        uint8_t idx = findPeerLink(data->mac_addr);
+        if (idx != PEER_LINK_OTHER)
+        {
+            PeerLink_t *link = &peerLinks[idx];
+            link->rssi = (link->rssi == 0) ? data->rssi : (link->rssi * 3 + data->rssi) / 4;
+        }
+        portEXIT_CRITICAL(&txLock);
+
+        /* A burst of frames would flood the chart history, it gets one sample per window */
+        uint32_t now = millis();
+        if (!rssiSampled || now - rssiSampleAt >= TELEMETRY_WINDOW_MS)
+        {
+            rssiSampled = true;
+            rssiSampleAt = now;
+            EspNowRssi_dBm.Set(data->rssi);
+        }
+    }
+
+    /* Numbered frames are stripped of the trailer, copies of frames already seen are dropped */
+    Message *msg = (Message *)data->data;
+    bool replay = false;
+    if (data->len >= (int)(MESSAGE_HEADER_SIZE + MSG_SEQ_SIZE) && (msg->messageType & MSG_SEQ_FLAG))
+    {
+        uint16_t seq;
+        data->len -= MSG_SEQ_SIZE;
+        memcpy(&seq, data->data + data->len, MSG_SEQ_SIZE);
+        msg->messageType &= ~MSG_SEQ_FLAG;
+
+        /* Peers never added have no window of their own */
+        portENTER_CRITICAL(&txLock);
+        uint8_t idx = findPeerLink(data->mac_addr);
+        replay = (idx != PEER_LINK_OTHER) && isReplay(&peerLinks[idx], seq);
+        portEXIT_CRITICAL(&txLock);
+        if (replay)
+        {
+            EspNowDuplicity.Set(++rxReplays);
+        }
+    }
+
+    if (onDataReceivedCallback != NULL && !replay)
+    {
+        if (data->len < (int)MESSAGE_HEADER_SIZE)
+        {
+            SystemLog::PutLog("ESP-Now data too short", v_warning);
+        }
+        else if (msg->payloadSize == PAYLOAD_SIZE_EXTENDED && data->len - (int)MESSAGE_HEADER_SIZE > MAX_PAYLOAD_SIZE)
+        {
+            msg->extPayloadSize = data->len - MESSAGE_HEADER_SIZE;
+            onDataReceivedCallback(data->mac_addr, msg, data->len);
+        }
+        else if (data->len != (int)(MESSAGE_HEADER_SIZE + msg->payloadSize))
+        {
+            SystemLog::PutLog("ESP-Now data incorrect length", v_error);
+        }
+        else
+        {
+            onDataReceivedCallback(data->mac_addr, msg, data->len);
+        }
+    }
+
+    /* The slot is released only after the handler is done with it */
+    ring.tail.store(tail + 1, std::memory_order_release);
+}
+
+/* Control messages are always dispatched before pending bulk data */
+void ESPNowCtrl::Task()
+{
+    while (rxControl.empty() && rxBulk.empty())
+    {
+        xSemaphoreTake(rxSignal, portMAX_DELAY);
+    }
+
+    EspNowZahozeno.Set(rxDropped.load());
+    EspNowPreteceni.Set(rxOverflow.load());
+
+    if (!rxControl.empty())
+    {
+        dispatchRxItem(rxControl);
+    }
+    else
+    {
+        dispatchRxItem(rxBulk);
+    }
+}
+
+/* Hands the status to the waiting task, returns the task to be notified */
+TaskHandle_t ESPNowCtrl::completeSlot(TxSlot_t *slot, esp_now_send_status_t status)
+{
+    if (slot->state == TX_SLOT_PENDING)
+    {
+        slot->status = status;
+        slot->state = TX_SLOT_DONE;
+        return slot->task;
+    }
+    if (slot->state == TX_SLOT_ABANDONED)
+    {
+        slot->state = TX_SLOT_FREE;
+    }
+    return NULL;
+}
+
+bool ESPNowCtrl::statusLost(const TxSlot_t *slot, uint32_t now)
+{
+    return slot->state == TX_SLOT_ABANDONED && (uint32_t)(now - slot->sentAt) >= TX_STATUS_LOST_MS * 1000UL;
+}
+
+/* Completes the frames up to upTo whose status will not come as failed, called
+   with txLock held. Returns the number of tasks stored to woken. */
+uint8_t ESPNowCtrl::skipStatuses(uint32_t upTo, TaskHandle_t *woken)
+{
+    uint8_t nmrWoken = 0;
+    while (txDoneSeq != upTo && txDoneSeq != txNextSeq)
+    {
+        TxSlot_t *slot = &txSlots[txDoneSeq % TX_SLOTS];
+        if (slot->seq == txDoneSeq)
+        {
+            TaskHandle_t task = completeSlot(slot, ESP_NOW_SEND_FAIL);
+            if (task != NULL)
+            {
+                woken[nmrWoken++] = task;
+            }
+        }
+        txDoneSeq++;
+    }
+    return nmrWoken;
+}
+
+/* The status belongs to the oldest frame of the peer. Frames of other peers
+   before it and abandoned frames past TX_STATUS_LOST_MS lost their statuses. */
+void ESPNowCtrl::onDataSent(const uint8_t *mac_addr, esp_now_send_status_t status)
+{
+    TaskHandle_t woken[TX_SLOTS + 1];
+    uint8_t nmrWoken = 0;
+
+    portENTER_CRITICAL(&txLock);
+    uint32_t now = micros();
+    uint32_t seq = txDoneSeq;
+    while (seq != txNextSeq && (memcmp(txSlots[seq % TX_SLOTS].mac_addr, mac_addr, 6) != 0 || statusLost(&txSlots[seq % TX_SLOTS], now)))
+    {
+        seq++;
+    }
+    if (seq != txNextSeq)
+    {
+        nmrWoken = skipStatuses(seq, woken);
+        TxSlot_t *slot = &txSlots[txDoneSeq % TX_SLOTS];
+        if (slot->seq == txDoneSeq)
+        {
+            /* Frames queued behind others are timed from the previous status */
+            int32_t rtt_us = now - ((int32_t)(slot->sentAt - txLastDoneAt) > 0 ? slot->sentAt : txLastDoneAt);
+            txLastDoneAt = now;
+            if (status == ESP_NOW_SEND_SUCCESS)
+            {
+                updateRtt(&peerLinks[slot->link], rtt_us);
+                txDelivered += slot->len;
+            }
+            if (slot->rate != PHY_RATE_NONE)
+            {
+                PeerLink_t *link = &peerLinks[slot->link];
+                /* Rate probes fail by design, they say nothing about the power */
+                if (slot->rate <= link->bulkRate && slot->power == link->txPower && link->powerSent < UINT8_MAX)
+                {
+                    link->powerSent++;
+                    link->powerFailed += (status == ESP_NOW_SEND_SUCCESS) ? 0 : 1;
+                }
+                link->loss = ((uint32_t)link->loss * 15 + ((status == ESP_NOW_SEND_SUCCESS) ? 0 : 1000)) / 16;
+                /* A channel that got worse would otherwise eat the retries of whole
+                   stats intervals before the averaged probability lets go of the rate */
+                if (status == ESP_NOW_SEND_SUCCESS)
+                {
+                    link->bulkFailures = (slot->rate <= link->bulkRate) ? 0 : link->bulkFailures;
+                }
+                else if (slot->rate == link->bulkRate && ++link->bulkFailures >= RATE_FALLBACK_FAILURES && link->bulkRate > PHY_RATE_ROBUST)
+                {
+                    link->rates[link->bulkRate].prob /= 2;
+                    link->bulkRate--;
+                    link->bulkFailures = 0;
+                }
+                RateStats_t *st = &peerLinks[slot->link].rates[slot->rate];
+                if (st->attempts < UINT16_MAX)
+                {
+                    st->attempts++;
+                    st->success += (status == ESP_NOW_SEND_SUCCESS) ? 1 : 0;
+                }
+            }
+
+            TaskHandle_t task = completeSlot(slot, status);
+            if (task != NULL)
+            {
+                woken[nmrWoken++] = task;
+            }
+        }
+        txDoneSeq++;
+    }
+    portEXIT_CRITICAL(&txLock);
+
+    for (uint8_t i = 0; i < nmrWoken; i++)
+    {
+        xTaskNotifyGive(woken[i]);
+    }
     // if (onDataSentCallback != NULL)
     // {
     //     onDataSentCallback(mac_addr, status);
     // }
-    xQueueSendToBack(sendQueue, &status, portMAX_DELAY);
 }
 
+/* Holds only until the next unicast frame, the power control sets its own level */
 void ESPNowCtrl::SetPower(wifi_power_t power)
 {
-    WiFi.setTxPower(power);
+    transport->SetPower(power);
+    currentPower = TX_POWER_NONE;
 }
\ No newline at end of file
@@ -17,13 +17,79 @@
 #include "esp_now.h"
 #include "freertos/semphr.h"
 #include "WiFiGeneric.h"
+#include "esp_wifi.h"
+#include "transport.h"
+#include <atomic>
 
 #define MAX_PAYLOAD_SIZE 240
 #define MAX_PACKET_SIZE 250
+/* ESP-NOW v2 stacks carry frames up to ESP_NOW_MAX_DATA_LEN_V2, they are used
+   only when both sides agreed on them during pairing */
+#ifdef ESP_NOW_MAX_DATA_LEN_V2
+#define MAX_FRAME_PAYLOAD_SIZE (ESP_NOW_MAX_DATA_LEN_V2 - 10)
+#else
+#define MAX_FRAME_PAYLOAD_SIZE MAX_PAYLOAD_SIZE
+#endif
+#define MAX_DATA_SIZE (MAX_FRAME_PAYLOAD_SIZE - 10)
+#define PAYLOAD_SIZE_EXTENDED 0xFF
 #define MAX_CHANNEL 13
 #define MAX_PARAM_DEFS 5
 #define MAX_PARAM_READS_WRITES 118
 
+#define STREAM_WINDOW_SIZE 4
+#define STREAM_MAX_WINDOW 8
+#define SEND_STATUS_TIMEOUT_MS 1000
+#define TX_STATUS_LOST_MS (2 * SEND_STATUS_TIMEOUT_MS) /* An abandoned frame still without status by then lost it */
+#define STREAM_ACK_TIMEOUT_MS 300
+#define STREAM_ACK_ATTEMPTS 3
+#define STREAM_OPEN_TIMEOUT_MS 30000
+#define STREAM_ACK_BITMAP_SIZE (MAX_PAYLOAD_SIZE - 10)
+#define TX_POOL_SIZE (STREAM_MAX_WINDOW + 4)
+#define RX_CONTROL_POOL_SIZE 8
+#define RX_BULK_POOL_SIZE 8
+#define TX_SLOTS 16
+#define MAX_PEER_LINKS 4
+#define PEER_LINK_OTHER MAX_PEER_LINKS /* Shared by the peers never added */
+#define RTO_MIN_MS 10
+#define BACKOFF_MAX_MS 500
+#define BACKOFF_MAX_SHIFT 6
+#define MAX_BULK_LANES 4
+#define BULK_QUANTUM (2 * (MESSAGE_HEADER_SIZE + MAX_FRAME_PAYLOAD_SIZE))
+#define LANE_CONTROL 0xFF
+#define TELEMETRY_WINDOW_MS 1000
+#define TELEMETRY_CHART_SAMPLES 60
+#define PHY_RATE_COUNT 10
+#define PHY_RATE_ROBUST 0
+#define PHY_RATE_NONE 0xFF
+#define RATE_STATS_INTERVAL_MS 100
+#define RATE_SAMPLE_INTERVAL 10
+#define RATE_PROB_SCALE 1000
+#define RATE_FALLBACK_FAILURES 3 /* Failures in a row at the bulk rate that step it down at once */
+#define RATE_ROBUST_RETRY 2      /* Retries of a frame after which it goes at the robust rate */
+#define TX_POWER_COUNT 10
+#define TX_POWER_MAX (TX_POWER_COUNT - 1)
+#define TX_POWER_NONE 0xFF
+#define POWER_WINDOW_FRAMES 16
+#define POWER_FAIL_STEP_UP 2
+#define POWER_LOSS_TARGET_PERMILLE 50
+#define POWER_RSSI_MIN_DBM -70
+#define RADIO_RX_CURRENT_MA 100
+#define SUPPLY_VOLTAGE_MV 3300
+#define FEC_GROUP_SIZE 8
+#define FEC_MAX_PARITY 4
+#define FEC_MIN_LOSS_PERMILLE 20
+#define FEC_TRACK_GROUPS 4
+#define MSG_SEQ_FLAG 0x80
+#define MSG_SEQ_SIZE 2
+#define RX_SEQ_WINDOW 32
+#define RX_SEQ_RESYNC 1024
+#define DEFERRED_QUEUE_SIZE 4
+#define MAX_STREAMS 4
+#define STREAM_ID_MAX 7 /* Ids stay clear of FEC_STREAM_TAG_FLAG */
+#define STREAM_NONE 0xFF
+#define STREAM_FEEDBACK_QUEUE_SIZE 2
+#define DEFERRED_WORKERS 1
+
 extern uint8_t BroadcastAddress[];
 
 typedef enum
@@ -55,6 +121,11 @@ typedef enum
     MSG_BYTE_STREAM,
     MSG_DISCOVERY,
     MSG_ACK,
+    MSG_STREAM_RESUME,
+    MSG_WAKE_REPORT,
+    MSG_WAKE_REPLY,
+    MSG_FEC_PARITY,
+    MSG_STREAM_CANCEL,
 } MessageType_t;
 
 typedef enum
@@ -65,17 +136,49 @@ typedef enum
     PAIR_STATE_EXPIRED
 } PairingState_t;
 
+/* payloadSize is PAYLOAD_SIZE_EXTENDED in frames longer than MAX_PAYLOAD_SIZE,
+   their size is given by the frame length. extPayloadSize and seq are not transmitted.
+   With CAP_SEQUENCE the messageType has MSG_SEQ_FLAG set and the per-peer sequence
+   number follows the payload as the last MSG_SEQ_SIZE bytes of the frame. */
 typedef struct
 {
     uint8_t messageType;
     uint8_t payloadSize;
-    uint8_t payload[MAX_PAYLOAD_SIZE];
+    uint8_t payload[MAX_FRAME_PAYLOAD_SIZE + MSG_SEQ_SIZE];
+    uint16_t extPayloadSize;
+    uint16_t seq;
 } __attribute__((packed)) Message;
 
+#define MESSAGE_HEADER_SIZE offsetof(Message, payload)
+
+static inline uint16_t GetPayloadSize(const Message *msg)
+{
+    return (msg->payloadSize == PAYLOAD_SIZE_EXTENDED) ? msg->extPayloadSize : msg->payloadSize;
+}
+
+static inline void SetPayloadSize(Message *msg, uint16_t size)
+{
+    msg->payloadSize = (size > MAX_PAYLOAD_SIZE) ? PAYLOAD_SIZE_EXTENDED : size;
+    msg->extPayloadSize = size;
+    /* New content, the next submit numbers the frame again */
+    msg->seq = 0;
+}
+
+#define CAP_LARGE_FRAMES 0x01
+#define CAP_FEC 0x02
+#define CAP_SEQUENCE 0x04
+#define CAP_STREAM_MUX 0x08
+#define CAP_SLOTS 0x10
+#define CAP_THUMBNAIL 0x20
+#define CAP_STREAM_ACK 0x40 /* Receiver confirms byte streams with MSG_ACK and reports gaps with MSG_NACK */
+
+/* maxPayload and capabilities are appended, legacy gateways read only the first fields */
 typedef struct
 {
     uint8_t deviceType;
     uint8_t channel;
+    uint16_t maxPayload;
+    uint8_t capabilities;
 } __attribute__((packed)) PairRequestPayload;
 
 typedef struct
@@ -83,14 +186,46 @@ typedef struct
     uint8_t deviceType;
     uint8_t channel;
     uint8_t state;
+    uint16_t maxPayload;
+    uint8_t capabilities;
 } __attribute__((packed)) PairResponsePayload;
 
-typedef struct
+#define PAIR_RESPONSE_LEGACY_SIZE offsetof(PairResponsePayload, maxPayload)
+
+/* Control slots take frames of the legacy size only, frames with an extended
+   payload go to the bulk ring. A bulk slot holds a whole Message, the length
+   of the extended payload is stored into it on dispatch. */
+#define RX_CONTROL_FRAME_SIZE (MESSAGE_HEADER_SIZE + MAX_PAYLOAD_SIZE + MSG_SEQ_SIZE)
+#define RX_BULK_FRAME_SIZE sizeof(Message)
+
+template <size_t DataSize>
+struct ESPNowItem_t
 {
     uint8_t mac_addr[6];
+    int8_t rssi;
     int len;
-    uint8_t data[MAX_PACKET_SIZE];
-} ESPNowItem_t;
+    uint8_t data[DataSize];
+};
+
+/* Single producer single consumer ring of received packets */
+template <size_t Size, size_t DataSize>
+struct RxRing_t
+{
+    ESPNowItem_t<DataSize> slots[Size];
+    std::atomic<uint32_t> head;
+    std::atomic<uint32_t> tail;
+
+    bool empty(void) { return tail.load(std::memory_order_relaxed) == head.load(std::memory_order_acquire); }
+};
+
+typedef struct
+{
+    bool active;
+    bool waiting;
+    uint16_t pending;
+    int32_t deficit;
+    SemaphoreHandle_t wake;
+} BulkLane_t;
 
 typedef struct
 {
@@ -142,14 +277,16 @@ typedef struct
             uint8_t : 6;
         };
     };
-    uint8_t data[230];
+    uint8_t data[MAX_DATA_SIZE];
 } __attribute__((packed)) UpdateRequestPayload;
 
+/* nmr is PAYLOAD_SIZE_EXTENDED when the data does not fit into it, the data
+   then runs to the end of the frame */
 typedef struct
 {
     uint32_t index;
     uint8_t nmr;
-    uint8_t data[230];
+    uint8_t data[MAX_DATA_SIZE];
 } __attribute__((packed)) DataPayload;
 
 typedef struct
@@ -160,11 +297,30 @@ typedef struct
     int32_t sunsetTime;
 } __attribute__((packed)) TimeSyncPayload;
 
+/* The slot fields are sent only with CAP_SLOTS. From the camera they announce
+   its next wake, from the gateway they assign the slot: slotPeriod 0 removes it. */
 typedef struct
 {
     uint32_t sleepTime;
+    uint32_t slotPeriod;  /* s */
+    uint32_t slotStartIn; /* ms from this frame to the start of the next slot */
 } __attribute__((packed)) SleepPayload;
 
+#define SLEEP_LEGACY_SIZE offsetof(SleepPayload, slotPeriod)
+
+typedef enum
+{
+    STREAM_TYPE_RAW = 0,
+    STREAM_TYPE_IMAGE,
+    STREAM_TYPE_THUMBNAIL,
+    STREAM_TYPE_LOG,        /* Log_t records, the older log file first */
+    STREAM_TYPE_PARAM_DEFS, /* pardef_t_espnow records */
+} StreamType_t;
+
+/* type is 0 in streams of a receiver without CAP_STREAM_MUX, otherwise the
+   stream id (1..STREAM_ID_MAX) in the upper and StreamType_t in the lower nibble */
+#define STREAM_TAG(id, streamType) (((id) << 4) | ((streamType) & 0x0F))
+
 typedef struct
 {
     uint32_t max_mr_bytes;
@@ -172,21 +328,250 @@ typedef struct
     DataPayload data;
 } __attribute__((packed)) ByteStreamPayload;
 
+/* Receiver feedback for a byte stream, sent only with CAP_STREAM_ACK. MSG_ACK
+   confirms the whole stream, MSG_NACK lists missing chunks: bit i of the bitmap
+   stands for the chunk starting at index + i * chunkSize. With CAP_STREAM_MUX the
+   payload starts with the ByteStreamPayload::type of the stream followed by this
+   structure. */
+typedef struct
+{
+    uint32_t max_mr_bytes;
+    uint32_t index;
+    uint16_t chunkSize;
+    uint8_t bitmap[STREAM_ACK_BITMAP_SIZE];
+} __attribute__((packed)) StreamAckPayload;
+
+/* Sent by the client after re-pairing in the middle of a stream, the receiver
+   answers with the same message carrying the offset to continue from. The
+   stream is identified the same way as in its chunks, by type and max_mr_bytes. */
+typedef struct
+{
+    uint8_t type;
+    uint32_t max_mr_bytes;
+    uint32_t index;
+} __attribute__((packed)) StreamResumePayload;
+
+/* With CAP_THUMBNAIL every image goes after its STREAM_TYPE_THUMBNAIL preview.
+   The receiver cancels open and further streams of streamType until the
+   camera starts the next preview. */
+typedef struct
+{
+    uint8_t streamType;
+} __attribute__((packed)) StreamCancelPayload;
+
+/* Receiver feedback as queued for the stream it belongs to, without the stream tag */
+typedef struct
+{
+    uint8_t messageType;
+    uint16_t size;
+    StreamAckPayload ack;
+} StreamFeedback_t;
+
+/* Flow state of one outgoing stream, each has its own bulk lane and feedback */
+typedef struct
+{
+    bool used;
+    bool serial;
+    uint8_t type;
+    uint8_t tag;
+    uint8_t lane;
+    QueueHandle_t feedback;
+} StreamFlow_t;
+
+/* Reed-Solomon parity of groupSize consecutive chunks of a MSG_BYTE_STREAM
+   transfer, the first one starts at groupIndex.
+   Shorter chunks are zero padded to the length of data, see fec.h.
+   streamType of a multiplexed stream is its tag with FEC_STREAM_TAG_FLAG. */
+#define FEC_STREAM_TAG_FLAG 0x80
+typedef struct
+{
+    uint32_t max_mr_bytes;
+    uint8_t streamType;
+    uint32_t groupIndex;
+    uint8_t groupSize : 4;
+    uint8_t parityIdx : 4;
+    uint8_t data[MAX_DATA_SIZE];
+} __attribute__((packed)) FecParityPayload;
+
+#define WAKE_FLAG_TIME_SYNC 0x01 /* Report asks for time sync */
+#define WAKE_FLAG_DONE 0x02      /* Nothing else follows the report */
+#define WAKE_REPORT_MAX_VALUES ((MAX_PAYLOAD_SIZE - 9) / 2)
+
+/* Replaces param values, MSG_TIME_SYNC_REQUEST, MSG_TRANSMIT_DONE and MSG_SLEEP of a timer wake */
+typedef struct
+{
+    uint8_t flags;
+    uint32_t sleepTime;
+    uint16_t regAddr;
+    uint16_t nmr;
+    int16_t values[WAKE_REPORT_MAX_VALUES];
+} __attribute__((packed)) WakeReportPayload;
+
+#define WAKE_REPLY_TIME_SYNC 0x01 /* Time sync is valid */
+#define WAKE_REPLY_MORE 0x02      /* Gateway sends more requests, wait for MSG_TRANSMIT_DONE */
+#define WAKE_REPLY_MAX_WRITES ((MAX_PAYLOAD_SIZE - 9 - sizeof(TimeSyncPayload)) / 2)
+
+/* Gateway answer to MSG_WAKE_REPORT with pending parameter writes, sleepTime 0 keeps the camera's own period */
+typedef struct
+{
+    uint8_t flags;
+    TimeSyncPayload time;
+    uint32_t sleepTime;
+    uint16_t regAddr;
+    uint16_t nmr;
+    int16_t values[WAKE_REPLY_MAX_WRITES];
+} __attribute__((packed)) WakeReplyPayload;
+
+typedef enum
+{
+    TX_SLOT_FREE = 0,
+    TX_SLOT_PENDING,
+    TX_SLOT_DONE,
+    TX_SLOT_ABANDONED,
+} TxSlotState_t;
+
+/* Completion slot of one submitted frame, ESP-NOW reports send status in
+   submit order so the n-th status belongs to sequence number n. A frame whose
+   status timed out keeps its slot as abandoned, its late status lands there and
+   is discarded. A status for another peer or an abandoned frame older than
+   TX_STATUS_LOST_MS shows that statuses were lost, the frames before it are
+   then completed as failed. */
+typedef struct
+{
+    uint32_t seq;
+    uint8_t mac_addr[6];
+    TaskHandle_t task;
+    uint8_t state;
+    uint8_t link;
+    uint32_t sentAt;
+    uint16_t len;
+    uint8_t rate;
+    uint8_t power;
+    esp_now_send_status_t status;
+} TxSlot_t;
+
+/* Delivery statistics of one PHY rate, the probability is an EWMA over stats intervals */
+typedef struct
+{
+    uint16_t attempts;
+    uint16_t success;
+    uint16_t prob;
+    bool valid;
+} RateStats_t;
+
+/* Link state of one peer, round trip estimates follow Jacobson/Karels */
+typedef struct
+{
+    uint8_t mac_addr[6];
+    bool used;
+    bool rttValid;
+    int32_t srtt_us;
+    int32_t rttvar_us;
+    uint8_t backoff;
+    int8_t rssi;
+    RateStats_t rates[PHY_RATE_COUNT];
+    uint8_t bulkRate;
+    uint8_t bulkFailures;
+    uint8_t sampleCnt;
+    uint32_t statsAt;
+    uint16_t loss; /* Failed unicast frames in permille, EWMA */
+    uint16_t txSeq;
+    uint16_t rxSeq;
+    uint32_t rxWindow; /* Bit i stands for rxSeq - i */
+    bool rxSeqValid;
+    uint8_t txPower;     /* Index to the TX power table, kept over deep sleep */
+    uint8_t powerSent;   /* Frames at the chosen rate in the current power window */
+    uint8_t powerFailed;
+} PeerLink_t;
+
 typedef void (*DataReceivedCallback)(const uint8_t *mac_addr, const Message *incomingData, int len);
 typedef void (*DataSentCallback)(const uint8_t *mac_addr, esp_now_send_status_t status);
 
+/* Received frame handed over to a worker task together with its handler */
+typedef struct
+{
+    DataReceivedCallback handler;
+    uint8_t mac_addr[6];
+    int len;
+    Message msg;
+} DeferredJob_t;
+
 class ESPNowCtrl
 {
 private:
-    static QueueHandle_t sendQueue;
-    static QueueHandle_t receiveQueue;
+    static TxSlot_t txSlots[TX_SLOTS];
+    static uint32_t txNextSeq;
+    static uint32_t txDoneSeq;
+    static portMUX_TYPE txLock;
+    static SemaphoreHandle_t txMutex;
+    static uint32_t txLastDoneAt;
+    static PeerLink_t peerLinks[MAX_PEER_LINKS + 1];
+    static uint8_t peerLinkVictim;
+    static BulkLane_t bulkLanes[MAX_BULK_LANES];
+    static SemaphoreHandle_t laneMutex;
+    static SemaphoreHandle_t laneFree;
+    static std::atomic<uint8_t> controlPending;
+
+    template <size_t Size, size_t DataSize>
+    static void putRxItem(RxRing_t<Size, DataSize> &ring, const uint8_t *mac_addr, const uint8_t *incomingData, int len, int8_t rssi);
+    template <size_t Size, size_t DataSize>
+    static void dispatchRxItem(RxRing_t<Size, DataSize> &ring);
+
+    static uint8_t findPeerLink(const uint8_t *mac_addr);
+    static uint8_t nextStreamId(void);
+    static void initPeerLink(PeerLink_t *link, const uint8_t *mac_addr);
+    static void createPeerLink(const uint8_t *mac_addr);
+    static void updateRtt(PeerLink_t *link, int32_t rtt_us);
+    static void wakeBulkLanes(void);
+    static uint32_t linkTimeout(const PeerLink_t *link);
+    static bool isReplay(PeerLink_t *link, uint16_t seq);
+    static void publishTelemetry(void);
+    static uint8_t currentRate;
+    static uint8_t currentPower;
+    static uint32_t txAirtime_us;
+    static uint32_t txEnergy_uJ;
+    static uint8_t selectPower(PeerLink_t *link);
+    static uint8_t selectRate(PeerLink_t *link);
+    static void updateRateStats(PeerLink_t *link);
+    static TaskHandle_t completeSlot(TxSlot_t *slot, esp_now_send_status_t status);
+    static bool statusLost(const TxSlot_t *slot, uint32_t now);
+    static uint8_t skipStatuses(uint32_t upTo, TaskHandle_t *woken);
+    static SemaphoreHandle_t rxSignal;
+    static RxRing_t<RX_CONTROL_POOL_SIZE, RX_CONTROL_FRAME_SIZE> rxControl;
+    static RxRing_t<RX_BULK_POOL_SIZE, RX_BULK_FRAME_SIZE> rxBulk;
+    static std::atomic<uint32_t> rxDropped;
+    static std::atomic<uint32_t> rxOverflow;
+    static uint32_t rxReplays;
+    static std::atomic<uint32_t> txSends;
+    static std::atomic<uint32_t> txRetries;
+    static std::atomic<uint32_t> txTimeouts;
+    static std::atomic<uint32_t> txDelivered;
+    static uint32_t goodputStart;
+    static uint32_t goodputMark;
+    static uint32_t goodputPrev;
+    static uint32_t rssiSampleAt;
+    static bool rssiSampled;
+    static StreamFlow_t streams[MAX_STREAMS];
+    static SemaphoreHandle_t streamMutex;
+    static SemaphoreHandle_t streamSerial;
+    static std::atomic<uint8_t> streamsOpen;
+    static uint8_t streamId;
+    static std::atomic<uint32_t> cancelledTypes;
+    static QueueHandle_t txFreeQueue;
+    static Message txPool[TX_POOL_SIZE];
+    static QueueHandle_t deferredQueue;
+    static std::atomic<uint8_t> deferredBusy;
+    static std::atomic<uint32_t> deferredTypes;
+    static void deferredWorker(void *arg);
     static DataReceivedCallback onDataReceivedCallback;
     static DataSentCallback onDataSentCallback;
 
-    static void onDataRecv(const uint8_t *mac_addr, const uint8_t *incomingData, int len);
+    static Transport *transport;
+    static void onDataRecv(const uint8_t *mac_addr, const uint8_t *incomingData, int len, int8_t rssi);
     static void onDataSent(const uint8_t *mac_addr, esp_now_send_status_t status);
 
     static bool initDone;
+    static uint32_t radioOnAt;
 
 public:
     static void Init();
@@ -195,18 +580,83 @@ public:
     static void SetDataReceivedCallback(DataReceivedCallback callback);
     static void SetDataSentCallback(DataSentCallback callback);
 
+    /* Runs the handler in a worker task instead of the RX task, for handlers that
+       send many frames or block. A coalesced request of the same type already
+       waiting is not queued again. Returns false when the queue is full. */
+    static bool Defer(const uint8_t *mac_addr, const Message *msg, int len, DataReceivedCallback handler, bool coalesce = true);
+    static bool DeferredIdle(void) { return deferredBusy == 0; }
+
     static void SetChannel(uint8_t channel);
 
+    /* Replaces the ESP-NOW radio link, must be called before Init */
+    static void SetTransport(Transport *newTransport);
+
     template <typename Payload>
     static bool SendMessage(const uint8_t *peer_addr, uint8_t messageType, const Payload &payloadData, uint8_t payloadSize, uint8_t retryCount = 3)
     {
         return SendMessageInternal(peer_addr, messageType, (const uint8_t *)(&payloadData), payloadSize, retryCount);
     }
-    static void SendMessageRaw(const uint8_t *peer_addr, uint8_t messageType, const uint8_t *payloadData, uint8_t payloadSize);
+    static bool SendMessageRaw(const uint8_t *peer_addr, uint8_t messageType, const uint8_t *payloadData, uint8_t payloadSize);
     static bool SendMessageInternal(const uint8_t *peer_addr, uint8_t messageType, const uint8_t *payload, uint8_t payloadSize, uint8_t retryCount);
 
     static bool SendMessage(const uint8_t *peer_addr, uint8_t messageType, uint8_t retryCount = 3);
 
+    /* Preallocated TX frames, the caller fills header and payload in place
+       and the frame is handed to the driver without further copies. */
+    static Message *BorrowFrame(uint8_t messageType, uint32_t timeoutMs = SEND_STATUS_TIMEOUT_MS);
+    static void ReturnFrame(Message *frame);
+    static uint32_t SubmitFrame(const uint8_t *peer_addr, Message *frame, uint8_t lane = LANE_CONTROL, bool robust = false);
+    /* timedOut, when given, tells a frame whose status did not come from a failed one */
+    static bool WaitFrameDone(uint32_t seq, bool *timedOut = NULL);
+    static bool WaitFrameDone(uint32_t seq, uint32_t timeoutMs, bool *timedOut = NULL);
+    static void AbandonFrame(uint32_t seq);
+    static uint32_t GetSentFrames(void) { return txSends; }
+    static uint32_t GetRadioOnTime(void) { return initDone ? millis() - radioOnAt : 0; }
+    /* Estimate of the radio energy since Init, in mJ */
+    static uint32_t GetRadioEnergy(void);
+    static uint32_t GetTimeout(const uint8_t *peer_addr);
+    static uint32_t GetBackoff(const uint8_t *peer_addr, uint8_t retries);
+    static bool SendFrame(const uint8_t *peer_addr, Message *frame, uint8_t retryCount = 3, uint8_t lane = LANE_CONTROL);
+    static void FillByteStreamFrame(Message *frame, const uint8_t *data, size_t len, size_t index, size_t chunkSize, uint8_t tag = 0);
+
+    /* Largest payload agreed with the gateway during pairing */
+    static uint16_t GetMaxPayload(void);
+    /* Data block of DataPayload based frames, the same as in legacy frames when no large frames were agreed */
+    static size_t GetDataChunkSize(void);
+
+    /* Parity chunks per FEC_GROUP_SIZE data chunks for the observed loss, 0 when FEC is off */
+    static uint8_t GetFecParity(const uint8_t *peer_addr);
+
+    static void PutStreamFeedback(const Message *msg);
+
+    /* Outgoing streams interleave over their own bulk lanes and each has its own
+       receiver feedback, so a stalled stream does not hold up the others. A receiver
+       without CAP_STREAM_MUX tells streams apart only by their length, streams
+       to it are sent one after another. Returns STREAM_NONE when no stream was
+       free within wait. */
+    static uint8_t OpenStream(uint8_t type, TickType_t wait = pdMS_TO_TICKS(STREAM_OPEN_TIMEOUT_MS));
+    static void CloseStream(uint8_t stream);
+    static uint8_t GetStreamTag(uint8_t stream) { return (stream < MAX_STREAMS) ? streams[stream].tag : 0; }
+
+    /* Sends data as MSG_BYTE_STREAM chunks with up to 'window' frames in flight.
+       Starts at 'offset' and leaves it at the end of the contiguously delivered part,
+       so a failed transfer can be continued by calling again. Missing chunks reported
+       by the receiver with MSG_NACK are resent until it confirms the stream with MSG_ACK.
+       With FEC a chunk lost within the parity of its group is not retransmitted. */
+    static bool SendStreamData(uint8_t stream, const uint8_t *peer_addr, const uint8_t *data, size_t len, size_t &offset, uint8_t window = STREAM_WINDOW_SIZE, uint8_t retryCount = 5);
+
+    /* A cancelled stream type stops the streams of that type in flight and makes
+       SendStreamData fail at once until CancelStreams(type, false) */
+    static void CancelStreams(uint8_t type, bool cancel = true);
+    static bool IsCancelled(uint8_t type);
+
+    /* Bulk transfers get the channel only when no control frame is waiting,
+       bulk lanes share it by deficit round robin. OpenBulkLane waits for a free
+       lane and returns LANE_CONTROL only when none was freed within wait. */
+    static uint8_t OpenBulkLane(TickType_t wait = portMAX_DELAY);
+    static void CloseBulkLane(uint8_t lane);
+    static void AcquireBulk(uint8_t lane, uint16_t bytes);
+
     static void AddPeer(const uint8_t *mac_addr, uint8_t channel);
     static void DeletePeer(const uint8_t *mac_addr);
     static void Task(void);
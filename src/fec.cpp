@@ -0,0 +1,273 @@
+/***********************************************************************
+ * Filename: fec.cpp
+ * Author: Pavel Kejik
+ * Date: 2024-04-12
+ * Description:
+ *     Implements FecEncoder and FecDecoder. Parity rows are accumulated
+ *     as the data chunks are sent, so the data itself is not buffered.
+ *     The decoder solves the parity equations of the lost chunks by
+ *     Gauss-Jordan elimination.
+ *
+ ***********************************************************************/
+
+#include "fec.h"
+
+uint8_t FecEncoder::gfExp[512];
+uint8_t FecEncoder::gfLog[256];
+bool FecEncoder::tablesDone = false;
+
+void FecEncoder::initTables(void)
+{
+    uint16_t x = 1;
+    for (int i = 0; i < 255; i++)
+    {
+        gfExp[i] = x;
+        gfLog[x] = i;
+        x <<= 1;
+        if (x & 0x100)
+        {
+            x ^= 0x11D;
+        }
+    }
+    /* Doubled table saves the modulo in multiplication */
+    for (int i = 255; i < 512; i++)
+    {
+        gfExp[i] = gfExp[i - 255];
+    }
+    gfLog[0] = 0;
+    tablesDone = true;
+}
+
+uint8_t FecEncoder::gfInv(uint8_t a)
+{
+    return gfExp[255 - gfLog[a]];
+}
+
+uint8_t FecEncoder::gfMul(uint8_t a, uint8_t b)
+{
+    return (a != 0 && b != 0) ? gfExp[gfLog[a] + gfLog[b]] : 0;
+}
+
+uint8_t FecEncoder::coefficient(uint8_t parityIdx, uint8_t dataIdx)
+{
+    return gfInv(parityIdx ^ (FEC_MAX_PARITY + dataIdx));
+}
+
+/* row += coef * data */
+void FecEncoder::mulAdd(uint8_t *row, const uint8_t *data, uint8_t coef, size_t len)
+{
+    if (coef == 0)
+    {
+        return;
+    }
+    uint8_t logCoef = gfLog[coef];
+    for (size_t b = 0; b < len; b++)
+    {
+        if (data[b] != 0)
+        {
+            row[b] ^= gfExp[logCoef + gfLog[data[b]]];
+        }
+    }
+}
+
+FecEncoder::FecEncoder(void)
+{
+    rows = NULL;
+    parity = 0;
+    filled = 0;
+    chunkSize = 0;
+    groupIndex = 0;
+}
+
+FecEncoder::~FecEncoder(void)
+{
+    End();
+}
+
+bool FecEncoder::Begin(uint8_t nmrParity, size_t size)
+{
+    End();
+    if (nmrParity == 0)
+    {
+        return false;
+    }
+    if (!tablesDone)
+    {
+        initTables();
+    }
+    rows = (uint8_t *)malloc(min(nmrParity, (uint8_t)FEC_MAX_PARITY) * size);
+    if (rows == NULL)
+    {
+        return false;
+    }
+    parity = min(nmrParity, (uint8_t)FEC_MAX_PARITY);
+    chunkSize = size;
+    NextGroup();
+    return true;
+}
+
+void FecEncoder::End(void)
+{
+    if (rows != NULL)
+    {
+        free(rows);
+        rows = NULL;
+    }
+    parity = 0;
+}
+
+void FecEncoder::NextGroup(void)
+{
+    filled = 0;
+    if (rows != NULL)
+    {
+        memset(rows, 0, parity * chunkSize);
+    }
+}
+
+void FecEncoder::Add(uint32_t index, const uint8_t *data, size_t len)
+{
+    if (!Active() || GroupFull())
+    {
+        return;
+    }
+    if (filled == 0)
+    {
+        groupIndex = index;
+    }
+    len = min(len, chunkSize);
+    for (uint8_t j = 0; j < parity; j++)
+    {
+        mulAdd(rows + j * chunkSize, data, coefficient(j, filled), len);
+    }
+    filled++;
+}
+
+void FecEncoder::FillParity(Message *frame, uint8_t parityIdx, uint32_t max_mr_bytes, uint8_t streamType)
+{
+    FecParityPayload *payload = (FecParityPayload *)frame->payload;
+    frame->messageType = MSG_FEC_PARITY;
+    payload->max_mr_bytes = max_mr_bytes;
+    payload->streamType = streamType;
+    payload->groupIndex = groupIndex;
+    payload->groupSize = filled;
+    payload->parityIdx = parityIdx;
+    memcpy(payload->data, rows + parityIdx * chunkSize, chunkSize);
+    SetPayloadSize(frame, offsetof(FecParityPayload, data) + chunkSize);
+}
+
+bool FecDecoder::Recover(uint8_t **chunks, const bool *lost, uint8_t groupSize, const uint8_t *const *parity, size_t chunkSize)
+{
+    uint8_t lostIdx[FEC_MAX_PARITY];
+    uint8_t parityIdx[FEC_MAX_PARITY];
+    uint8_t nmrLost = 0;
+    uint8_t nmrParity = 0;
+
+    for (uint8_t i = 0; i < groupSize; i++)
+    {
+        if (lost[i])
+        {
+            if (nmrLost >= FEC_MAX_PARITY)
+            {
+                return false;
+            }
+            lostIdx[nmrLost++] = i;
+        }
+    }
+    if (nmrLost == 0)
+    {
+        return true;
+    }
+    for (uint8_t j = 0; j < FEC_MAX_PARITY && nmrParity < nmrLost; j++)
+    {
+        if (parity[j] != NULL)
+        {
+            parityIdx[nmrParity++] = j;
+        }
+    }
+    if (nmrParity < nmrLost)
+    {
+        return false;
+    }
+    if (!FecEncoder::tablesDone)
+    {
+        FecEncoder::initTables();
+    }
+
+    /* Coefficients of the lost chunks in the received parity rows, a is reduced to unit matrix while inv becomes its inverse */
+    uint8_t a[FEC_MAX_PARITY][FEC_MAX_PARITY];
+    uint8_t inv[FEC_MAX_PARITY][FEC_MAX_PARITY];
+    for (uint8_t r = 0; r < nmrLost; r++)
+    {
+        for (uint8_t c = 0; c < nmrLost; c++)
+        {
+            a[r][c] = FecEncoder::coefficient(parityIdx[r], lostIdx[c]);
+            inv[r][c] = (r == c) ? 1 : 0;
+        }
+    }
+    for (uint8_t c = 0; c < nmrLost; c++)
+    {
+        uint8_t pivot = c;
+        while (pivot < nmrLost && a[pivot][c] == 0)
+        {
+            pivot++;
+        }
+        if (pivot == nmrLost)
+        {
+            return false;
+        }
+        for (uint8_t k = 0; k < nmrLost; k++)
+        {
+            std::swap(a[c][k], a[pivot][k]);
+            std::swap(inv[c][k], inv[pivot][k]);
+        }
+        uint8_t scale = FecEncoder::gfInv(a[c][c]);
+        for (uint8_t k = 0; k < nmrLost; k++)
+        {
+            a[c][k] = FecEncoder::gfMul(a[c][k], scale);
+            inv[c][k] = FecEncoder::gfMul(inv[c][k], scale);
+        }
+        for (uint8_t r = 0; r < nmrLost; r++)
+        {
+            uint8_t factor = a[r][c];
+            if (r == c || factor == 0)
+            {
+                continue;
+            }
+            for (uint8_t k = 0; k < nmrLost; k++)
+            {
+                a[r][k] ^= FecEncoder::gfMul(factor, a[c][k]);
+                inv[r][k] ^= FecEncoder::gfMul(factor, inv[c][k]);
+            }
+        }
+    }
+
+    /* Parity rows without the contribution of the chunks that arrived */
+    uint8_t *syndromes = (uint8_t *)malloc(nmrLost * chunkSize);
+    if (syndromes == NULL)
+    {
+        return false;
+    }
+    for (uint8_t r = 0; r < nmrLost; r++)
+    {
+        uint8_t *syndrome = syndromes + r * chunkSize;
+        memcpy(syndrome, parity[parityIdx[r]], chunkSize);
+        for (uint8_t i = 0; i < groupSize; i++)
+        {
+            if (!lost[i])
+            {
+                FecEncoder::mulAdd(syndrome, chunks[i], FecEncoder::coefficient(parityIdx[r], i), chunkSize);
+            }
+        }
+    }
+    for (uint8_t c = 0; c < nmrLost; c++)
+    {
+        memset(chunks[lostIdx[c]], 0, chunkSize);
+        for (uint8_t r = 0; r < nmrLost; r++)
+        {
+            FecEncoder::mulAdd(chunks[lostIdx[c]], syndromes + r * chunkSize, inv[c][r], chunkSize);
+        }
+    }
+    free(syndromes);
+    return true;
+}
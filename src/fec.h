@@ -0,0 +1,67 @@
+/***********************************************************************
+ * Filename: fec.h
+ * Author: Pavel Kejik
+ * Date: 2024-04-12
+ * Description:
+ *     Declares FecEncoder, a systematic Reed-Solomon encoder over
+ *     GF(2^8) (polynomial 0x11D) for byte streams, and FecDecoder, its
+ *     receiving side used by the simulated gateway. Data
+ *     chunks are sent unchanged, each group of up to FEC_GROUP_SIZE
+ *     chunks is followed by parity chunks. Parity chunk j is the sum of
+ *     data chunks i multiplied by the Cauchy coefficient
+ *     1 / (j ^ (FEC_MAX_PARITY + i)), so any groupSize of the
+ *     groupSize + parity chunks rebuild the group.
+ *
+ ***********************************************************************/
+
+#pragma once
+#include "Arduino.h"
+#include "esp_now_ctrl.h"
+
+class FecEncoder
+{
+private:
+    uint8_t *rows;
+    uint8_t parity;
+    uint8_t filled;
+    size_t chunkSize;
+    uint32_t groupIndex;
+
+    static uint8_t gfExp[512];
+    static uint8_t gfLog[256];
+    static bool tablesDone;
+    static void initTables(void);
+    static uint8_t gfInv(uint8_t a);
+    static uint8_t gfMul(uint8_t a, uint8_t b);
+    static uint8_t coefficient(uint8_t parityIdx, uint8_t dataIdx);
+    static void mulAdd(uint8_t *row, const uint8_t *data, uint8_t coef, size_t len);
+
+    friend class FecDecoder;
+
+public:
+    FecEncoder(void);
+    ~FecEncoder(void);
+
+    /* parity 0 switches the encoder off */
+    bool Begin(uint8_t nmrParity, size_t size);
+    void End(void);
+    bool Active(void) { return parity > 0; }
+    uint8_t Parity(void) { return parity; }
+    uint8_t Filled(void) { return filled; }
+    bool GroupFull(void) { return filled >= FEC_GROUP_SIZE; }
+
+    /* Chunks of a group must follow each other, a shorter chunk is zero padded */
+    void Add(uint32_t index, const uint8_t *data, size_t len);
+    void FillParity(Message *frame, uint8_t parityIdx, uint32_t max_mr_bytes, uint8_t streamType);
+    void NextGroup(void);
+};
+
+class FecDecoder
+{
+public:
+    /* chunks[i] is data chunk i of the group, chunkSize long and zero padded,
+       lost marks the ones to rebuild. parity[j] is parity chunk j of the group
+       or NULL when it did not arrive. Fails when fewer parity chunks than
+       lost chunks arrived, the chunks are then left as they were. */
+    static bool Recover(uint8_t **chunks, const bool *lost, uint8_t groupSize, const uint8_t *const *parity, size_t chunkSize);
+};
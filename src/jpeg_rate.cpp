@@ -0,0 +1,62 @@
+/***********************************************************************
+ * Filename: jpeg_rate.cpp
+ * Author: Pavel Kejik
+ * Date: 2024-04-12
+ * Description:
+ *     Implements JpegRate.
+ *
+ ***********************************************************************/
+
+#include "jpeg_rate.h"
+#include "parameters.h"
+#include <math.h>
+
+RTC_DATA_ATTR float JpegRate::offset[JPEG_RATE_SCENES];
+RTC_DATA_ATTR float JpegRate::slope = JPEG_RATE_SLOPE_DEFAULT;
+RTC_DATA_ATTR uint8_t JpegRate::lastQuality[JPEG_RATE_SCENES];
+RTC_DATA_ATTR float JpegRate::lastLogSize[JPEG_RATE_SCENES];
+RTC_DATA_ATTR bool JpegRate::valid[JPEG_RATE_SCENES];
+
+uint32_t JpegRate::Budget(void)
+{
+    if (RozpoctSnimku_B.Get() > 0)
+    {
+        return RozpoctSnimku_B.Get();
+    }
+    return (uint64_t)max((int32_t)0, RychlostSnimku_Bps.Get()) * DobaPrenosuSnimku_ms.Get() / 1000;
+}
+
+uint8_t JpegRate::Predict(uint8_t scene)
+{
+    uint32_t budget = Budget();
+    if (scene >= JPEG_RATE_SCENES || !valid[scene] || budget == 0)
+    {
+        return JPEG_QUALITY_DEFAULT;
+    }
+    float quality = (offset[scene] - logf((float)budget)) / slope;
+    return constrain((int)lroundf(quality), JPEG_QUALITY_MIN, JPEG_QUALITY_MAX);
+}
+
+/* The slope is learned from consecutive pictures of a scene taken at different
+   quality, the offset follows every picture */
+void JpegRate::Update(uint8_t scene, uint8_t quality, size_t bytes)
+{
+    if (scene >= JPEG_RATE_SCENES || bytes == 0)
+    {
+        return;
+    }
+    float logSize = logf((float)bytes);
+    if (valid[scene] && quality != lastQuality[scene])
+    {
+        float measured = (lastLogSize[scene] - logSize) / (quality - lastQuality[scene]);
+        if (measured >= JPEG_RATE_SLOPE_MIN && measured <= JPEG_RATE_SLOPE_MAX)
+        {
+            slope += (measured - slope) / 4;
+        }
+    }
+    float measuredOffset = logSize + slope * quality;
+    offset[scene] = valid[scene] ? offset[scene] + (measuredOffset - offset[scene]) * JPEG_RATE_GAIN : measuredOffset;
+    lastQuality[scene] = quality;
+    lastLogSize[scene] = logSize;
+    valid[scene] = true;
+}
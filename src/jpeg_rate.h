@@ -0,0 +1,44 @@
+/***********************************************************************
+ * Filename: jpeg_rate.h
+ * Author: Pavel Kejik
+ * Date: 2024-04-12
+ * Description:
+ *     Declares JpegRate, which picks the sensor JPEG quality so that
+ *     pictures land close to a byte budget. The size is modelled as
+ *     ln(bytes) = offset - slope * quality with a separate offset for
+ *     day and night scenes. The model is kept in RTC memory and updated
+ *     from every picture taken.
+ *
+ ***********************************************************************/
+
+#pragma once
+#include "Arduino.h"
+
+#define JPEG_QUALITY_DEFAULT 10
+#define JPEG_QUALITY_MIN 4
+#define JPEG_QUALITY_MAX 40
+#define JPEG_RATE_SCENES 2
+#define JPEG_RATE_SLOPE_DEFAULT 0.05f /* ln(bytes) per quality step of the OV2640 */
+#define JPEG_RATE_SLOPE_MIN 0.01f
+#define JPEG_RATE_SLOPE_MAX 0.3f
+#define JPEG_RATE_GAIN 0.5f
+
+class JpegRate
+{
+private:
+    static float offset[JPEG_RATE_SCENES];
+    static float slope;
+    static uint8_t lastQuality[JPEG_RATE_SCENES];
+    static float lastLogSize[JPEG_RATE_SCENES];
+    static bool valid[JPEG_RATE_SCENES];
+
+public:
+    /* RozpoctSnimku_B when set, otherwise the image goodput of the last wake
+       times DobaPrenosuSnimku_ms. 0 when there is nothing to base it on. */
+    static uint32_t Budget(void);
+
+    /* Quality for the next picture of the scene, the default without a budget or model */
+    static uint8_t Predict(uint8_t scene);
+
+    static void Update(uint8_t scene, uint8_t quality, size_t bytes);
+};
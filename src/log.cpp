@@ -198,14 +198,54 @@ size_t SystemLog::GetLogJson(JsonArray doc, size_t pos, size_t nmr_max)
 }
 
 
+/* The log files are read out first, the stream keeps its data for retransmits
+   and the file system is not held during the transfer */
+bool SystemLog::sendLogStream(const uint8_t *mac_addr)
+{
+    size_t cap = 2 * (NMR_RECORDS + 1) * sizeof(Log_t);
+    uint8_t *data = (uint8_t *)malloc(cap);
+    if (data == NULL)
+    {
+        return false;
+    }
+    size_t len = 0;
+    {
+        std::lock_guard<std::mutex> lock(storageFS_lock);
+        int read_file = write_file ^ 1;
+        for (int i = 0; i < 2; ++i)
+        {
+            File file = storageFS.open(log_files[(read_file + i) % 2], "r");
+            if (!file)
+                continue;
+            len += file.readBytes((char *)data + len, cap - len);
+            file.close();
+        }
+    }
+    len -= len % sizeof(Log_t);
+    bool res = (len == 0) || ESPNowClient::SendStream(mac_addr, data, len, STREAM_TYPE_LOG);
+    free(data);
+    return res;
+}
+
 bool SystemLog::SendLogsViaEspNow(const uint8_t *mac_addr)
 {
+    if (EspNowSchopnosti.Get() & CAP_STREAM_MUX)
+    {
+        return sendLogStream(mac_addr);
+    }
     std::lock_guard<std::mutex> lock(storageFS_lock);
     size_t total_nmr = 0;
-    DataPayload payload;
     bool sendMessageSuccess = true;
 
-    memset(&payload, 0, sizeof(payload));
+    uint8_t lane = ESPNowCtrl::OpenBulkLane();
+    Message *frame = ESPNowCtrl::BorrowFrame(MSG_GET_LOG_RESPONSE);
+    if (frame == NULL)
+    {
+        ESPNowCtrl::CloseBulkLane(lane);
+        return false;
+    }
+    DataPayload *payload = (DataPayload *)frame->payload;
+    size_t dataCap = ESPNowCtrl::GetDataChunkSize();
     size_t payloadFillIndex = 0;
     size_t currentIndex = 0;
 
@@ -221,24 +261,22 @@ bool SystemLog::SendLogsViaEspNow(const uint8_t *mac_addr)
 
         while (file.available() > 0 && sendMessageSuccess)
         {
-            Log_t log_item;
-            size_t readSize = file.readBytes((char *)&log_item, min(sizeof(Log_t), sizeof(payload.data) - payloadFillIndex));
+            size_t readSize = file.readBytes((char *)payload->data + payloadFillIndex, dataCap - payloadFillIndex);
 
             if (readSize > 0)
             {
-                memcpy(payload.data + payloadFillIndex, &log_item, readSize);
                 payloadFillIndex += readSize;
                 currentIndex += readSize;
 
-                if (payloadFillIndex == sizeof(payload.data))
+                if (payloadFillIndex == dataCap)
                 {
-                    payload.index = currentIndex - payloadFillIndex;
-                    payload.nmr = payloadFillIndex;
+                    payload->index = currentIndex - payloadFillIndex;
+                    payload->nmr = (payloadFillIndex < PAYLOAD_SIZE_EXTENDED) ? payloadFillIndex : PAYLOAD_SIZE_EXTENDED;
+                    SetPayloadSize(frame, offsetof(DataPayload, data) + payloadFillIndex);
 
-                    CHECK_SEND(ESPNowCtrl::SendMessage(mac_addr, MSG_GET_LOG_RESPONSE, payload, 4 + 1 + payload.nmr, 5), sendMessageSuccess);
+                    CHECK_SEND(ESPNowCtrl::SendFrame(mac_addr, frame, 5, lane), sendMessageSuccess);
                     total_nmr += payloadFillIndex / sizeof(Log_t);
 
-                    memset(&payload, 0, sizeof(payload));
                     payloadFillIndex = 0;
                 }
             }
@@ -249,12 +287,15 @@ bool SystemLog::SendLogsViaEspNow(const uint8_t *mac_addr)
 
     if (payloadFillIndex > 0 && sendMessageSuccess)
     {
-        payload.index = currentIndex - payloadFillIndex;
-        payload.nmr = payloadFillIndex;
-        CHECK_SEND(ESPNowCtrl::SendMessage(mac_addr, MSG_GET_LOG_RESPONSE, payload, 4 + 1 + payload.nmr, 5), sendMessageSuccess);
+        payload->index = currentIndex - payloadFillIndex;
+        payload->nmr = (payloadFillIndex < PAYLOAD_SIZE_EXTENDED) ? payloadFillIndex : PAYLOAD_SIZE_EXTENDED;
+        SetPayloadSize(frame, offsetof(DataPayload, data) + payloadFillIndex);
+        CHECK_SEND(ESPNowCtrl::SendFrame(mac_addr, frame, 5, lane), sendMessageSuccess);
         total_nmr += payloadFillIndex / sizeof(Log_t);
     }
 
+    ESPNowCtrl::CloseBulkLane(lane);
+    ESPNowCtrl::ReturnFrame(frame);
     return sendMessageSuccess;
 }
 
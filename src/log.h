@@ -28,6 +28,7 @@ class SystemLog
 {
 private:
     static void printItem(const Log_t *item);
+    static bool sendLogStream(const uint8_t *mac_addr);
 
     static QueueHandle_t log_queue;
 
@@ -72,7 +72,7 @@ void SleepTask(void *pvParameters)
 {
   while (true)
   {
-    if (IsSystemIdle())
+    if (IsSystemIdle() && ESPNowCtrl::DeferredIdle())
     {
       vTaskSuspendAll();
       for (int i = 0; i < NUMBER_TASK_HANDLES; i++)
@@ -83,20 +83,30 @@ void SleepTask(void *pvParameters)
         }
       }
       xTaskResumeAll();
+      bool restart = RestartCmd.Get() == povoleno;
+      uint64_t wakeDelay_us = ESPNowClient::GetWakeDelay_us();
+      uint32_t wakeDelayAt = micros();
+      if (!restart && !ESPNowClient::SleepAnnounced())
+      {
+        SleepPayload payload;
+        uint8_t payloadSize = ESPNowClient::FillSleepPayload(payload, wakeDelay_us);
+        ESPNowCtrl::SendMessage(MasterMacAdresa.Get(), MSG_SLEEP, payload, payloadSize);
+      }
+      /* Set before Register::Sleep() so the values of this wake are saved */
+      RamceZaProbuzeni.Set(min(ESPNowCtrl::GetSentFrames(), (uint32_t)UINT16_MAX));
+      RadioZaProbuzeni_ms.Set(min(ESPNowCtrl::GetRadioOnTime(), (uint32_t)UINT16_MAX));
+      EnergieRadiaZaProbuzeni_mJ.Set(min(ESPNowCtrl::GetRadioEnergy(), (uint32_t)UINT16_MAX));
       Register::Sleep();
       SystemLog::Sleep();
-      if (RestartCmd.Get() == povoleno)
+      if (restart)
       {
         ESP.restart();
       }
       else
       {
-
-        SleepPayload payload;
-        payload.sleepTime = PeriodaKomunikace_S.Get();
-        ESPNowCtrl::SendMessage(MasterMacAdresa.Get(), MSG_SLEEP, payload, sizeof(payload));
-
-        esp_sleep_enable_timer_wakeup((uint64_t)PeriodaKomunikace_S.Get() * 1000000ULL);
+        /* The announced wake counts from MSG_SLEEP, the time spent saving is taken off */
+        uint64_t elapsed_us = micros() - wakeDelayAt;
+        esp_sleep_enable_timer_wakeup((wakeDelay_us > elapsed_us + 1000) ? wakeDelay_us - elapsed_us : 1000);
         esp_deep_sleep_start();
       }
     }
@@ -0,0 +1,138 @@
+/***********************************************************************
+ * Filename: motion.cpp
+ * Author: Pavel Kejik
+ * Date: 2024-04-12
+ * Description:
+ *     Implements MotionGate. The differences are computed four pixels
+ *     per 32-bit word: even and odd bytes are split into 16-bit lanes,
+ *     so neither the subtraction nor the block sums carry into the
+ *     neighbouring pixel.
+ *
+ ***********************************************************************/
+
+#include "motion.h"
+#include "parameters.h"
+#include "img_converters.h"
+
+RTC_DATA_ATTR uint32_t MotionGate::reference[MOTION_PROBE_WORDS];
+RTC_DATA_ATTR bool MotionGate::referenceValid = false;
+
+/* |a - b| of the bytes in the low halves of both 16-bit lanes */
+static inline uint32_t absDiffLanes(uint32_t a, uint32_t b)
+{
+    uint32_t d = (a | 0x01000100) - b;
+    uint32_t lt = (~d >> 8) & 0x00010001;
+    return ((d & 0x00FF00FF) ^ (lt * 0xFF)) + lt;
+}
+
+/* Sums of the absolute differences of four pixels, two per lane */
+static inline uint32_t absDiff4(uint32_t a, uint32_t b)
+{
+    return absDiffLanes(a & 0x00FF00FF, b & 0x00FF00FF) + absDiffLanes((a >> 8) & 0x00FF00FF, (b >> 8) & 0x00FF00FF);
+}
+
+uint16_t MotionGate::ChangedBlocks(const uint32_t *probe, const uint32_t *ref, uint8_t threshold)
+{
+    const uint8_t rowWords = MOTION_PROBE_W / 4;
+    const uint8_t blockWords = MOTION_BLOCK / 4;
+    /* A lane collects at most 2 * 255 per word, MOTION_BLOCK^2 / 4 words fit into 16 bits */
+    const uint32_t limit = (uint32_t)threshold * MOTION_BLOCK * MOTION_BLOCK;
+    uint16_t changed = 0;
+
+    for (uint8_t by = 0; by < MOTION_PROBE_H / MOTION_BLOCK; by++)
+    {
+        for (uint8_t bx = 0; bx < MOTION_PROBE_W / MOTION_BLOCK; bx++)
+        {
+            uint32_t lanes = 0;
+            uint16_t first = by * MOTION_BLOCK * rowWords + bx * blockWords;
+            for (uint8_t y = 0; y < MOTION_BLOCK; y++)
+            {
+                for (uint8_t x = 0; x < blockWords; x++)
+                {
+                    uint16_t w = first + y * rowWords + x;
+                    lanes += absDiff4(probe[w], ref[w]);
+                }
+            }
+            if ((lanes & 0xFFFF) + (lanes >> 16) > limit)
+            {
+                changed++;
+            }
+        }
+    }
+    return changed;
+}
+
+/* The JPEG is decoded at 1/8 scale and averaged down to the probe size */
+bool MotionGate::makeProbe(const camera_fb_t *fb, uint32_t *probe)
+{
+    uint16_t width = (fb->width + 7) / 8;
+    uint16_t height = (fb->height + 7) / 8;
+    size_t rgbLen = width * height * 2;
+    if (width < MOTION_PROBE_W || height < MOTION_PROBE_H)
+    {
+        return false;
+    }
+    uint8_t *rgb = (uint8_t *)(psramFound() ? ps_malloc(rgbLen) : malloc(rgbLen));
+    if (rgb == NULL)
+    {
+        return false;
+    }
+    if (!jpg2rgb565(fb->buf, fb->len, rgb, JPG_SCALE_8X))
+    {
+        free(rgb);
+        return false;
+    }
+
+    uint8_t *gray = (uint8_t *)probe;
+    for (uint16_t py = 0; py < MOTION_PROBE_H; py++)
+    {
+        uint16_t y0 = py * height / MOTION_PROBE_H;
+        uint16_t y1 = (py + 1) * height / MOTION_PROBE_H;
+        for (uint16_t px = 0; px < MOTION_PROBE_W; px++)
+        {
+            uint16_t x0 = px * width / MOTION_PROBE_W;
+            uint16_t x1 = (px + 1) * width / MOTION_PROBE_W;
+            uint32_t sum = 0;
+            for (uint16_t y = y0; y < y1; y++)
+            {
+                const uint8_t *pixel = rgb + (y * width + x0) * 2;
+                for (uint16_t x = x0; x < x1; x++, pixel += 2)
+                {
+                    /* RGB565 with the high byte first */
+                    uint8_t r = pixel[0] & 0xF8;
+                    uint8_t g = ((pixel[0] << 5) | (pixel[1] >> 3)) & 0xFC;
+                    uint8_t b = pixel[1] << 3;
+                    sum += (r * 77 + g * 150 + b * 29) >> 8;
+                }
+            }
+            gray[py * MOTION_PROBE_W + px] = sum / ((y1 - y0) * (x1 - x0));
+        }
+    }
+    free(rgb);
+    return true;
+}
+
+bool MotionGate::Check(const camera_fb_t *fb)
+{
+    static uint32_t probe[MOTION_PROBE_WORDS];
+    uint16_t required = PohybBloku.Get();
+    if (required == 0)
+    {
+        return true;
+    }
+    if (!makeProbe(fb, probe))
+    {
+        return true;
+    }
+
+    bool send = true;
+    if (referenceValid)
+    {
+        uint16_t changed = ChangedBlocks(probe, reference, PohybPrah.Get());
+        ZmenenychBloku.Set(changed);
+        send = changed >= required;
+    }
+    memcpy(reference, probe, sizeof(reference));
+    referenceValid = true;
+    return send;
+}
@@ -0,0 +1,39 @@
+/***********************************************************************
+ * Filename: motion.h
+ * Author: Pavel Kejik
+ * Date: 2024-04-12
+ * Description:
+ *     Declares MotionGate, which decides whether a captured frame
+ *     differs enough from the previous wake to be sent. The frame is
+ *     reduced to a MOTION_PROBE_W x MOTION_PROBE_H grayscale probe that
+ *     is compared block by block with the probe kept in RTC memory.
+ *
+ ***********************************************************************/
+
+#pragma once
+#include "Arduino.h"
+#include "esp_camera.h"
+
+#define MOTION_PROBE_W 48
+#define MOTION_PROBE_H 32
+#define MOTION_BLOCK 8
+#define MOTION_BLOCKS ((MOTION_PROBE_W / MOTION_BLOCK) * (MOTION_PROBE_H / MOTION_BLOCK))
+#define MOTION_PROBE_WORDS (MOTION_PROBE_W * MOTION_PROBE_H / 4)
+
+class MotionGate
+{
+private:
+    static uint32_t reference[MOTION_PROBE_WORDS];
+    static bool referenceValid;
+
+    static bool makeProbe(const camera_fb_t *fb, uint32_t *probe);
+
+public:
+    /* Sum of absolute differences of every MOTION_BLOCK x MOTION_BLOCK block,
+       blocks whose mean difference per pixel exceeds threshold are counted */
+    static uint16_t ChangedBlocks(const uint32_t *probe, const uint32_t *ref, uint8_t threshold);
+
+    /* True when the frame should be sent, the frame becomes the new reference.
+       Without a reference or a readable frame it is always sent. */
+    static bool Check(const camera_fb_t *fb);
+};
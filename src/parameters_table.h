@@ -50,6 +50,12 @@
 */
 DefPar_Ram( StavZarizeni,  1,     Parovani,    NormalniMod ,     Sparovano, U16_,   Par_R  ,    Par_Public,    FLAGS_NONE )
 DefPar_Ram( PoriditSnimek,  2,     vypnuto,    vypnuto ,     povoleno, U16_,   Par_RW  ,    Par_Public | Par_ESPNow,    BOOL_FLAG )
+DefPar_Ram( DobaSnimku_ms,  29,     0,    0 ,     UINT16_MAX, U16_,   Par_R  ,    Par_Public | Par_ESPNow,    FLAGS_NONE )
+DefPar_Ram( DobaNahledu_ms,  32,     0,    0 ,     UINT16_MAX, U16_,   Par_R  ,    Par_Public | Par_ESPNow,    FLAGS_NONE )
+DefPar_Ram( ZmenenychBloku,  35,     0,    0 ,     24, U16_,   Par_R  ,    Par_Public | Par_ESPNow,    FLAGS_NONE )
+DefPar_RTC( KvalitaJpeg,  38,     10,    0 ,     63, U16_,   Par_R  ,    Par_Public | Par_ESPNow,    FLAGS_NONE )
+DefPar_RTC( RychlostSnimku_Bps,  39,     0,    0 ,     INT32_MAX, S32_,   Par_R  ,    Par_Public | Par_ESPNow,    FLAGS_NONE )
+DefPar_Ram( ProbuzeniKSnimku_ms,  41,     0,    0 ,     UINT16_MAX, U16_,   Par_R  ,    Par_Public | Par_ESPNow,    FLAGS_NONE )
 
 // DefPar_RTC( NapetiBaterie_mV, 2,  0,    5,   300, U16_,   Par_R  ,    Par_Public | Par_ESPNow,    CHART_FLAG)
 
@@ -64,6 +70,12 @@ DefPar_Nv( KonfiguraceSnimani,   3,  automaticky, automaticky,nikdy, U16_,   Par
 DefPar_Nv( PouzitBlesk,   4,  automaticky, automaticky,nikdy, U16_,   Par_RW  ,   Par_Public | Par_ESPNow, STATE_FLAG)
 DefPar_Nv( PosunVychodu, 5,  0,    -180,    180, S16_,   Par_RW  ,    Par_Public | Par_ESPNow,    FLAGS_NONE )
 DefPar_Nv( PosunZapadu, 6,  0,    -180,    180, S16_,   Par_RW  ,    Par_Public | Par_ESPNow,    FLAGS_NONE )
+DefPar_Nv( SnimkuVDavce, 30,  1,    1,    8, U16_,   Par_RW  ,    Par_Public | Par_ESPNow,    FLAGS_NONE )
+DefPar_Nv( PoslatNahled, 31,  povoleno,    vypnuto,    povoleno, U16_,   Par_RW  ,    Par_Public | Par_ESPNow,    BOOL_FLAG )
+DefPar_Nv( PohybPrah, 33,  12,    1,    255, U16_,   Par_RW  ,    Par_Public | Par_ESPNow,    FLAGS_NONE )
+DefPar_Nv( PohybBloku, 34,  2,    0,    24, U16_,   Par_RW  ,    Par_Public | Par_ESPNow,    FLAGS_NONE )
+DefPar_Nv( RozpoctSnimku_B, 36,  0,    0,    60000, U16_,   Par_RW  ,    Par_Public | Par_ESPNow,    FLAGS_NONE )
+DefPar_Nv( DobaPrenosuSnimku_ms, 37,  2000,    100,    30000, U16_,   Par_RW  ,    Par_Public | Par_ESPNow,    FLAGS_NONE )
 
 /*
 -----------------------------------------------------------------------------------------------------------
@@ -74,6 +86,37 @@ DefPar_Nv( PosunZapadu, 6,  0,    -180,    180, S16_,   Par_RW  ,    Par_Public
 DefPar_Nv( PeriodaKomunikace_S, 7,  10,    2,    3600, U16_,   Par_RW  ,    Par_Public | Par_ESPNow,    COMM_PERIOD_FLAG)
 DefPar_Fun( MasterMacAdresa, 200,  255,    0,    0, U16_,   Par_RW  ,    Par_Installer,    FLAGS_NONE, mac_reg_nv)
 DefPar_RTC( WiFiKanal, 203,  1,     1,    13, U16_,   Par_R,    Par_Public,    FLAGS_NONE )
+DefPar_Nv( EspNowMaxDelkaRamce, 204,  240,     240,    1480, U16_,   Par_R,    Par_Public,    FLAGS_NONE )
+DefPar_Nv( EspNowSchopnosti, 205,  0,     0,    UINT16_MAX, U16_,   Par_R,    Par_Public,    FLAGS_NONE )
+
+/*
+-----------------------------------------------------------------------------------------------------------
+  @ ESP-NOW statistika
+
+-----------------------------------------------------------------------------------------------------------
+*/
+DefPar_Ram( EspNowZahozeno, 400,  0,     0,    UINT16_MAX, U16_,   Par_R,    Par_Public,    FLAGS_NONE )
+DefPar_Ram( EspNowPreteceni, 401,  0,     0,    UINT16_MAX, U16_,   Par_R,    Par_Public,    FLAGS_NONE )
+DefPar_Ram( EspNowSrtt_us, 402,  0,     0,    INT32_MAX, S32_,   Par_R,    Par_Public,    FLAGS_NONE )
+DefPar_Ram( EspNowRttVar_us, 404,  0,     0,    INT32_MAX, S32_,   Par_R,    Par_Public,    FLAGS_NONE )
+DefPar_Ram( EspNowTimeout_ms, 406,  1000,     0,    UINT16_MAX, U16_,   Par_R,    Par_Public,    FLAGS_NONE )
+DefPar_Ram( EspNowDuplicity, 407,  0,     0,    UINT16_MAX, U16_,   Par_R,    Par_Public,    FLAGS_NONE )
+DefPar_Fun( EspNowRssi_dBm, 10,  0,     -128,    0, S16_,   Par_R,    Par_Public | Par_ESPNow,    CHART_FLAG, chart_reg )
+DefPar_Ram( EspNowOdeslano, 11,  0,     0,    UINT16_MAX, U16_,   Par_R,    Par_Public | Par_ESPNow,    FLAGS_NONE )
+DefPar_Ram( EspNowOpakovani, 12,  0,     0,    UINT16_MAX, U16_,   Par_R,    Par_Public | Par_ESPNow,    FLAGS_NONE )
+DefPar_Ram( EspNowTimeouty, 13,  0,     0,    UINT16_MAX, U16_,   Par_R,    Par_Public | Par_ESPNow,    FLAGS_NONE )
+DefPar_Ram( EspNowDoruceno_B, 14,  0,     0,    INT32_MAX, S32_,   Par_R,    Par_Public | Par_ESPNow,    FLAGS_NONE )
+DefPar_Ram( EspNowGoodput_Bps, 16,  0,     0,    INT32_MAX, S32_,   Par_R,    Par_Public | Par_ESPNow,    FLAGS_NONE )
+DefPar_Fun( EspNowGoodput_kbps, 18,  0,     0,    INT16_MAX, S16_,   Par_R,    Par_Public | Par_ESPNow,    CHART_FLAG, chart_reg )
+DefPar_Ram( EspNowRychlostPhy_kbps, 19,  1000,     1000,    54000, U16_,   Par_R,    Par_Public | Par_ESPNow,    FLAGS_NONE )
+DefPar_RTC( RamceZaProbuzeni, 20,  0,     0,    UINT16_MAX, U16_,   Par_R,    Par_Public | Par_ESPNow,    FLAGS_NONE )
+DefPar_RTC( RadioZaProbuzeni_ms, 21,  0,     0,    UINT16_MAX, U16_,   Par_R,    Par_Public | Par_ESPNow,    FLAGS_NONE )
+DefPar_Ram( EspNowZtrata_promile, 22,  0,     0,    1000, U16_,   Par_R,    Par_Public | Par_ESPNow,    FLAGS_NONE )
+DefPar_Ram( EspNowFecParita, 23,  0,     0,    4, U16_,   Par_R,    Par_Public | Par_ESPNow,    FLAGS_NONE )
+DefPar_Ram( EspNowVykonTx_dBm, 24,  19,     0,    20, U16_,   Par_R,    Par_Public | Par_ESPNow,    FLAGS_NONE )
+DefPar_RTC( EnergieRadiaZaProbuzeni_mJ, 25,  0,     0,    UINT16_MAX, U16_,   Par_R,    Par_Public | Par_ESPNow,    FLAGS_NONE )
+DefPar_RTC( SlotPerioda_s, 26,  0,     0,    3600, U16_,   Par_RW  ,    Par_Public | Par_ESPNow,    FLAGS_NONE )
+DefPar_RTC( SlotOffset_ms, 27,  0,     0,    INT32_MAX, S32_,   Par_RW  ,    Par_Public | Par_ESPNow,    FLAGS_NONE )
 
 /*
 -----------------------------------------------------------------------------------------------------------
@@ -798,6 +798,7 @@ public:
 		tailIdx = 0;
 		newSamples = 0;
 		maxVal = 0;
+		valBuf = NULL;
 	}
 
 	void SetSize(uint16_t sz)
@@ -805,7 +806,7 @@ public:
 		std::lock_guard<std::mutex> lock(mutex);
 		if (maxSamples > 0)
 		{
-			delete valBuf;
+			delete[] valBuf;
 		}
 		valBuf = new int16_t[sz];
 		maxSamples = sz;
@@ -815,11 +816,16 @@ public:
 		this->resetval();
 	}
 
+	// Vraci posledni ulozeny vzorek
 	int32_t Get(void)
 	{
 		std::lock_guard<std::mutex> lock(mutex);
 
-		return valBuf[tailIdx];
+		if (nmrSamples == 0)
+		{
+			return def.def;
+		}
+		return valBuf[(headIdx == 0) ? (maxSamples - 1) : (headIdx - 1)];
 	}
 
 	bool Set(int32_t val)
@@ -837,6 +843,10 @@ public:
 
 		std::lock_guard<std::mutex> lock(mutex);
 
+		if (maxSamples == 0)
+		{
+			return false;
+		}
 		valBuf[headIdx] = (int16_t)val;
 		headIdx++;
 		retval = true;
@@ -0,0 +1,127 @@
+/***********************************************************************
+ * Filename: transport.cpp
+ * Author: Pavel Kejik
+ * Date: 2024-04-12
+ * Description:
+ *     Implements ESPNowTransport, the ESP-NOW radio link of ESPNowCtrl.
+ *
+ ***********************************************************************/
+
+#include "transport.h"
+#include "WiFi.h"
+
+TransportRecvCallback ESPNowTransport::recvCallback = NULL;
+TransportSentCallback ESPNowTransport::sentCallback = NULL;
+int8_t ESPNowTransport::lastRssi = 0;
+uint8_t ESPNowTransport::lastRssiAddr[6];
+
+bool ESPNowTransport::Init(TransportRecvCallback recvCb, TransportSentCallback sentCb)
+{
+    WiFi.mode(WIFI_STA);
+    esp_wifi_set_ps(WIFI_PS_NONE);
+
+    if (esp_now_init() != ESP_OK)
+    {
+        return false;
+    }
+    esp_now_set_wake_window(UINT16_MAX);
+
+    recvCallback = recvCb;
+    sentCallback = sentCb;
+
+    esp_now_register_recv_cb(onDataRecv);
+    esp_now_register_send_cb(onDataSent);
+    setRssiCapture(true);
+    return true;
+}
+
+void ESPNowTransport::Deinit(void)
+{
+    setRssiCapture(false);
+    esp_now_deinit();
+    WiFi.mode(WIFI_OFF);
+}
+
+/* ESP-NOW receive callback carries no RSSI, it is taken from the action frame
+   seen just before. The power control needs the RSSI of every wake, so the
+   capture runs as long as the link is up; the filter keeps it to management
+   frames, data frames of other networks never reach the callback. */
+void ESPNowTransport::setRssiCapture(bool enable)
+{
+    if (enable)
+    {
+        wifi_promiscuous_filter_t filter = {.filter_mask = WIFI_PROMIS_FILTER_MASK_MGMT};
+        esp_wifi_set_promiscuous_filter(&filter);
+        esp_wifi_set_promiscuous_rx_cb(onPromiscuousRecv);
+    }
+    else
+    {
+        lastRssi = 0;
+    }
+    esp_wifi_set_promiscuous(enable);
+}
+
+bool ESPNowTransport::AddPeer(const uint8_t *mac_addr, uint8_t channel)
+{
+    esp_now_peer_info_t peer;
+    memset(&peer, 0, sizeof(esp_now_peer_info_t));
+    peer.channel = channel;
+    peer.encrypt = false;
+    // peer.ifidx = WIFI_IF_STA;
+    memcpy(peer.peer_addr, mac_addr, sizeof(uint8_t[6]));
+    return esp_now_add_peer(&peer) == ESP_OK;
+}
+
+void ESPNowTransport::DeletePeer(const uint8_t *mac_addr)
+{
+    esp_now_del_peer(mac_addr);
+}
+
+void ESPNowTransport::SetChannel(uint8_t channel)
+{
+    esp_wifi_set_channel(channel, WIFI_SECOND_CHAN_NONE);
+}
+
+bool ESPNowTransport::SetRate(wifi_phy_rate_t rate)
+{
+    return esp_wifi_config_espnow_rate(WIFI_IF_STA, rate) == ESP_OK;
+}
+
+void ESPNowTransport::SetPower(wifi_power_t power)
+{
+    WiFi.setTxPower(power);
+}
+
+bool ESPNowTransport::Send(const uint8_t *peer_addr, const uint8_t *data, size_t len)
+{
+    return esp_now_send(peer_addr, data, len) == ESP_OK;
+}
+
+/* Runs in the Wi-Fi task right before onDataRecv of the same frame, ESP-NOW
+   frames are vendor specific action frames and the transmitter is address 2. */
+void ESPNowTransport::onPromiscuousRecv(void *buf, wifi_promiscuous_pkt_type_t type)
+{
+    const wifi_promiscuous_pkt_t *pkt = (const wifi_promiscuous_pkt_t *)buf;
+    if (type != WIFI_PKT_MGMT || pkt->payload[0] != 0xD0)
+    {
+        return;
+    }
+    lastRssi = pkt->rx_ctrl.rssi;
+    memcpy(lastRssiAddr, &pkt->payload[10], 6);
+}
+
+void ESPNowTransport::onDataRecv(const uint8_t *mac_addr, const uint8_t *data, int len)
+{
+    if (recvCallback != NULL)
+    {
+        recvCallback(mac_addr, data, len, (memcmp(lastRssiAddr, mac_addr, 6) == 0) ? lastRssi : 0);
+    }
+}
+
+void ESPNowTransport::onDataSent(const uint8_t *mac_addr, esp_now_send_status_t status)
+{
+    if (sentCallback != NULL)
+    {
+        sentCallback(mac_addr, status);
+    }
+}
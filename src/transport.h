@@ -0,0 +1,60 @@
+/***********************************************************************
+ * Filename: transport.h
+ * Author: Pavel Kejik
+ * Date: 2024-04-12
+ * Description:
+ *     Declares the Transport interface, the radio link used by
+ *     ESPNowCtrl for sending and receiving frames, and ESPNowTransport,
+ *     its implementation on top of ESP-NOW. The send status of frames
+ *     must be reported in the order the frames were sent.
+ *
+ ***********************************************************************/
+
+#pragma once
+#include "Arduino.h"
+#include "esp_now.h"
+#include "esp_wifi.h"
+#include "WiFiGeneric.h"
+
+/* Called from the transport's own context, must not block */
+typedef void (*TransportRecvCallback)(const uint8_t *mac_addr, const uint8_t *data, int len, int8_t rssi);
+typedef void (*TransportSentCallback)(const uint8_t *mac_addr, esp_now_send_status_t status);
+
+class Transport
+{
+public:
+    virtual ~Transport() {}
+
+    virtual bool Init(TransportRecvCallback recvCb, TransportSentCallback sentCb) = 0;
+    virtual void Deinit(void) = 0;
+    virtual bool AddPeer(const uint8_t *mac_addr, uint8_t channel) = 0;
+    virtual void DeletePeer(const uint8_t *mac_addr) = 0;
+    virtual void SetChannel(uint8_t channel) = 0;
+    virtual bool SetRate(wifi_phy_rate_t rate) = 0;
+    virtual void SetPower(wifi_power_t power) = 0;
+    virtual bool Send(const uint8_t *peer_addr, const uint8_t *data, size_t len) = 0;
+};
+
+class ESPNowTransport : public Transport
+{
+private:
+    static TransportRecvCallback recvCallback;
+    static TransportSentCallback sentCallback;
+    static int8_t lastRssi;
+    static uint8_t lastRssiAddr[6];
+
+    static void setRssiCapture(bool enable);
+    static void onPromiscuousRecv(void *buf, wifi_promiscuous_pkt_type_t type);
+    static void onDataRecv(const uint8_t *mac_addr, const uint8_t *data, int len);
+    static void onDataSent(const uint8_t *mac_addr, esp_now_send_status_t status);
+
+public:
+    bool Init(TransportRecvCallback recvCb, TransportSentCallback sentCb);
+    void Deinit(void);
+    bool AddPeer(const uint8_t *mac_addr, uint8_t channel);
+    void DeletePeer(const uint8_t *mac_addr);
+    void SetChannel(uint8_t channel);
+    bool SetRate(wifi_phy_rate_t rate);
+    void SetPower(wifi_power_t power);
+    bool Send(const uint8_t *peer_addr, const uint8_t *data, size_t len);
+};
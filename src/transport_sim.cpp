@@ -0,0 +1,666 @@
+/***********************************************************************
+ * Filename: transport_sim.cpp
+ * Author: Pavel Kejik
+ * Date: 2024-04-12
+ * Description:
+ *     Implements SimTransport. Both directions share one simulated air:
+ *     every frame occupies it for its airtime at its PHY rate capped by
+ *     the configured bandwidth, then arrives after the latency unless
+ *     it is lost.
+ *     Frames are delivered and their send status reported in order.
+ *     The default gateway keeps one reassembly buffer per stream tag
+ *     with a bit per received chunk and the parity of its recent FEC
+ *     groups.
+ *
+ ***********************************************************************/
+
+#ifdef TRANSPORT_SIM
+
+#include "transport_sim.h"
+#include "fec.h"
+
+SimTransport simTransport;
+
+SimTransport::SimTransport(void)
+{
+    model = {0, 0, 2, 0, 1000, 1, -60, 0, 0};
+    memset(&stats, 0, sizeof(stats));
+    gateway = SimGatewayDefault;
+    const uint8_t gwMac[6] = {0x02, 0x00, 0x00, 0x00, 0x00, 0x01};
+    const uint8_t camMac[6] = {0x02, 0x00, 0x00, 0x00, 0x00, 0x02};
+    memcpy(gatewayMac, gwMac, 6);
+    memcpy(clientMac, camMac, 6);
+    channel = 1;
+    rate_kbps = 1000;
+    busyUntil = 0;
+    statusDelayMs = 0;
+    air = NULL;
+    task = NULL;
+    recvCallback = NULL;
+    sentCallback = NULL;
+}
+
+void SimTransport::SetChannelModel(const SimChannel_t &newModel)
+{
+    model = newModel;
+}
+
+void SimTransport::SetGateway(const uint8_t *mac_addr, SimGatewayScript script)
+{
+    memcpy(gatewayMac, mac_addr, 6);
+    gateway = script;
+}
+
+void SimTransport::ResetStats(void)
+{
+    memset(&stats, 0, sizeof(stats));
+}
+
+void SimTransport::PrintStats(void)
+{
+    Serial.printf("Sim up: %u frames, %u B, %u lost, %u dropped; down: %u frames, %u B, %u lost; dup: %u; air: %u ms\n",
+                  stats.framesUp, stats.bytesUp, stats.lostUp, stats.dropped,
+                  stats.framesDown, stats.bytesDown, stats.lostDown,
+                  stats.duplicates, stats.airtime_us / 1000);
+}
+
+bool SimTransport::Init(TransportRecvCallback recvCb, TransportSentCallback sentCb)
+{
+    recvCallback = recvCb;
+    sentCallback = sentCb;
+    if (air == NULL)
+    {
+        air = xQueueCreate(SIM_AIR_QUEUE_SIZE, sizeof(SimFrame_t));
+        xTaskCreateUniversal(airTask, "simAirTask", 4096, this, 6, &task, ARDUINO_RUNNING_CORE);
+    }
+    return air != NULL;
+}
+
+void SimTransport::Deinit(void)
+{
+    recvCallback = NULL;
+    sentCallback = NULL;
+}
+
+bool SimTransport::AddPeer(const uint8_t *mac_addr, uint8_t channel)
+{
+    return true;
+}
+
+void SimTransport::DeletePeer(const uint8_t *mac_addr)
+{
+}
+
+void SimTransport::SetChannel(uint8_t newChannel)
+{
+    channel = newChannel;
+}
+
+bool SimTransport::SetRate(wifi_phy_rate_t rate)
+{
+    switch (rate)
+    {
+    case WIFI_PHY_RATE_2M_L:
+        rate_kbps = 2000;
+        break;
+    case WIFI_PHY_RATE_5M_L:
+        rate_kbps = 5500;
+        break;
+    case WIFI_PHY_RATE_11M_L:
+        rate_kbps = 11000;
+        break;
+    case WIFI_PHY_RATE_6M:
+        rate_kbps = 6000;
+        break;
+    case WIFI_PHY_RATE_9M:
+        rate_kbps = 9000;
+        break;
+    case WIFI_PHY_RATE_12M:
+        rate_kbps = 12000;
+        break;
+    case WIFI_PHY_RATE_18M:
+        rate_kbps = 18000;
+        break;
+    case WIFI_PHY_RATE_24M:
+        rate_kbps = 24000;
+        break;
+    case WIFI_PHY_RATE_36M:
+        rate_kbps = 36000;
+        break;
+    case WIFI_PHY_RATE_48M:
+        rate_kbps = 48000;
+        break;
+    case WIFI_PHY_RATE_54M:
+        rate_kbps = 54000;
+        break;
+    default:
+        rate_kbps = 1000;
+        break;
+    }
+    return true;
+}
+
+void SimTransport::SetPower(wifi_power_t power)
+{
+}
+
+bool SimTransport::Send(const uint8_t *peer_addr, const uint8_t *data, size_t len)
+{
+    return transmit(true, peer_addr, data, len);
+}
+
+/* Gateway answer, it travels back over the same simulated air */
+bool SimTransport::Reply(uint8_t messageType, const void *payload, uint16_t payloadSize)
+{
+    Message msg;
+    msg.messageType = messageType;
+    SetPayloadSize(&msg, payloadSize);
+    if (payloadSize > 0)
+    {
+        memcpy(msg.payload, payload, payloadSize);
+    }
+    return transmit(false, gatewayMac, (const uint8_t *)&msg, MESSAGE_HEADER_SIZE + payloadSize);
+}
+
+bool SimTransport::chance(uint16_t permille)
+{
+    return permille > 0 && (esp_random() % 1000) < permille;
+}
+
+bool SimTransport::transmit(bool up, const uint8_t *mac_addr, const uint8_t *data, int len)
+{
+    SimFrame_t frame;
+    if (air == NULL || len > (int)sizeof(frame.data))
+    {
+        return false;
+    }
+
+    std::lock_guard<std::mutex> lock(airMutex);
+    uint32_t now = micros();
+    /* Gateway answers are not rate controlled, they go at the channel bandwidth */
+    uint32_t kbps = up ? rate_kbps : 0;
+    if (model.bandwidth_kbps > 0)
+    {
+        kbps = (kbps > 0) ? min(kbps, model.bandwidth_kbps) : model.bandwidth_kbps;
+    }
+    uint32_t airtime_us = (kbps > 0) ? len * 8000 / kbps : 0;
+    uint32_t start = ((int32_t)(busyUntil - now) > 0) ? busyUntil : now;
+    busyUntil = start + airtime_us;
+    stats.airtime_us += airtime_us;
+
+    frame.up = up;
+    frame.rate_kbps = up ? rate_kbps : 0;
+    frame.statusDelayMs = up ? statusDelayMs : 0;
+    statusDelayMs = up ? 0 : statusDelayMs;
+    memcpy(frame.mac_addr, mac_addr, 6);
+    frame.dueAt = busyUntil + 1000 * (model.latencyMs + ((model.jitterMs > 0) ? esp_random() % (model.jitterMs + 1) : 0));
+    frame.len = len;
+    memcpy(frame.data, data, len);
+    return xQueueSendToBack(air, &frame, 0) == pdTRUE;
+}
+
+void SimTransport::deliver(SimFrame_t &frame)
+{
+    bool tooFast = model.maxRate_kbps > 0 && frame.rate_kbps > model.maxRate_kbps;
+    bool lost = (channel != model.gatewayChannel) || tooFast || chance(model.lossPermille);
+    uint8_t copies = (!lost && chance(model.duplicatePermille)) ? 2 : 1;
+    Message *msg = (Message *)frame.data;
+
+    /* The gateway stand-in does not check sequence numbers */
+    if (frame.up && (msg->messageType & MSG_SEQ_FLAG) && frame.len >= (int)(MESSAGE_HEADER_SIZE + MSG_SEQ_SIZE))
+    {
+        msg->messageType &= ~MSG_SEQ_FLAG;
+        frame.len -= MSG_SEQ_SIZE;
+    }
+    if (msg->payloadSize == PAYLOAD_SIZE_EXTENDED)
+    {
+        msg->extPayloadSize = frame.len - MESSAGE_HEADER_SIZE;
+    }
+    stats.duplicates += copies - 1;
+
+    if (frame.up)
+    {
+        stats.framesUp++;
+        stats.bytesUp += frame.len;
+        stats.lostUp += lost ? 1 : 0;
+        bool broadcast = memcmp(frame.mac_addr, BroadcastAddress, 6) == 0;
+        bool toGateway = broadcast || memcmp(frame.mac_addr, gatewayMac, 6) == 0;
+        /* A dropped frame is acknowledged on MAC level, only receiver feedback can reveal it */
+        bool dropped = !lost && (msg->messageType == MSG_BYTE_STREAM || msg->messageType == MSG_FEC_PARITY) && chance(model.dropPermille);
+        stats.dropped += dropped ? 1 : 0;
+        for (uint8_t i = 0; i < copies && !lost && !dropped && toGateway && gateway != NULL; i++)
+        {
+            gateway(this, clientMac, msg, frame.len);
+        }
+        if (frame.statusDelayMs > 0)
+        {
+            delay(frame.statusDelayMs);
+        }
+        if (sentCallback != NULL)
+        {
+            /* Broadcast frames are not acknowledged, their status is always success */
+            sentCallback(frame.mac_addr, ((lost || !toGateway) && !broadcast) ? ESP_NOW_SEND_FAIL : ESP_NOW_SEND_SUCCESS);
+        }
+    }
+    else
+    {
+        stats.framesDown++;
+        stats.bytesDown += frame.len;
+        stats.lostDown += lost ? 1 : 0;
+        for (uint8_t i = 0; i < copies && !lost && recvCallback != NULL; i++)
+        {
+            recvCallback(frame.mac_addr, frame.data, frame.len, model.rssi);
+        }
+    }
+}
+
+void SimTransport::airTask(void *arg)
+{
+    SimTransport *sim = (SimTransport *)arg;
+    SimFrame_t frame;
+    while (true)
+    {
+        if (xQueueReceive(sim->air, &frame, portMAX_DELAY) == pdTRUE)
+        {
+            int32_t wait_us = frame.dueAt - micros();
+            if (wait_us > 0)
+            {
+                delay((wait_us + 999) / 1000);
+            }
+            sim->deliver(frame);
+        }
+    }
+}
+
+#define SIM_GATEWAY_STREAMS 8
+#define SIM_GATEWAY_GROUPS 8
+
+typedef struct
+{
+    bool used;
+    uint32_t index; /* Byte offset of the first chunk of the group */
+    uint8_t size;
+    uint8_t *parity[FEC_MAX_PARITY];
+} SimFecGroup_t;
+
+typedef struct
+{
+    bool used;
+    bool complete;
+    uint8_t tag;
+    uint32_t len;
+    size_t chunkSize;
+    uint32_t nmrChunks;
+    uint8_t *data;     /* Whole chunks, the last one zero padded as in the parity */
+    uint8_t *received; /* One bit per chunk */
+    SimFecGroup_t groups[SIM_GATEWAY_GROUPS];
+    uint8_t nextGroup;
+} SimStream_t;
+
+static SimStream_t gwStreams[SIM_GATEWAY_STREAMS];
+static uint8_t gwNextStream = 0;
+static SimGatewayStats_t gwStats;
+
+static void freeGroup(SimFecGroup_t *group)
+{
+    for (uint8_t j = 0; j < FEC_MAX_PARITY; j++)
+    {
+        free(group->parity[j]);
+    }
+    memset(group, 0, sizeof(SimFecGroup_t));
+}
+
+static void freeStream(SimStream_t *stream)
+{
+    free(stream->data);
+    free(stream->received);
+    for (uint8_t i = 0; i < SIM_GATEWAY_GROUPS; i++)
+    {
+        freeGroup(&stream->groups[i]);
+    }
+    memset(stream, 0, sizeof(SimStream_t));
+}
+
+static SimStream_t *findStream(uint8_t tag, uint32_t len)
+{
+    for (uint8_t i = 0; i < SIM_GATEWAY_STREAMS; i++)
+    {
+        if (gwStreams[i].used && gwStreams[i].tag == tag && gwStreams[i].len == len)
+        {
+            return &gwStreams[i];
+        }
+    }
+    return NULL;
+}
+
+/* A new stream replaces the previous one with the same tag, chunk size is the one agreed at pairing */
+static SimStream_t *newStream(uint8_t tag, uint32_t len)
+{
+    SimStream_t *stream = NULL;
+    for (uint8_t i = 0; i < SIM_GATEWAY_STREAMS && stream == NULL; i++)
+    {
+        if (gwStreams[i].used && gwStreams[i].tag == tag)
+        {
+            stream = &gwStreams[i];
+        }
+    }
+    for (uint8_t i = 0; i < SIM_GATEWAY_STREAMS && stream == NULL; i++)
+    {
+        if (!gwStreams[i].used)
+        {
+            stream = &gwStreams[i];
+        }
+    }
+    if (stream == NULL)
+    {
+        stream = &gwStreams[gwNextStream];
+        gwNextStream = (gwNextStream + 1) % SIM_GATEWAY_STREAMS;
+    }
+    freeStream(stream);
+
+    if (len == 0)
+    {
+        return NULL;
+    }
+    stream->chunkSize = ESPNowCtrl::GetDataChunkSize();
+    stream->nmrChunks = (len + stream->chunkSize - 1) / stream->chunkSize;
+    stream->data = (uint8_t *)calloc(stream->nmrChunks, stream->chunkSize);
+    stream->received = (uint8_t *)calloc((stream->nmrChunks + 7) / 8, 1);
+    if (stream->data == NULL || stream->received == NULL)
+    {
+        freeStream(stream);
+        return NULL;
+    }
+    stream->used = true;
+    stream->tag = tag;
+    stream->len = len;
+    return stream;
+}
+
+static bool chunkReceived(const SimStream_t *stream, uint32_t chunk)
+{
+    return stream->received[chunk / 8] & (1 << (chunk % 8));
+}
+
+static uint32_t firstMissing(const SimStream_t *stream)
+{
+    uint32_t chunk = 0;
+    while (chunk < stream->nmrChunks && chunkReceived(stream, chunk))
+    {
+        chunk++;
+    }
+    return chunk;
+}
+
+static SimFecGroup_t *groupOf(SimStream_t *stream, uint32_t chunk)
+{
+    for (uint8_t i = 0; i < SIM_GATEWAY_GROUPS; i++)
+    {
+        SimFecGroup_t *group = &stream->groups[i];
+        uint32_t first = group->index / stream->chunkSize;
+        if (group->used && chunk >= first && chunk < first + group->size)
+        {
+            return group;
+        }
+    }
+    return NULL;
+}
+
+/* Parity of the most recent groups is kept, the oldest group makes room */
+static SimFecGroup_t *fecGroup(SimStream_t *stream, uint32_t index, uint8_t size)
+{
+    for (uint8_t i = 0; i < SIM_GATEWAY_GROUPS; i++)
+    {
+        if (stream->groups[i].used && stream->groups[i].index == index && stream->groups[i].size == size)
+        {
+            return &stream->groups[i];
+        }
+    }
+    SimFecGroup_t *group = &stream->groups[stream->nextGroup];
+    stream->nextGroup = (stream->nextGroup + 1) % SIM_GATEWAY_GROUPS;
+    freeGroup(group);
+    group->used = true;
+    group->index = index;
+    group->size = size;
+    return group;
+}
+
+static void recoverGroup(SimStream_t *stream, SimFecGroup_t *group)
+{
+    uint8_t *chunks[FEC_GROUP_SIZE];
+    bool lost[FEC_GROUP_SIZE];
+    uint8_t nmrLost = 0;
+    uint32_t first = group->index / stream->chunkSize;
+
+    for (uint8_t k = 0; k < group->size; k++)
+    {
+        chunks[k] = stream->data + (first + k) * stream->chunkSize;
+        lost[k] = !chunkReceived(stream, first + k);
+        nmrLost += lost[k] ? 1 : 0;
+    }
+    if (nmrLost == 0 || !FecDecoder::Recover(chunks, lost, group->size, group->parity, stream->chunkSize))
+    {
+        return;
+    }
+    for (uint8_t k = 0; k < group->size; k++)
+    {
+        if (lost[k])
+        {
+            stream->received[(first + k) / 8] |= 1 << ((first + k) % 8);
+        }
+    }
+    gwStats.fecRecovered += nmrLost;
+}
+
+/* MSG_ACK with index below len reports progress, MSG_NACK lists the missing
+   chunks from the first one on. Multiplexed streams have a nonzero tag and
+   their feedback starts with it. */
+static void sendFeedback(SimTransport *sim, const SimStream_t *stream, bool selective)
+{
+    uint8_t reply[MAX_FRAME_PAYLOAD_SIZE];
+    uint8_t prefix = (stream->tag != 0) ? 1 : 0;
+    StreamAckPayload ack;
+    size_t size = offsetof(StreamAckPayload, bitmap);
+    uint8_t messageType = MSG_ACK;
+    uint32_t missing = firstMissing(stream);
+
+    ack.max_mr_bytes = stream->len;
+    ack.index = min((size_t)stream->len, missing * stream->chunkSize);
+    ack.chunkSize = stream->chunkSize;
+    if (selective && missing < stream->nmrChunks)
+    {
+        size_t maxBits = min(sizeof(ack.bitmap), sizeof(reply) - prefix - size) * 8;
+        uint32_t bits = min((size_t)(stream->nmrChunks - missing), maxBits);
+        memset(ack.bitmap, 0, sizeof(ack.bitmap));
+        for (uint32_t bit = 0; bit < bits; bit++)
+        {
+            if (!chunkReceived(stream, missing + bit))
+            {
+                ack.bitmap[bit / 8] |= 1 << (bit % 8);
+            }
+        }
+        size += (bits + 7) / 8;
+        messageType = MSG_NACK;
+        gwStats.nacks++;
+    }
+    else
+    {
+        gwStats.acks++;
+    }
+    reply[0] = stream->tag;
+    memcpy(&reply[prefix], &ack, size);
+    sim->Reply(messageType, reply, prefix + size);
+}
+
+/* The whole stream is acknowledged once, missing chunks are reported when the
+   end of the stream arrives again, a new stream gets a progress ACK so the
+   sender knows feedback will come */
+static void streamProgress(SimTransport *sim, SimStream_t *stream, bool isNew, bool atEnd)
+{
+    bool wasComplete = stream->complete;
+    if (!stream->complete && firstMissing(stream) == stream->nmrChunks)
+    {
+        stream->complete = true;
+        gwStats.streamsDone++;
+    }
+    if (stream->complete ? (!wasComplete || atEnd) : (isNew || atEnd))
+    {
+        sendFeedback(sim, stream, atEnd);
+    }
+}
+
+static void gatewayStreamChunk(SimTransport *sim, const Message *msg)
+{
+    const ByteStreamPayload *payload = (const ByteStreamPayload *)msg->payload;
+    if (GetPayloadSize(msg) < offsetof(ByteStreamPayload, data.data))
+    {
+        return;
+    }
+    size_t nmr = (payload->data.nmr == PAYLOAD_SIZE_EXTENDED) ? GetPayloadSize(msg) - offsetof(ByteStreamPayload, data.data) : payload->data.nmr;
+    uint32_t index = payload->data.index;
+    uint32_t len = payload->max_mr_bytes;
+
+    size_t chunkSize = ESPNowCtrl::GetDataChunkSize();
+    if (index % chunkSize != 0 || nmr > chunkSize || index + nmr > len)
+    {
+        return;
+    }
+
+    /* Resent chunks of a complete stream carry the same data, different data
+       starts the next stream with the same tag and length */
+    SimStream_t *stream = findStream(payload->type, len);
+    bool isNew = stream == NULL || (stream->complete && memcmp(stream->data + index, payload->data.data, nmr) != 0);
+    if (isNew && (stream = newStream(payload->type, len)) == NULL)
+    {
+        return;
+    }
+    uint32_t chunk = index / chunkSize;
+    if (!chunkReceived(stream, chunk))
+    {
+        memcpy(stream->data + index, payload->data.data, nmr);
+        stream->received[chunk / 8] |= 1 << (chunk % 8);
+        SimFecGroup_t *group = groupOf(stream, chunk);
+        if (group != NULL)
+        {
+            recoverGroup(stream, group);
+        }
+    }
+    streamProgress(sim, stream, isNew, index + nmr >= len);
+}
+
+static void gatewayParity(SimTransport *sim, const Message *msg)
+{
+    const FecParityPayload *payload = (const FecParityPayload *)msg->payload;
+    uint8_t tag;
+    if (payload->streamType & FEC_STREAM_TAG_FLAG)
+    {
+        tag = payload->streamType & ~FEC_STREAM_TAG_FLAG;
+    }
+    else if (payload->streamType == MSG_BYTE_STREAM)
+    {
+        tag = 0;
+    }
+    else
+    {
+        return;
+    }
+
+    SimStream_t *stream = findStream(tag, payload->max_mr_bytes);
+    bool isNew = stream == NULL;
+    if (isNew && (stream = newStream(tag, payload->max_mr_bytes)) == NULL)
+    {
+        return;
+    }
+    size_t chunkSize = stream->chunkSize;
+    if (stream->complete || GetPayloadSize(msg) < offsetof(FecParityPayload, data) + chunkSize ||
+        payload->groupIndex % chunkSize != 0 || payload->groupSize == 0 || payload->groupSize > FEC_GROUP_SIZE ||
+        payload->parityIdx >= FEC_MAX_PARITY || payload->groupIndex / chunkSize + payload->groupSize > stream->nmrChunks)
+    {
+        return;
+    }
+    SimFecGroup_t *group = fecGroup(stream, payload->groupIndex, payload->groupSize);
+    if (group->parity[payload->parityIdx] == NULL)
+    {
+        group->parity[payload->parityIdx] = (uint8_t *)malloc(chunkSize);
+        if (group->parity[payload->parityIdx] == NULL)
+        {
+            return;
+        }
+        memcpy(group->parity[payload->parityIdx], payload->data, chunkSize);
+    }
+    recoverGroup(stream, group);
+    streamProgress(sim, stream, isNew, payload->groupIndex + payload->groupSize * chunkSize >= stream->len);
+}
+
+void SimGatewayDefault(SimTransport *sim, const uint8_t *mac_addr, const Message *msg, int len)
+{
+    switch (msg->messageType)
+    {
+    case MSG_PAIR_REQUEST:
+    {
+        PairResponsePayload response;
+        response.deviceType = ((const PairRequestPayload *)msg->payload)->deviceType;
+        response.channel = sim->GetChannelModel().gatewayChannel;
+        response.state = PAIR_STATE_PAIRED;
+        response.maxPayload = MAX_FRAME_PAYLOAD_SIZE;
+        /* Slot scheduling and thumbnail previews are not simulated */
+        response.capabilities = CAP_LARGE_FRAMES | CAP_FEC | CAP_SEQUENCE | CAP_STREAM_MUX | CAP_STREAM_ACK;
+        sim->Reply(MSG_PAIR_RESPONSE, &response, sizeof(response));
+        break;
+    }
+    case MSG_WAKE_REPORT:
+    {
+        WakeReplyPayload reply;
+        memset(&reply, 0, sizeof(reply));
+        sim->Reply(MSG_WAKE_REPLY, &reply, offsetof(WakeReplyPayload, values));
+        break;
+    }
+    case MSG_TRANSMIT_DONE:
+        sim->Reply(MSG_TRANSMIT_DONE, NULL, 0);
+        break;
+    case MSG_BYTE_STREAM:
+        gatewayStreamChunk(sim, msg);
+        break;
+    case MSG_FEC_PARITY:
+        gatewayParity(sim, msg);
+        break;
+    case MSG_STREAM_RESUME:
+    {
+        if (GetPayloadSize(msg) < sizeof(StreamResumePayload))
+        {
+            break;
+        }
+        StreamResumePayload response = *(const StreamResumePayload *)msg->payload;
+        const SimStream_t *stream = findStream(response.type, response.max_mr_bytes);
+        response.index = (stream != NULL) ? min((size_t)stream->len, firstMissing(stream) * stream->chunkSize) : 0;
+        gwStats.resumes++;
+        sim->Reply(MSG_STREAM_RESUME, &response, sizeof(response));
+        break;
+    }
+    default:
+        break;
+    }
+}
+
+const uint8_t *SimGatewayStreamData(uint8_t tag, uint32_t len)
+{
+    const SimStream_t *stream = findStream(tag, len);
+    return (stream != NULL && stream->complete) ? stream->data : NULL;
+}
+
+const SimGatewayStats_t &SimGatewayGetStats(void)
+{
+    return gwStats;
+}
+
+void SimGatewayReset(void)
+{
+    for (uint8_t i = 0; i < SIM_GATEWAY_STREAMS; i++)
+    {
+        freeStream(&gwStreams[i]);
+    }
+    gwNextStream = 0;
+    memset(&gwStats, 0, sizeof(gwStats));
+}
+
+#endif /*TRANSPORT_SIM*/
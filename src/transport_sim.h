@@ -0,0 +1,134 @@
+/***********************************************************************
+ * Filename: transport_sim.h
+ * Author: Pavel Kejik
+ * Date: 2024-04-12
+ * Description:
+ *     Declares SimTransport, an in-process replacement of the ESP-NOW
+ *     radio link. Frames go through a simulated channel with loss,
+ *     latency, bandwidth limit, duplicate delivery and channel mismatch
+ *     to a scriptable gateway stand-in. The default gateway reassembles
+ *     byte streams, rebuilds chunks from FEC parity and answers with
+ *     selective ACK/NACK. Built only with TRANSPORT_SIM.
+ *
+ ***********************************************************************/
+
+#pragma once
+#ifdef TRANSPORT_SIM
+
+#include "transport.h"
+#include "esp_now_ctrl.h"
+#include "freertos/queue.h"
+#include <mutex>
+
+#define SIM_AIR_QUEUE_SIZE 16
+
+typedef struct
+{
+    uint16_t lossPermille;      /* Frames lost in each direction */
+    uint16_t duplicatePermille; /* Frames delivered twice */
+    uint16_t latencyMs;
+    uint16_t jitterMs;
+    uint32_t bandwidth_kbps;    /* 0 = limited only by the PHY rate */
+    uint8_t gatewayChannel;     /* Frames sent on another channel are lost */
+    int8_t rssi;
+    uint16_t dropPermille;      /* Stream frames acknowledged but not stored by the gateway */
+    uint16_t maxRate_kbps;      /* Frames sent at a faster PHY rate are lost, 0 = every rate works */
+} SimChannel_t;
+
+typedef struct
+{
+    uint32_t framesUp;
+    uint32_t framesDown;
+    uint32_t lostUp;
+    uint32_t lostDown;
+    uint32_t duplicates;
+    uint32_t dropped;
+    uint32_t bytesUp;
+    uint32_t bytesDown;
+    uint32_t airtime_us;
+} SimStats_t;
+
+class SimTransport;
+
+/* Gateway stand-in, called in the air task for every frame the gateway receives */
+typedef void (*SimGatewayScript)(SimTransport *sim, const uint8_t *mac_addr, const Message *msg, int len);
+
+class SimTransport : public Transport
+{
+private:
+    typedef struct
+    {
+        bool up;
+        uint8_t mac_addr[6];
+        uint32_t dueAt; /* us */
+        uint16_t rate_kbps;
+        uint32_t statusDelayMs;
+        int len;
+        uint8_t data[sizeof(Message)];
+    } SimFrame_t;
+
+    SimChannel_t model;
+    SimStats_t stats;
+    SimGatewayScript gateway;
+    uint8_t gatewayMac[6];
+    uint8_t clientMac[6];
+    uint8_t channel;
+    uint16_t rate_kbps;
+    uint32_t busyUntil; /* us */
+    uint32_t statusDelayMs;
+    QueueHandle_t air;
+    std::mutex airMutex;
+    TaskHandle_t task;
+    TransportRecvCallback recvCallback;
+    TransportSentCallback sentCallback;
+
+    bool chance(uint16_t permille);
+    bool transmit(bool up, const uint8_t *mac_addr, const uint8_t *data, int len);
+    void deliver(SimFrame_t &frame);
+    static void airTask(void *arg);
+
+public:
+    SimTransport(void);
+
+    void SetChannelModel(const SimChannel_t &newModel);
+    const SimChannel_t &GetChannelModel(void) { return model; }
+    void SetGateway(const uint8_t *mac_addr, SimGatewayScript script);
+    bool Reply(uint8_t messageType, const void *payload, uint16_t payloadSize);
+    /* The send status of the next frame comes ms late, the later statuses wait behind it */
+    void DelayNextStatus(uint32_t ms) { statusDelayMs = ms; }
+    const SimStats_t &GetStats(void) { return stats; }
+    void ResetStats(void);
+    void PrintStats(void);
+
+    bool Init(TransportRecvCallback recvCb, TransportSentCallback sentCb);
+    void Deinit(void);
+    bool AddPeer(const uint8_t *mac_addr, uint8_t channel);
+    void DeletePeer(const uint8_t *mac_addr);
+    void SetChannel(uint8_t newChannel);
+    bool SetRate(wifi_phy_rate_t rate);
+    void SetPower(wifi_power_t power);
+    bool Send(const uint8_t *peer_addr, const uint8_t *data, size_t len);
+};
+
+typedef struct
+{
+    uint32_t streamsDone;
+    uint32_t acks;
+    uint32_t nacks;
+    uint32_t fecRecovered; /* Chunks rebuilt from parity */
+    uint32_t resumes;
+} SimGatewayStats_t;
+
+/* Answers pairing, wake reports, done markers and stream resume requests,
+   reassembles byte streams and reports missing chunks with MSG_NACK */
+void SimGatewayDefault(SimTransport *sim, const uint8_t *mac_addr, const Message *msg, int len);
+
+/* Data of the last complete stream with tag and length len, NULL when there is none */
+const uint8_t *SimGatewayStreamData(uint8_t tag, uint32_t len);
+const SimGatewayStats_t &SimGatewayGetStats(void);
+/* Forgets all streams and statistics of the default gateway */
+void SimGatewayReset(void);
+
+extern SimTransport simTransport;
+
+#endif /*TRANSPORT_SIM*/
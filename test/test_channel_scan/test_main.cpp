@@ -0,0 +1,152 @@
+/***********************************************************************
+ * Filename: test_main.cpp
+ * Author: Pavel Kejik
+ * Date: 2024-04-12
+ * Description:
+ *     Time to pair of the ChannelScan history against the plain
+ *     sequential scan, for a gateway that stays on one channel, one
+ *     that mostly stays and one that moves at random. A probe costs
+ *     the channel switch, a missed probe also its timeout, an answered
+ *     probe the round trip.
+ *
+ ***********************************************************************/
+
+#include <unity.h>
+#include "channel_scan.h"
+
+#define SWITCH_MS 5
+#define RTT_US 3000
+#define WARMUP_PAIRINGS 20
+#define PAIRINGS 500
+
+typedef uint8_t (*GatewayChannel_t)(void);
+
+static uint8_t lastChannel;
+
+static uint32_t pairWithHistory(uint8_t gateway)
+{
+    uint8_t order[MAX_CHANNEL];
+    uint8_t nmr = ChannelScan::Order(lastChannel, order);
+    uint32_t ms = 0;
+    for (uint8_t i = 0; i < nmr; i++)
+    {
+        ms += SWITCH_MS;
+        if (order[i] == gateway)
+        {
+            ChannelScan::Paired(gateway, RTT_US);
+            lastChannel = gateway;
+            return ms + RTT_US / 1000;
+        }
+        ms += ChannelScan::ProbeTimeout();
+    }
+    return ms;
+}
+
+static uint32_t pairSequential(uint8_t gateway)
+{
+    uint32_t ms = 0;
+    for (uint8_t channel = 1; channel <= MAX_CHANNEL; channel++)
+    {
+        ms += SWITCH_MS;
+        if (channel == gateway)
+        {
+            return ms + RTT_US / 1000;
+        }
+        ms += PAIR_PROBE_MAX_MS;
+    }
+    return ms;
+}
+
+static uint8_t fixedChannel(void)
+{
+    return 11;
+}
+
+static uint8_t mostlyChannel6(void)
+{
+    uint32_t r = random(100);
+    return r < 80 ? 6 : (r < 90 ? 1 : 11);
+}
+
+static uint8_t anyChannel(void)
+{
+    return random(1, MAX_CHANNEL + 1);
+}
+
+static void measure(const char *name, GatewayChannel_t gateway, float *history, float *sequential)
+{
+    randomSeed(1);
+    for (int i = 0; i < WARMUP_PAIRINGS; i++)
+    {
+        pairWithHistory(gateway());
+    }
+    uint64_t historyMs = 0;
+    uint64_t sequentialMs = 0;
+    for (int i = 0; i < PAIRINGS; i++)
+    {
+        uint8_t channel = gateway();
+        historyMs += pairWithHistory(channel);
+        sequentialMs += pairSequential(channel);
+    }
+    *history = (float)historyMs / PAIRINGS;
+    *sequential = (float)sequentialMs / PAIRINGS;
+    char msg[96];
+    snprintf(msg, sizeof(msg), "%s: history %.1f ms, sequential %.1f ms", name, *history, *sequential);
+    TEST_MESSAGE(msg);
+}
+
+void test_fixed_channel(void)
+{
+    float history, sequential;
+    measure("fixed channel 11", fixedChannel, &history, &sequential);
+    TEST_ASSERT_LESS_THAN_UINT32(SWITCH_MS + RTT_US / 1000 + 1, (uint32_t)history);
+    TEST_ASSERT_LESS_THAN_UINT32((uint32_t)sequential, (uint32_t)history);
+}
+
+void test_mostly_one_channel(void)
+{
+    float history, sequential;
+    measure("mostly channel 6", mostlyChannel6, &history, &sequential);
+    TEST_ASSERT_LESS_THAN_UINT32((uint32_t)sequential / 4, (uint32_t)history);
+}
+
+void test_random_channel(void)
+{
+    float history, sequential;
+    measure("random channel", anyChannel, &history, &sequential);
+    TEST_ASSERT_LESS_THAN_UINT32((uint32_t)sequential, (uint32_t)history);
+}
+
+void setUp(void)
+{
+    ChannelScan::Clear();
+    lastChannel = 0;
+}
+
+void tearDown(void)
+{
+}
+
+/* The first pairing knows nothing and waits the full probe time */
+void test_first_pairing(void)
+{
+    TEST_ASSERT_EQUAL_UINT32(PAIR_PROBE_MAX_MS, ChannelScan::ProbeTimeout());
+    ChannelScan::Paired(3, RTT_US);
+    TEST_ASSERT_EQUAL_UINT32(PAIR_PROBE_MIN_MS, ChannelScan::ProbeTimeout());
+    uint8_t order[MAX_CHANNEL];
+    TEST_ASSERT_EQUAL(MAX_CHANNEL, ChannelScan::Order(0, order));
+    TEST_ASSERT_EQUAL_UINT8(3, order[0]);
+    TEST_ASSERT_EQUAL(MAX_CHANNEL, ChannelScan::Order(9, order));
+    TEST_ASSERT_EQUAL_UINT8(9, order[0]);
+    TEST_ASSERT_EQUAL_UINT8(3, order[1]);
+}
+
+int main(int argc, char **argv)
+{
+    UNITY_BEGIN();
+    RUN_TEST(test_first_pairing);
+    RUN_TEST(test_fixed_channel);
+    RUN_TEST(test_mostly_one_channel);
+    RUN_TEST(test_random_channel);
+    return UNITY_END();
+}
@@ -0,0 +1,218 @@
+/***********************************************************************
+ * Filename: test_main.cpp
+ * Author: Pavel Kejik
+ * Date: 2024-04-12
+ * Description:
+ *     Reed-Solomon parity of FecEncoder against a bitwise GF(2^8)
+ *     reference, and FecDecoder rebuilding every pattern of lost
+ *     chunks the parity covers. The encode benchmark reports the time
+ *     per group of full size chunks for every parity count.
+ *
+ ***********************************************************************/
+
+#include <unity.h>
+#include "fec.h"
+
+#define CHUNK_SIZE 64
+#define BENCH_ROUNDS 200
+
+static uint8_t refMul(uint8_t a, uint8_t b)
+{
+    uint8_t product = 0;
+    while (b != 0)
+    {
+        if (b & 1)
+        {
+            product ^= a;
+        }
+        a = (a << 1) ^ ((a & 0x80) ? 0x1D : 0);
+        b >>= 1;
+    }
+    return product;
+}
+
+static uint8_t refInv(uint8_t a)
+{
+    for (uint16_t x = 1; x < 256; x++)
+    {
+        if (refMul(a, x) == 1)
+        {
+            return x;
+        }
+    }
+    return 0;
+}
+
+static uint8_t data[FEC_GROUP_SIZE][CHUNK_SIZE];
+static uint8_t parity[FEC_MAX_PARITY][CHUNK_SIZE];
+
+/* The last chunk of the group is lastLen long, the rest of it stays zero */
+static void encodeGroup(uint8_t groupSize, size_t lastLen)
+{
+    FecEncoder fec;
+    Message frame;
+    memset(data, 0, sizeof(data));
+    for (uint8_t i = 0; i < groupSize; i++)
+    {
+        size_t len = (i == groupSize - 1) ? lastLen : CHUNK_SIZE;
+        for (size_t b = 0; b < len; b++)
+        {
+            data[i][b] = esp_random();
+        }
+    }
+    data[0][0] = 0;
+    data[0][1] = 255;
+
+    TEST_ASSERT_TRUE(fec.Begin(FEC_MAX_PARITY, CHUNK_SIZE));
+    for (uint8_t i = 0; i < groupSize; i++)
+    {
+        fec.Add(i * CHUNK_SIZE, data[i], (i == groupSize - 1) ? lastLen : CHUNK_SIZE);
+    }
+    for (uint8_t j = 0; j < FEC_MAX_PARITY; j++)
+    {
+        fec.FillParity(&frame, j, groupSize * CHUNK_SIZE, MSG_BYTE_STREAM);
+        FecParityPayload *payload = (FecParityPayload *)frame.payload;
+        TEST_ASSERT_EQUAL(MSG_FEC_PARITY, frame.messageType);
+        TEST_ASSERT_EQUAL(groupSize, payload->groupSize);
+        TEST_ASSERT_EQUAL(j, payload->parityIdx);
+        memcpy(parity[j], payload->data, CHUNK_SIZE);
+    }
+}
+
+void setUp(void)
+{
+}
+
+void tearDown(void)
+{
+}
+
+void test_parity_matches_reference(void)
+{
+    for (uint8_t groupSize = 1; groupSize <= FEC_GROUP_SIZE; groupSize++)
+    {
+        encodeGroup(groupSize, CHUNK_SIZE - groupSize);
+        for (uint8_t j = 0; j < FEC_MAX_PARITY; j++)
+        {
+            uint8_t expected[CHUNK_SIZE] = {0};
+            for (uint8_t i = 0; i < groupSize; i++)
+            {
+                uint8_t coef = refInv(j ^ (FEC_MAX_PARITY + i));
+                for (size_t b = 0; b < CHUNK_SIZE; b++)
+                {
+                    expected[b] ^= refMul(coef, data[i][b]);
+                }
+            }
+            TEST_ASSERT_EQUAL_MEMORY(expected, parity[j], CHUNK_SIZE);
+        }
+    }
+}
+
+/* Every set of up to FEC_MAX_PARITY lost chunks with every choice of the parity that arrived */
+void test_recover_all_patterns(void)
+{
+    encodeGroup(FEC_GROUP_SIZE, 17);
+    uint8_t original[FEC_GROUP_SIZE][CHUNK_SIZE];
+    memcpy(original, data, sizeof(data));
+
+    for (uint16_t lostMask = 1; lostMask < (1 << FEC_GROUP_SIZE); lostMask++)
+    {
+        uint8_t nmrLost = __builtin_popcount(lostMask);
+        if (nmrLost > FEC_MAX_PARITY)
+        {
+            continue;
+        }
+        for (uint8_t parityMask = 0; parityMask < (1 << FEC_MAX_PARITY); parityMask++)
+        {
+            uint8_t *chunks[FEC_GROUP_SIZE];
+            bool lost[FEC_GROUP_SIZE];
+            const uint8_t *received[FEC_MAX_PARITY];
+            for (uint8_t i = 0; i < FEC_GROUP_SIZE; i++)
+            {
+                lost[i] = lostMask & (1 << i);
+                chunks[i] = data[i];
+                if (lost[i])
+                {
+                    memset(data[i], 0xA5, CHUNK_SIZE);
+                }
+            }
+            for (uint8_t j = 0; j < FEC_MAX_PARITY; j++)
+            {
+                received[j] = (parityMask & (1 << j)) ? parity[j] : NULL;
+            }
+
+            bool recovered = FecDecoder::Recover(chunks, lost, FEC_GROUP_SIZE, received, CHUNK_SIZE);
+            TEST_ASSERT_EQUAL(__builtin_popcount(parityMask) >= nmrLost, recovered);
+            if (recovered)
+            {
+                TEST_ASSERT_EQUAL_MEMORY(original, data, sizeof(data));
+            }
+            memcpy(data, original, sizeof(data));
+        }
+    }
+}
+
+void test_recover_too_many_lost(void)
+{
+    encodeGroup(FEC_GROUP_SIZE, CHUNK_SIZE);
+    uint8_t *chunks[FEC_GROUP_SIZE];
+    bool lost[FEC_GROUP_SIZE];
+    const uint8_t *received[FEC_MAX_PARITY];
+    for (uint8_t i = 0; i < FEC_GROUP_SIZE; i++)
+    {
+        chunks[i] = data[i];
+        lost[i] = i <= FEC_MAX_PARITY;
+    }
+    for (uint8_t j = 0; j < FEC_MAX_PARITY; j++)
+    {
+        received[j] = parity[j];
+    }
+    TEST_ASSERT_FALSE(FecDecoder::Recover(chunks, lost, FEC_GROUP_SIZE, received, CHUNK_SIZE));
+}
+
+/* Parity of whole groups of the largest chunks, against the airtime of the group */
+void test_encode_benchmark(void)
+{
+    static uint8_t chunk[MAX_DATA_SIZE];
+    for (size_t b = 0; b < sizeof(chunk); b++)
+    {
+        chunk[b] = esp_random();
+    }
+    Message frame;
+    uint32_t airtime_us = FEC_GROUP_SIZE * sizeof(chunk) * 8 / 54;
+
+    for (uint8_t nmrParity = 1; nmrParity <= FEC_MAX_PARITY; nmrParity++)
+    {
+        FecEncoder fec;
+        TEST_ASSERT_TRUE(fec.Begin(nmrParity, sizeof(chunk)));
+        uint32_t start = micros();
+        for (uint32_t round = 0; round < BENCH_ROUNDS; round++)
+        {
+            for (uint8_t i = 0; i < FEC_GROUP_SIZE; i++)
+            {
+                fec.Add(i * sizeof(chunk), chunk, sizeof(chunk));
+            }
+            for (uint8_t j = 0; j < nmrParity; j++)
+            {
+                fec.FillParity(&frame, j, FEC_GROUP_SIZE * sizeof(chunk), MSG_BYTE_STREAM);
+            }
+            fec.NextGroup();
+        }
+        uint32_t elapsed = micros() - start;
+
+        char msgText[96];
+        snprintf(msgText, sizeof(msgText), "parity %u: %u ns per group of %u B, %u us on air at 54 Mbps",
+                 nmrParity, (unsigned)(elapsed * 1000ULL / BENCH_ROUNDS), (unsigned)(FEC_GROUP_SIZE * sizeof(chunk)), (unsigned)airtime_us);
+        TEST_MESSAGE(msgText);
+    }
+}
+
+int main(int argc, char **argv)
+{
+    UNITY_BEGIN();
+    RUN_TEST(test_parity_matches_reference);
+    RUN_TEST(test_recover_all_patterns);
+    RUN_TEST(test_recover_too_many_lost);
+    RUN_TEST(test_encode_benchmark);
+    return UNITY_END();
+}
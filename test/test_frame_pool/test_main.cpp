@@ -0,0 +1,139 @@
+/***********************************************************************
+ * Filename: test_main.cpp
+ * Author: Pavel Kejik
+ * Date: 2024-04-12
+ * Description:
+ *     TX frame pool of ESPNowCtrl: borrowing, returning and filling
+ *     stream chunks in place, and the framing cost per chunk against
+ *     the former path through a stack payload and a stack Message.
+ *
+ ***********************************************************************/
+
+#include <unity.h>
+#include "esp_now_ctrl.h"
+
+#define IMAGE_LEN 40000
+#define BENCH_ROUNDS 50
+
+static uint8_t image[IMAGE_LEN];
+static volatile uint8_t sink;
+
+void setUp(void)
+{
+}
+
+void tearDown(void)
+{
+}
+
+void test_pool_exhaustion(void)
+{
+    Message *frames[TX_POOL_SIZE];
+    for (uint8_t i = 0; i < TX_POOL_SIZE; i++)
+    {
+        frames[i] = ESPNowCtrl::BorrowFrame(MSG_BYTE_STREAM, 0);
+        TEST_ASSERT_NOT_NULL(frames[i]);
+        TEST_ASSERT_EQUAL(MSG_BYTE_STREAM, frames[i]->messageType);
+        for (uint8_t j = 0; j < i; j++)
+        {
+            TEST_ASSERT_TRUE(frames[i] != frames[j]);
+        }
+    }
+    TEST_ASSERT_NULL(ESPNowCtrl::BorrowFrame(MSG_BYTE_STREAM, 10));
+
+    ESPNowCtrl::ReturnFrame(frames[3]);
+    TEST_ASSERT_TRUE(ESPNowCtrl::BorrowFrame(MSG_BYTE_STREAM, 0) == frames[3]);
+    for (uint8_t i = 0; i < TX_POOL_SIZE; i++)
+    {
+        ESPNowCtrl::ReturnFrame(frames[i]);
+    }
+}
+
+/* Chunks are copied straight from the image into the frame, the last one is shorter */
+void test_fill_in_place(void)
+{
+    size_t chunkSize = ESPNowCtrl::GetDataChunkSize();
+    Message *frame = ESPNowCtrl::BorrowFrame(MSG_BYTE_STREAM, 0);
+    TEST_ASSERT_NOT_NULL(frame);
+    const ByteStreamPayload *payload = (const ByteStreamPayload *)frame->payload;
+    size_t lastIndex = IMAGE_LEN - IMAGE_LEN % chunkSize;
+
+    ESPNowCtrl::FillByteStreamFrame(frame, image, IMAGE_LEN, chunkSize, chunkSize, 0x21);
+    TEST_ASSERT_EQUAL(MSG_BYTE_STREAM, frame->messageType);
+    TEST_ASSERT_EQUAL(offsetof(ByteStreamPayload, data.data) + chunkSize, GetPayloadSize(frame));
+    TEST_ASSERT_EQUAL(IMAGE_LEN, payload->max_mr_bytes);
+    TEST_ASSERT_EQUAL(0x21, payload->type);
+    TEST_ASSERT_EQUAL(chunkSize, payload->data.index);
+    TEST_ASSERT_EQUAL_MEMORY(image + chunkSize, payload->data.data, chunkSize);
+
+    ESPNowCtrl::FillByteStreamFrame(frame, image, IMAGE_LEN, lastIndex, chunkSize, 0x21);
+    TEST_ASSERT_EQUAL(offsetof(ByteStreamPayload, data.data) + IMAGE_LEN % chunkSize, GetPayloadSize(frame));
+    TEST_ASSERT_EQUAL(IMAGE_LEN % chunkSize, payload->data.nmr);
+    TEST_ASSERT_EQUAL_MEMORY(image + lastIndex, payload->data.data, IMAGE_LEN % chunkSize);
+    ESPNowCtrl::ReturnFrame(frame);
+}
+
+/* Framing of a whole image, the former path cleared the stack payload for every
+   chunk and copied it again into a stack Message for esp_now_send */
+void test_framing_benchmark(void)
+{
+    size_t chunkSize = ESPNowCtrl::GetDataChunkSize();
+    uint32_t nmrChunks = BENCH_ROUNDS * ((IMAGE_LEN + chunkSize - 1) / chunkSize);
+    ByteStreamPayload payload;
+    Message msg;
+
+    uint32_t start = micros();
+    for (uint32_t round = 0; round < BENCH_ROUNDS; round++)
+    {
+        memset(&payload, 0, sizeof(payload));
+        payload.max_mr_bytes = IMAGE_LEN;
+        for (size_t index = 0; index < IMAGE_LEN; index += chunkSize)
+        {
+            size_t bytesToCopy = min(chunkSize, (size_t)(IMAGE_LEN - index));
+            memset(&payload.data, 0, sizeof(payload.data));
+            payload.data.index = index;
+            memcpy(payload.data.data, image + index, bytesToCopy);
+            payload.data.nmr = bytesToCopy;
+
+            msg.messageType = MSG_BYTE_STREAM;
+            SetPayloadSize(&msg, offsetof(ByteStreamPayload, data.data) + bytesToCopy);
+            memcpy(msg.payload, &payload, offsetof(ByteStreamPayload, data.data) + bytesToCopy);
+            sink = msg.payload[bytesToCopy];
+        }
+    }
+    uint32_t copyPath = micros() - start;
+
+    Message *frame = ESPNowCtrl::BorrowFrame(MSG_BYTE_STREAM, 0);
+    TEST_ASSERT_NOT_NULL(frame);
+    start = micros();
+    for (uint32_t round = 0; round < BENCH_ROUNDS; round++)
+    {
+        for (size_t index = 0; index < IMAGE_LEN; index += chunkSize)
+        {
+            ESPNowCtrl::FillByteStreamFrame(frame, image, IMAGE_LEN, index, chunkSize, 0);
+            sink = frame->payload[GetPayloadSize(frame) - 1];
+        }
+    }
+    uint32_t poolPath = micros() - start;
+    ESPNowCtrl::ReturnFrame(frame);
+
+    char msgText[96];
+    snprintf(msgText, sizeof(msgText), "per chunk: stack copies %u ns, pool frame %u ns",
+             (unsigned)(copyPath * 1000ULL / nmrChunks), (unsigned)(poolPath * 1000ULL / nmrChunks));
+    TEST_MESSAGE(msgText);
+}
+
+int main(int argc, char **argv)
+{
+    for (uint32_t i = 0; i < IMAGE_LEN; i++)
+    {
+        image[i] = esp_random();
+    }
+    ESPNowCtrl::Init();
+
+    UNITY_BEGIN();
+    RUN_TEST(test_pool_exhaustion);
+    RUN_TEST(test_fill_in_place);
+    RUN_TEST(test_framing_benchmark);
+    return UNITY_END();
+}
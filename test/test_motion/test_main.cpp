@@ -0,0 +1,174 @@
+/***********************************************************************
+ * Filename: test_main.cpp
+ * Author: Pavel Kejik
+ * Date: 2024-04-12
+ * Description:
+ *     MotionGate::ChangedBlocks, which sums the differences of four
+ *     pixels per word, against a plain per-pixel sum of absolute
+ *     differences. Covers every pair of pixel values, random probes
+ *     and the 0/255 extremes. The benchmark reports the time per probe
+ *     of both.
+ *
+ ***********************************************************************/
+
+#include <unity.h>
+#include "motion.h"
+
+#define BLOCKS_X (MOTION_PROBE_W / MOTION_BLOCK)
+#define BENCH_ROUNDS 2000
+
+static uint32_t probe[MOTION_PROBE_WORDS];
+static uint32_t ref[MOTION_PROBE_WORDS];
+static volatile uint16_t sink;
+
+static uint32_t blockSad(uint8_t block)
+{
+    const uint8_t *a = (const uint8_t *)probe;
+    const uint8_t *b = (const uint8_t *)ref;
+    uint16_t x0 = (block % BLOCKS_X) * MOTION_BLOCK;
+    uint16_t y0 = (block / BLOCKS_X) * MOTION_BLOCK;
+    uint32_t sad = 0;
+    for (uint16_t y = y0; y < y0 + MOTION_BLOCK; y++)
+    {
+        for (uint16_t x = x0; x < x0 + MOTION_BLOCK; x++)
+        {
+            sad += abs(a[y * MOTION_PROBE_W + x] - b[y * MOTION_PROBE_W + x]);
+        }
+    }
+    return sad;
+}
+
+static uint16_t referenceChanged(uint8_t threshold)
+{
+    uint16_t changed = 0;
+    for (uint8_t block = 0; block < MOTION_BLOCKS; block++)
+    {
+        if (blockSad(block) > (uint32_t)threshold * MOTION_BLOCK * MOTION_BLOCK)
+        {
+            changed++;
+        }
+    }
+    return changed;
+}
+
+static void checkAllThresholds(void)
+{
+    for (uint16_t threshold = 0; threshold <= UINT8_MAX; threshold++)
+    {
+        TEST_ASSERT_EQUAL(referenceChanged(threshold), MotionGate::ChangedBlocks(probe, ref, threshold));
+    }
+}
+
+void setUp(void)
+{
+}
+
+void tearDown(void)
+{
+}
+
+/* A block of equal pairs is changed exactly when |a - b| exceeds the threshold */
+void test_every_pixel_pair(void)
+{
+    for (uint16_t a = 0; a <= UINT8_MAX; a++)
+    {
+        for (uint16_t b = 0; b <= UINT8_MAX; b++)
+        {
+            memset(probe, a, sizeof(probe));
+            memset(ref, b, sizeof(ref));
+            uint8_t diff = abs(a - b);
+            if (diff > 0)
+            {
+                TEST_ASSERT_EQUAL(MOTION_BLOCKS, MotionGate::ChangedBlocks(probe, ref, diff - 1));
+            }
+            TEST_ASSERT_EQUAL(0, MotionGate::ChangedBlocks(probe, ref, diff));
+        }
+    }
+}
+
+void test_random_probes(void)
+{
+    randomSeed(1);
+    for (int run = 0; run < 50; run++)
+    {
+        uint8_t *a = (uint8_t *)probe;
+        uint8_t *b = (uint8_t *)ref;
+        /* Small changes on top of the same picture, as between two wakes */
+        uint8_t spread = (run % 2) ? 255 : 32;
+        for (size_t i = 0; i < sizeof(probe); i++)
+        {
+            a[i] = random(256);
+            b[i] = constrain(a[i] + random(-spread, spread + 1), 0, 255);
+        }
+        checkAllThresholds();
+    }
+}
+
+/* Full swing in every pixel, in both directions and mixed within words */
+void test_extremes(void)
+{
+    uint8_t *a = (uint8_t *)probe;
+    uint8_t *b = (uint8_t *)ref;
+    for (size_t i = 0; i < sizeof(probe); i++)
+    {
+        a[i] = (i % 2) ? 255 : 0;
+        b[i] = 255 - a[i];
+    }
+    checkAllThresholds();
+    TEST_ASSERT_EQUAL(MOTION_BLOCKS, MotionGate::ChangedBlocks(probe, ref, 254));
+    TEST_ASSERT_EQUAL(0, MotionGate::ChangedBlocks(probe, ref, 255));
+
+    randomSeed(2);
+    for (size_t i = 0; i < sizeof(probe); i++)
+    {
+        a[i] = random(2) ? 255 : 0;
+        b[i] = random(2) ? 255 : 0;
+    }
+    checkAllThresholds();
+
+    memset(probe, 0x5A, sizeof(probe));
+    memcpy(ref, probe, sizeof(ref));
+    TEST_ASSERT_EQUAL(0, MotionGate::ChangedBlocks(probe, ref, 0));
+}
+
+/* Comparison of one probe, word-wise in MotionGate against the per-pixel sum */
+void test_swar_benchmark(void)
+{
+    randomSeed(3);
+    uint8_t *a = (uint8_t *)probe;
+    uint8_t *b = (uint8_t *)ref;
+    for (size_t i = 0; i < sizeof(probe); i++)
+    {
+        a[i] = random(256);
+        b[i] = constrain(a[i] + random(-32, 33), 0, 255);
+    }
+
+    uint32_t start = micros();
+    for (uint32_t round = 0; round < BENCH_ROUNDS; round++)
+    {
+        sink = referenceChanged(round % 32);
+    }
+    uint32_t scalarPath = micros() - start;
+
+    start = micros();
+    for (uint32_t round = 0; round < BENCH_ROUNDS; round++)
+    {
+        sink = MotionGate::ChangedBlocks(probe, ref, round % 32);
+    }
+    uint32_t swarPath = micros() - start;
+
+    char msgText[96];
+    snprintf(msgText, sizeof(msgText), "per probe: per-pixel %u ns, four pixels per word %u ns",
+             (unsigned)(scalarPath * 1000ULL / BENCH_ROUNDS), (unsigned)(swarPath * 1000ULL / BENCH_ROUNDS));
+    TEST_MESSAGE(msgText);
+}
+
+int main(int argc, char **argv)
+{
+    UNITY_BEGIN();
+    RUN_TEST(test_every_pixel_pair);
+    RUN_TEST(test_random_probes);
+    RUN_TEST(test_extremes);
+    RUN_TEST(test_swar_benchmark);
+    return UNITY_END();
+}
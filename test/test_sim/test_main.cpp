@@ -0,0 +1,391 @@
+/***********************************************************************
+ * Filename: test_main.cpp
+ * Author: Pavel Kejik
+ * Date: 2024-04-12
+ * Description:
+ *     Byte streams over the simulated channel with loss. The default
+ *     gateway must end up with exactly the data that was sent, lost
+ *     frames are rebuilt from FEC parity or resent after its NACK.
+ *     The window benchmark reports the time per image against the
+ *     number of chunks in flight, the loss sweep the cost and gain of
+ *     FEC over a range of loss. The TX power has to follow the RSSI
+ *     from one wake to the next.
+ *
+ ***********************************************************************/
+
+#include <unity.h>
+#include "esp_now_ctrl.h"
+#include "transport_sim.h"
+#include "parameters.h"
+
+#define SWEEP_ATTEMPTS 3
+
+static const uint8_t gatewayMac[6] = {0x02, 0x00, 0x00, 0x00, 0x00, 0x01};
+static const uint32_t capabilities = CAP_LARGE_FRAMES | CAP_FEC | CAP_SEQUENCE | CAP_STREAM_MUX | CAP_STREAM_ACK;
+
+static void onDataReceived(const uint8_t *mac_addr, const Message *msg, int len)
+{
+    if (msg->messageType == MSG_ACK || msg->messageType == MSG_NACK)
+    {
+        ESPNowCtrl::PutStreamFeedback(msg);
+    }
+}
+
+static void rxTask(void *arg)
+{
+    while (true)
+    {
+        ESPNowCtrl::Task();
+    }
+}
+
+static const SimChannel_t defaultModel = simTransport.GetChannelModel();
+
+static void setChannel(uint16_t lossPermille, uint16_t dropPermille)
+{
+    SimChannel_t model = simTransport.GetChannelModel();
+    model.lossPermille = lossPermille;
+    model.dropPermille = dropPermille;
+    simTransport.SetChannelModel(model);
+}
+
+/* Returns how long the stream took in ms. A stream given up is continued from
+   its offset up to attempts times, as ESPNowClient::SendStream does. */
+static uint32_t sendStream(uint32_t len, uint8_t window = STREAM_WINDOW_SIZE, uint8_t attempts = 1)
+{
+    uint8_t *data = (uint8_t *)malloc(len);
+    TEST_ASSERT_NOT_NULL(data);
+    for (uint32_t i = 0; i < len; i++)
+    {
+        data[i] = esp_random();
+    }
+
+    uint8_t stream = ESPNowCtrl::OpenStream(STREAM_TYPE_IMAGE);
+    TEST_ASSERT_NOT_EQUAL(STREAM_NONE, stream);
+    uint8_t tag = ESPNowCtrl::GetStreamTag(stream);
+    size_t offset = 0;
+    uint32_t start = millis();
+    bool sent = false;
+    for (uint8_t i = 0; i < attempts && !sent; i++)
+    {
+        sent = ESPNowCtrl::SendStreamData(stream, gatewayMac, data, len, offset, window);
+    }
+    uint32_t elapsed = millis() - start;
+    ESPNowCtrl::CloseStream(stream);
+
+    TEST_ASSERT_TRUE(sent);
+    TEST_ASSERT_EQUAL_UINT32(len, offset);
+    const uint8_t *received = SimGatewayStreamData(tag, len);
+    TEST_ASSERT_NOT_NULL(received);
+    TEST_ASSERT_EQUAL_MEMORY(data, received, len);
+    free(data);
+    return elapsed;
+}
+
+void setUp(void)
+{
+    SimGatewayReset();
+    simTransport.ResetStats();
+}
+
+void tearDown(void)
+{
+    simTransport.SetChannelModel(defaultModel);
+    EspNowSchopnosti.Set(capabilities);
+}
+
+void test_stream_lossless(void)
+{
+    sendStream(10000);
+    TEST_ASSERT_EQUAL_UINT32(1, SimGatewayGetStats().streamsDone);
+    TEST_ASSERT_EQUAL_UINT32(0, SimGatewayGetStats().nacks);
+}
+
+/* The first stream measures the loss, FEC is used from then on */
+void test_stream_loss_fec(void)
+{
+    setChannel(100, 0);
+    for (uint8_t i = 0; i < 4; i++)
+    {
+        sendStream(20000 + i * 777);
+    }
+    TEST_ASSERT_GREATER_THAN_UINT32(0, simTransport.GetStats().lostUp);
+    TEST_ASSERT_GREATER_THAN_UINT32(0, SimGatewayGetStats().fecRecovered);
+    TEST_ASSERT_EQUAL_UINT32(4, SimGatewayGetStats().streamsDone);
+}
+
+/* Dropped frames were acknowledged on MAC level, without FEC only the NACK brings them back */
+void test_stream_drop_nack(void)
+{
+    EspNowSchopnosti.Set(capabilities & ~CAP_FEC);
+    setChannel(20, 50);
+    sendStream(30000);
+    TEST_ASSERT_GREATER_THAN_UINT32(0, simTransport.GetStats().dropped);
+    TEST_ASSERT_GREATER_THAN_UINT32(0, SimGatewayGetStats().nacks);
+}
+
+static uint32_t submitDone(Message *frame)
+{
+    memset(frame, 0, sizeof(Message));
+    frame->messageType = MSG_TRANSMIT_DONE;
+    SetPayloadSize(frame, 0);
+    return ESPNowCtrl::SubmitFrame(gatewayMac, frame);
+}
+
+/* A status arriving after its frame timed out belongs to that frame, the next
+   frame waits for its own */
+void test_late_status(void)
+{
+    Message first;
+    Message second;
+    Message third;
+    simTransport.DelayNextStatus(100);
+    uint32_t seq = submitDone(&first);
+    TEST_ASSERT_NOT_EQUAL(0, seq);
+    TEST_ASSERT_FALSE(ESPNowCtrl::WaitFrameDone(seq, 20));
+
+    /* The late success of the first frame must not be taken for the lost second one */
+    setChannel(1000, 0);
+    seq = submitDone(&second);
+    TEST_ASSERT_NOT_EQUAL(0, seq);
+    TEST_ASSERT_FALSE(ESPNowCtrl::WaitFrameDone(seq, 500));
+
+    setChannel(0, 0);
+    seq = submitDone(&third);
+    TEST_ASSERT_NOT_EQUAL(0, seq);
+    TEST_ASSERT_TRUE(ESPNowCtrl::WaitFrameDone(seq, 500));
+}
+
+/* Reference receiver for the NACK test: the chunks in refLost are discarded
+   the first time they arrive, the end of the stream is answered with the
+   bitmap of the missing chunks and the complete stream with MSG_ACK */
+#define REF_LEN 20000
+static const uint32_t refLost[] = {0, 3, 10, 11, 40, 84};
+static uint8_t refData[REF_LEN];
+static uint8_t refArrivals[REF_LEN / 100];
+static bool refStored[REF_LEN / 100];
+
+static bool refIsLost(uint32_t chunk)
+{
+    for (uint8_t i = 0; i < sizeof(refLost) / sizeof(refLost[0]); i++)
+    {
+        if (refLost[i] == chunk)
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+static void referenceReceiver(SimTransport *sim, const uint8_t *mac_addr, const Message *msg, int len)
+{
+    if (msg->messageType != MSG_BYTE_STREAM)
+    {
+        return;
+    }
+    const ByteStreamPayload *payload = (const ByteStreamPayload *)msg->payload;
+    size_t chunkSize = ESPNowCtrl::GetDataChunkSize();
+    size_t nmr = GetPayloadSize(msg) - offsetof(ByteStreamPayload, data.data);
+    uint32_t nmrChunks = (REF_LEN + chunkSize - 1) / chunkSize;
+    uint32_t chunk = payload->data.index / chunkSize;
+    if (payload->max_mr_bytes != REF_LEN || chunk >= nmrChunks)
+    {
+        return;
+    }
+
+    if (refArrivals[chunk]++ > 0 || !refIsLost(chunk))
+    {
+        memcpy(refData + payload->data.index, payload->data.data, nmr);
+        refStored[chunk] = true;
+    }
+
+    uint32_t missing = 0;
+    while (missing < nmrChunks && refStored[missing])
+    {
+        missing++;
+    }
+    if (missing < nmrChunks && payload->data.index + nmr < REF_LEN)
+    {
+        return;
+    }
+    uint8_t reply[1 + sizeof(StreamAckPayload)];
+    StreamAckPayload ack;
+    memset(&ack, 0, sizeof(ack));
+    ack.max_mr_bytes = REF_LEN;
+    ack.index = min((size_t)REF_LEN, missing * chunkSize);
+    ack.chunkSize = chunkSize;
+    for (uint32_t bit = 0; missing + bit < nmrChunks; bit++)
+    {
+        ack.bitmap[bit / 8] |= refStored[missing + bit] ? 0 : (1 << (bit % 8));
+    }
+    reply[0] = payload->type;
+    memcpy(&reply[1], &ack, offsetof(StreamAckPayload, bitmap) + (nmrChunks - missing + 7) / 8);
+    sim->Reply((missing < nmrChunks) ? MSG_NACK : MSG_ACK, reply, 1 + offsetof(StreamAckPayload, bitmap) + (nmrChunks - missing + 7) / 8);
+}
+
+/* Every chunk the receiver reports missing is resent exactly once and nothing
+   else is, not even the first chunk whose send status comes too late */
+void test_nack_selective_repeat(void)
+{
+    uint8_t *data = (uint8_t *)malloc(REF_LEN);
+    TEST_ASSERT_NOT_NULL(data);
+    for (uint32_t i = 0; i < REF_LEN; i++)
+    {
+        data[i] = esp_random();
+    }
+    memset(refArrivals, 0, sizeof(refArrivals));
+    memset(refStored, 0, sizeof(refStored));
+    EspNowSchopnosti.Set(capabilities & ~CAP_FEC);
+    simTransport.SetGateway(gatewayMac, referenceReceiver);
+    simTransport.DelayNextStatus(SEND_STATUS_TIMEOUT_MS + 100);
+
+    uint8_t stream = ESPNowCtrl::OpenStream(STREAM_TYPE_IMAGE);
+    size_t offset = 0;
+    bool sent = ESPNowCtrl::SendStreamData(stream, gatewayMac, data, REF_LEN, offset);
+    ESPNowCtrl::CloseStream(stream);
+    simTransport.SetGateway(gatewayMac, SimGatewayDefault);
+
+    TEST_ASSERT_TRUE(sent);
+    TEST_ASSERT_EQUAL_MEMORY(data, refData, REF_LEN);
+    uint32_t nmrChunks = (REF_LEN + ESPNowCtrl::GetDataChunkSize() - 1) / ESPNowCtrl::GetDataChunkSize();
+    for (uint32_t chunk = 0; chunk < nmrChunks; chunk++)
+    {
+        TEST_ASSERT_EQUAL_UINT8(refIsLost(chunk) ? 2 : 1, refArrivals[chunk]);
+    }
+    free(data);
+}
+
+/* Time per image and frame rate for several windows on a lossy link with latency,
+   a window of one is the stop-and-wait transfer */
+void test_window_benchmark(void)
+{
+    const uint8_t windows[] = {1, 2, 4, STREAM_MAX_WINDOW};
+    const uint32_t len = 20000;
+    uint32_t elapsed[sizeof(windows)];
+    SimChannel_t model = defaultModel;
+    model.lossPermille = 50;
+    model.latencyMs = 5;
+    simTransport.SetChannelModel(model);
+
+    for (uint8_t i = 0; i < sizeof(windows); i++)
+    {
+        simTransport.ResetStats();
+        elapsed[i] = max(1U, sendStream(len, windows[i]));
+        char msg[96];
+        snprintf(msg, sizeof(msg), "window %u: %u ms per image, %u frames/s, %u lost",
+                 windows[i], elapsed[i], simTransport.GetStats().framesUp * 1000 / elapsed[i], simTransport.GetStats().lostUp);
+        TEST_MESSAGE(msg);
+    }
+    TEST_ASSERT_LESS_THAN_UINT32(elapsed[0] / 2, elapsed[sizeof(windows) - 1]);
+}
+
+/* Time per image and frames sent with FEC off and on over a range of loss, the
+   first stream of each point lets the link measure its loss. Feedback is lost
+   as often as data, a stream may run out of ACK attempts and be resumed. */
+void test_fec_loss_sweep(void)
+{
+    const uint16_t losses[] = {0, 50, 100, 200};
+    SimChannel_t model = defaultModel;
+    model.latencyMs = 5;
+
+    for (uint8_t i = 0; i < sizeof(losses) / sizeof(losses[0]); i++)
+    {
+        uint32_t elapsed[2];
+        uint32_t frames[2];
+        uint32_t recovered[2];
+        model.lossPermille = losses[i];
+        simTransport.SetChannelModel(model);
+        for (uint8_t fec = 0; fec < 2; fec++)
+        {
+            EspNowSchopnosti.Set(fec ? capabilities : capabilities & ~CAP_FEC);
+            sendStream(20000, STREAM_WINDOW_SIZE, SWEEP_ATTEMPTS);
+            SimGatewayReset();
+            simTransport.ResetStats();
+            elapsed[fec] = sendStream(20000, STREAM_WINDOW_SIZE, SWEEP_ATTEMPTS);
+            frames[fec] = simTransport.GetStats().framesUp;
+            recovered[fec] = SimGatewayGetStats().fecRecovered;
+        }
+        char msg[128];
+        snprintf(msg, sizeof(msg), "loss %u: FEC off %u ms, %u frames; FEC on %u ms, %u frames, %u rebuilt",
+                 losses[i], elapsed[0], frames[0], elapsed[1], frames[1], recovered[1]);
+        TEST_MESSAGE(msg);
+        TEST_ASSERT_EQUAL_UINT32(0, recovered[0]);
+        if (losses[i] >= 100)
+        {
+            TEST_ASSERT_GREATER_THAN_UINT32(0, recovered[1]);
+        }
+    }
+}
+
+/* The rate controller settles on the fastest rate the channel carries, an image
+   then takes a fraction of the airtime it would at the robust 1 Mbps */
+void test_rate_adaptation(void)
+{
+    SimChannel_t model = defaultModel;
+    model.bandwidth_kbps = 0;
+    model.maxRate_kbps = 24000;
+    simTransport.SetChannelModel(model);
+    for (uint8_t i = 0; i < 3; i++)
+    {
+        sendStream(30000 + i);
+    }
+
+    simTransport.ResetStats();
+    sendStream(30000);
+    const SimStats_t &stats = simTransport.GetStats();
+    uint32_t robust_us = stats.bytesUp * 8;
+    char msg[96];
+    snprintf(msg, sizeof(msg), "bulk rate %u kbps, airtime %u us, at 1 Mbps %u us",
+             (unsigned)EspNowRychlostPhy_kbps.Get(), stats.airtime_us, robust_us);
+    TEST_MESSAGE(msg);
+    TEST_ASSERT_EQUAL_UINT16(24000, EspNowRychlostPhy_kbps.Get());
+    TEST_ASSERT_LESS_THAN_UINT32(robust_us / 4, stats.airtime_us);
+}
+
+/* Every wake measures the RSSI again and the TX power follows it, down while the
+   gateway is heard with margin and back up once a later wake finds it weaker */
+void test_power_follows_rssi(void)
+{
+    const int8_t rssi[] = {-50, -68, -50, -80};
+    const uint16_t power_dBm[] = {2, 17, 2, 19};
+    SimChannel_t model = defaultModel;
+
+    for (uint8_t wake = 0; wake < sizeof(rssi); wake++)
+    {
+        ESPNowCtrl::Deinit();
+        model.rssi = rssi[wake];
+        simTransport.SetChannelModel(model);
+        ESPNowCtrl::Init();
+        for (uint8_t i = 0; i < 10; i++)
+        {
+            sendStream(30000);
+        }
+        char msg[64];
+        snprintf(msg, sizeof(msg), "RSSI %d dBm: TX power %u dBm", rssi[wake], (unsigned)EspNowVykonTx_dBm.Get());
+        TEST_MESSAGE(msg);
+        TEST_ASSERT_EQUAL_UINT16(power_dBm[wake], EspNowVykonTx_dBm.Get());
+        TEST_ASSERT_EQUAL_INT16(rssi[wake], EspNowRssi_dBm.Get());
+    }
+}
+
+int main(int argc, char **argv)
+{
+    EspNowSchopnosti.Set(capabilities);
+    ESPNowCtrl::SetTransport(&simTransport);
+    ESPNowCtrl::SetDataReceivedCallback(onDataReceived);
+    ESPNowCtrl::Init();
+    ESPNowCtrl::AddPeer(gatewayMac, simTransport.GetChannelModel().gatewayChannel);
+    xTaskCreateUniversal(rxTask, "rxTask", 4096, NULL, 5, NULL, ARDUINO_RUNNING_CORE);
+
+    UNITY_BEGIN();
+    RUN_TEST(test_stream_lossless);
+    RUN_TEST(test_stream_loss_fec);
+    RUN_TEST(test_stream_drop_nack);
+    RUN_TEST(test_late_status);
+    RUN_TEST(test_nack_selective_repeat);
+    RUN_TEST(test_window_benchmark);
+    RUN_TEST(test_fec_loss_sweep);
+    RUN_TEST(test_rate_adaptation);
+    RUN_TEST(test_power_follows_rssi);
+    return UNITY_END();
+}